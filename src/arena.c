@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+/**
+ * Memory an arena hands out, from data[0] up to data[used]. Every allocation
+ * is preceded by a header holding its size
+ */
+typedef struct arenaBlock {
+    struct arenaBlock *previous;  // block that was current before this one
+    size_t size;                  // bytes in data
+    size_t used;                  // bytes of data handed out
+    _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+} arenaBlock;
+
+struct arena {
+    arenaBlock *current;  // block allocations come from, newest first
+    size_t blockSize;     // size of the first block
+};
+
+#define HEADER_SIZE ARENA_ALIGNMENT  // bytes before every allocation
+
+static __thread arena *localArena = NULL;
+static pthread_key_t arenaKey;
+static pthread_once_t arenaKeyOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Returns size rounded up to a multiple of ARENA_ALIGNMENT
+ */
+static size_t alignSize(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+/**
+ * Returns the size stored in the header of allocation ptr
+ */
+static size_t allocationSize(void *ptr) {
+    return *(size_t*)((unsigned char*)ptr - HEADER_SIZE);
+}
+
+/**
+ * Adds a block of at least size bytes to arena, making it current.
+ * Returns 0 on success and 1 otherwise
+ */
+static int addBlock(arena *a, size_t size) {
+    size_t blockSize = a->current ? 2*a->current->size : a->blockSize;
+    if (blockSize < size) {
+        blockSize = size;
+    }
+    arenaBlock *block = malloc(sizeof(arenaBlock) + blockSize);
+    if (block == NULL) {
+        return 1;
+    }
+    block->previous = a->current;
+    block->size = blockSize;
+    block->used = 0;
+    a->current = block;
+    return 0;
+}
+
+arena* arenaInit(size_t blockSize) {
+    arena *a = malloc(sizeof(arena));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->current = NULL;
+    a->blockSize = alignSize(blockSize);
+    return a;
+}
+
+/**
+ * Frees every block of arena
+ */
+static void freeBlocks(arena *a) {
+    while (a->current != NULL) {
+        arenaBlock *previous = a->current->previous;
+        free(a->current);
+        a->current = previous;
+    }
+}
+
+void destroyArena(arena *a) {
+    if (a == NULL) {
+        return;
+    }
+    freeBlocks(a);
+    free(a);
+}
+
+void* arenaAlloc(arena *a, size_t size) {
+    size_t needed = HEADER_SIZE + alignSize(size);
+    if ((a->current == NULL ||
+         a->current->size - a->current->used < needed) &&
+        addBlock(a, needed)) {
+        return NULL;
+    }
+    unsigned char *header = &a->current->data[a->current->used];
+    *(size_t*)header = alignSize(size);
+    a->current->used += needed;
+    return header + HEADER_SIZE;
+}
+
+void* arenaCalloc(arena *a, size_t size) {
+    void *ptr = arenaAlloc(a, size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+/**
+ * Returns 1 if ptr is the latest allocation of block and 0 otherwise
+ */
+static int isLatest(arenaBlock *block, void *ptr) {
+    unsigned char *bytes = ptr;
+    return bytes > block->data && bytes <= &block->data[block->used] &&
+           (size_t)(bytes - block->data) + allocationSize(ptr) == block->used;
+}
+
+/**
+ * Copies the size bytes at ptr into a new allocation of newSize bytes and
+ * returns it, or NULL on failiure. The old space is only given back when the
+ * arena is reset
+ */
+static void* moveAllocation(arena *a, void *ptr, size_t size, size_t newSize) {
+    void *moved = arenaAlloc(a, newSize);
+    if (moved != NULL) {
+        memcpy(moved, ptr, size);
+    }
+    return moved;
+}
+
+void* arenaRealloc(arena *a, void *ptr, size_t size, size_t newSize) {
+    if (alignSize(newSize) <= allocationSize(ptr)) {
+        return ptr;
+    }
+    arenaBlock *block = a->current;
+    size_t growth = alignSize(newSize) - allocationSize(ptr);
+    if (block != NULL && isLatest(block, ptr)) {
+        if (block->size - block->used < growth) {
+            if ((unsigned char*)ptr != &block->data[HEADER_SIZE]) {
+                return moveAllocation(a, ptr, size, newSize);
+            }
+            // ptr has its block to itself, so the block can grow instead
+            block = realloc(block, sizeof(arenaBlock) + block->used + growth);
+            if (block == NULL) {
+                return NULL;
+            }
+            block->size = block->used + growth;
+            a->current = block;
+            ptr = &block->data[HEADER_SIZE];
+        }
+        block->used += growth;
+        *(size_t*)((unsigned char*)ptr - HEADER_SIZE) = alignSize(newSize);
+        return ptr;
+    }
+    return moveAllocation(a, ptr, size, newSize);
+}
+
+void arenaRelease(arena *a, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    // Blocks newer than the one holding ptr must be empty for it to be latest
+    for (arenaBlock *block = a->current; block != NULL;
+         block = block->previous) {
+        unsigned char *bytes = ptr;
+        if (bytes > block->data && bytes <= &block->data[block->used]) {
+            if (isLatest(block, ptr)) {
+                block->used -= HEADER_SIZE + allocationSize(ptr);
+            }
+            return;
+        }
+        if (block->used != 0) {
+            return;
+        }
+    }
+}
+
+void arenaReset(arena *a) {
+    if (a->current == NULL) {
+        return;
+    }
+    if (a->current->previous == NULL && a->current->size <= ARENA_KEEP_LIMIT) {
+        a->current->used = 0;
+        return;
+    }
+    // Merge the blocks into one big enough for a job like the last one
+    size_t total = 0;
+    for (arenaBlock *block = a->current; block != NULL;
+         block = block->previous) {
+        total += block->size;
+    }
+    freeBlocks(a);
+    addBlock(a, total < ARENA_KEEP_LIMIT ? total : ARENA_KEEP_LIMIT);
+}
+
+/**
+ * Destructor of arenaKey: frees the arena of a thread that exits
+ */
+static void destroyThreadArena(void *a) {
+    destroyArena(a);
+}
+
+/**
+ * Creates arenaKey, run once per process
+ */
+static void createArenaKey() {
+    pthread_key_create(&arenaKey, destroyThreadArena);
+}
+
+arena* threadArena() {
+    if (localArena == NULL) {
+        pthread_once(&arenaKeyOnce, createArenaKey);
+        localArena = arenaInit(ARENA_BLOCK_SIZE);
+        pthread_setspecific(arenaKey, localArena);
+    }
+    return localArena;
+}
+
+void resetThreadArena() {
+    if (localArena != NULL) {
+        arenaReset(localArena);
+    }
+}
+
+void releaseThreadArena() {
+    if (localArena != NULL) {
+        pthread_setspecific(arenaKey, NULL);
+        destroyArena(localArena);
+        localArena = NULL;
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef __CSTEG_ARENA__
+#define __CSTEG_ARENA__
+#include <stddef.h>
+
+/*
+ * Region allocator: allocations are carved out of large blocks and freed all
+ * at once by resetting or destroying their arena, so short lived data costs
+ * no malloc() or free() per object. The most recent allocations may also be
+ * released in the reverse order they were made, which lets a job reuse the
+ * memory of a scan it is done with for the next one.
+ */
+typedef struct arena arena;
+
+#define ARENA_BLOCK_SIZE 65536         // first block of a thread arena
+#define ARENA_KEEP_LIMIT (64UL << 20)  // most bytes kept across resets
+#define ARENA_ALIGNMENT 16             // alignment of every allocation
+
+/*
+ * Returns an empty arena whose first block holds blockSize bytes, or NULL on
+ * failiure. Later blocks double in size
+ */
+arena* arenaInit(size_t blockSize);
+
+/*
+ * Frees arena and everything allocated from it
+ */
+void destroyArena(arena*);
+
+/*
+ * Returns size bytes (not initialised) from arena, or NULL on failiure
+ */
+void* arenaAlloc(arena*, size_t size);
+
+/*
+ * Same as arenaAlloc(), but the bytes are set to 0
+ */
+void* arenaCalloc(arena*, size_t size);
+
+/*
+ * Returns the size bytes at ptr (allocated from arena) grown to newSize,
+ * extending them in place if they are the latest allocation, or NULL on
+ * failiure, in which case ptr is left as it was
+ */
+void* arenaRealloc(arena*, void *ptr, size_t size, size_t newSize);
+
+/*
+ * Gives the space of ptr back to arena if it is its latest allocation still
+ * held, and does nothing otherwise. ptr may be NULL
+ */
+void arenaRelease(arena*, void *ptr);
+
+/*
+ * Frees everything allocated from arena, keeping (up to ARENA_KEEP_LIMIT
+ * bytes of) its memory in a single block for the allocations that follow
+ */
+void arenaReset(arena*);
+
+/*
+ * Returns the arena of the calling thread, created on first use and freed
+ * when the thread exits, or NULL on failiure. Batch jobs run by spawned threads
+ * reset it once they end, so memory is reused across the jobs a thread runs.
+ */
+arena* threadArena();
+
+/*
+ * Resets the arena of the calling thread, if it has one (see arenaReset())
+ */
+void resetThreadArena();
+
+/*
+ * Frees the arena of the calling thread, if it has one
+ */
+void releaseThreadArena();
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "csteg.h"
+#include "arena.h"
+
+#define INITIAL_FILE_CAPACITY 64
+#define MAX_THREADS 256
+
+/**
+ * Growable list of paths built up while walking directories
+ */
+typedef struct fileList {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} fileList;
+
+/**
+ * Appends a copy of path to list. Returns 0 on success and 1 otherwise
+ */
+static int appendPath(fileList *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t newCapacity = list->capacity ? 2*list->capacity :
+                             INITIAL_FILE_CAPACITY;
+        char **grown = realloc(list->paths, newCapacity * sizeof(char*));
+        if (grown == NULL) {
+            return 1;
+        }
+        list->paths = grown;
+        list->capacity = newCapacity;
+    }
+    list->paths[list->count] = strdup(path);
+    if (list->paths[list->count] == NULL) {
+        return 1;
+    }
+    list->count++;
+    return 0;
+}
+
+/**
+ * Adds path to list if it is a JPEG file, or every JPEG file below it if it
+ * is a directory. Returns 0 on success and 1 otherwise
+ */
+static int walkPath(fileList *list, const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        printf("ERROR: cannot access %s\n", path);
+        return 1;
+    }
+    if (!S_ISDIR(info.st_mode)) {
+        return hasJpegExtension(path) ? appendPath(list, path) : 0;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        printf("ERROR: cannot open directory %s\n", path);
+        return 1;
+    }
+    size_t pathLength = strlen(path);
+    struct dirent *entry;
+    int result = 0;
+    while (result == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        char *child = malloc(pathLength + strlen(entry->d_name) + 2);
+        if (child == NULL) {
+            result = 1;
+            break;
+        }
+        sprintf(child, "%s/%s", path, entry->d_name);
+        result = walkPath(list, child);
+        free(child);
+    }
+    closedir(dir);
+    return result;
+}
+
+/**
+ * Orders two entries of a path list alphabetically
+ */
+static int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+int collectJpegFiles(const char *path, char ***files, size_t *fileCount) {
+    fileList list = {0};
+    if (walkPath(&list, path)) {
+        destroyFileList(list.paths, list.count);
+        return 1;
+    }
+    // Sort so output does not depend on directory order
+    qsort(list.paths, list.count, sizeof(char*), comparePaths);
+    *files = list.paths;
+    *fileCount = list.count;
+    return 0;
+}
+
+void destroyFileList(char **files, size_t fileCount) {
+    if (files == NULL)
+        return;
+    for (size_t i = 0; i < fileCount; i++) {
+        free(files[i]);
+    }
+    free(files);
+}
+
+int defaultThreadCount() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+
+/**
+ * State shared by all threads of a single runBatch() call
+ */
+typedef struct batchState {
+    size_t jobCount;
+    size_t nextJob;   // index of next job to hand out, updated atomically
+    size_t failures;  // number of failed jobs, updated atomically
+    int (*job)(size_t, void*);
+    void *context;
+} batchState;
+
+/**
+ * Keeps taking the next job index until none are left, resetting the arena
+ * of the thread after each job if resetArena is 1
+ */
+static void runJobs(batchState *state, int resetArena) {
+    size_t index;
+    while ((index = __atomic_fetch_add(&state->nextJob, 1, __ATOMIC_RELAXED))
+           < state->jobCount) {
+        if (state->job(index, state->context)) {
+            __atomic_fetch_add(&state->failures, 1, __ATOMIC_RELAXED);
+        }
+        if (resetArena) {
+            resetThreadArena();  // next job reuses the memory of this one
+        }
+    }
+}
+
+/**
+ * Thread body: runs jobs until none are left. Nothing a job allocates from
+ * the arena of its thread outlives the job
+ */
+static void* batchWorker(void *arg) {
+    runJobs(arg, 1);
+    return NULL;
+}
+
+size_t runBatch(size_t jobCount, int threadCount,
+                int (*job)(size_t, void*), void *context) {
+    batchState state = {jobCount, 0, 0, job, context};
+    if (threadCount <= 0) {
+        threadCount = defaultThreadCount();
+    }
+    if (threadCount > MAX_THREADS) {
+        threadCount = MAX_THREADS;
+    }
+    if ((size_t)threadCount > jobCount) {
+        threadCount = jobCount;
+    }
+
+    // Calling thread does its share of the work too
+    pthread_t threads[MAX_THREADS];
+    int started = 0;
+    for (; started < threadCount - 1; started++) {
+        if (pthread_create(&threads[started], NULL, batchWorker, &state)) {
+            break;
+        }
+    }
+    // Its arena may hold memory of the caller, so only jobs clean up after it
+    runJobs(&state, 0);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return state.failures;
+}
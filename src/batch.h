@@ -0,0 +1,35 @@
+#ifndef __CSTEG_BATCH__
+#define __CSTEG_BATCH__
+#include <stddef.h>
+
+/*
+ * Helpers for running one operation over many JPEG files at once
+ */
+
+/*
+ * Stores in *files the paths of every JPEG file under path (searching
+ * directories recursively, or just path itself if it is a file) and their
+ * number in *fileCount. Returns 0 on success and 1 otherwise
+ */
+int collectJpegFiles(const char *path, char ***files, size_t *fileCount);
+
+/*
+ * Frees a list of paths created by collectJpegFiles()
+ */
+void destroyFileList(char **files, size_t fileCount);
+
+/*
+ * Returns the number of threads to use when none were requested
+ */
+int defaultThreadCount();
+
+/*
+ * Calls job(i, context) once for every i in [0, jobCount) using up to
+ * threadCount threads (defaultThreadCount() if threadCount <= 0). Jobs are
+ * handed out in increasing order of i. Returns the number of jobs that
+ * returned a non-zero value.
+ */
+size_t runBatch(size_t jobCount, int threadCount,
+                int (*job)(size_t, void*), void *context);
+
+#endif
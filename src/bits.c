@@ -0,0 +1,127 @@
+#include "bits.h"
+#include "csteg.h"
+
+unsigned int peekCursor(const bitCursor *cursor, unsigned char n) {
+    const unsigned char *data = cursor->data;
+    unsigned long index = cursor->byte;
+    unsigned int bits = index < cursor->end ? data[index] : 0xFF;
+    bits &= 0xFF >> cursor->bit;
+    unsigned char bitCount = 8 - cursor->bit;  // bits held in bits
+    while (bitCount < n) {
+        index++;
+        if (index < cursor->end && data[index] == 0 &&
+            data[index - 1] == 0xFF) {
+            index++;
+        }
+        bits = bits << 8 | (index < cursor->end ? data[index] : 0xFF);
+        bitCount += 8;
+    }
+    return bits >> (bitCount - n);
+}
+
+unsigned char stepCursor(bitCursor *cursor, unsigned char n) {
+    unsigned char step = 8 - cursor->bit;
+    if (step > n) {
+        step = n;
+    }
+    cursor->bit += step;
+    if (cursor->bit == 8) {
+        cursor->bit = 0;
+        cursor->byte++;
+        // Skip useless 00 stuff-byte of FF00
+        if (cursor->byte < cursor->end && cursor->data[cursor->byte] == 0 &&
+            cursor->data[cursor->byte - 1] == 0xFF) {
+            cursor->byte++;
+        }
+    }
+    return step;
+}
+
+int jumpCursor(bitCursor *cursor, unsigned char n) {
+    unsigned long last = cursor->byte + (cursor->bit + n) / 8;
+    if (last >= cursor->end) {
+        return 1;
+    }
+    for (unsigned long index = cursor->byte; index <= last; index++) {
+        if (cursor->data[index] == 0xFF) {
+            return 1;
+        }
+    }
+    cursor->byte = last;
+    cursor->bit = (cursor->bit + n) % 8;
+    return 0;
+}
+
+int skipCursor(bitCursor *cursor, unsigned char n) {
+    // Jumping is tried here rather than through jumpCursor(), as this runs
+    // once per symbol
+    unsigned long last = cursor->byte + (cursor->bit + n) / 8;
+    unsigned long index = cursor->byte;
+    while (index <= last && index < cursor->end &&
+           cursor->data[index] != 0xFF) {
+        index++;
+    }
+    if (index > last) {
+        cursor->byte = last;
+        cursor->bit = (cursor->bit + n) % 8;
+        return 0;
+    }
+    while (n != 0) {
+        n -= stepCursor(cursor, n);
+    }
+    return cursor->byte > cursor->end ||
+           (cursor->byte == cursor->end && cursor->bit != 0);
+}
+
+int walkCursor(const bitCursor *cursor, dhtTrie *table, unsigned char *value,
+               unsigned char *length) {
+    unsigned int code = peekCursor(cursor, MAX_CODE_LENGTH);
+    *length = 0;
+    while (isEmpty(table) && *length < MAX_CODE_LENGTH) {
+        unsigned char bit = code >> (MAX_CODE_LENGTH - 1 - *length) & 1;
+        table = traverseTrie(table, bit);
+        (*length)++;
+        if (table == NULL) {
+            return 1;
+        }
+    }
+    if (isEmpty(table)) {
+        return 1;
+    }
+    *value = getValue(table);
+    return 0;
+}
+
+unsigned char takeLookupAcs(const dhtLookupEntry *entry,
+                            unsigned char onlyPlain, unsigned char *acs,
+                            unsigned char *bits, unsigned long long *slots) {
+    // Kept in locals, as this runs once per lookup of every AC
+    unsigned char acsRead = *acs;
+    unsigned char taken = 0;
+    unsigned char carriers = 0;
+    while (taken < entry->count && acsRead < MAX_AC_COEFFICIENTS) {
+        unsigned char value = entry->values[taken];
+        unsigned char coded = MAX_AC_COEFFICIENTS - acsRead;
+        unsigned char carries = 0;
+        if (value != EOB) {
+            coded = value == ZRL ? 16 : GET_4_MSBs(value) + 1;
+            carries = GET_FIRST_4_BITS(value) > 1;
+        }
+        if (acsRead + coded > MAX_AC_COEFFICIENTS ||
+            (onlyPlain && (value == EOB || carries ||
+                           acsRead + coded == MAX_AC_COEFFICIENTS))) {
+            break;
+        }
+        acsRead += coded;
+        carriers += carries;
+        taken++;
+    }
+    if (taken != 0) {
+        *acs = acsRead;
+        *bits = entry->ends[taken - 1];
+        if (slots != NULL) {
+            *slots += carriers;
+        }
+    }
+    return taken;
+}
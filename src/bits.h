@@ -0,0 +1,66 @@
+#ifndef __CSTEG_BITS__
+#define __CSTEG_BITS__
+#include "trie.h"
+
+/*
+ * Bit cursor over Huffman coded scan data, shared by every decoder of the
+ * program. Bytes are read first bit highest, and the 00 stuff-byte after
+ * each FF byte is skipped. Bits at or past end read as 1, which is what
+ * padding before a marker holds.
+ */
+typedef struct bitCursor {
+    const unsigned char *data;
+    unsigned long byte;  // byte of data holding the cursor
+    unsigned char bit;   // bits of byte already read, in [0, 7]
+    unsigned long end;   // first byte of data that cannot be read
+} bitCursor;
+
+/*
+ * Returns the next n (at most MAX_CODE_LENGTH) bits after cursor, first bit
+ * read as most significant, without moving it
+ */
+unsigned int peekCursor(const bitCursor *cursor, unsigned char n);
+
+/*
+ * Moves cursor past at most n of its next bits, stopping at the end of its
+ * byte. Returns the number of bits moved past
+ */
+unsigned char stepCursor(bitCursor *cursor, unsigned char n);
+
+/*
+ * Moves cursor past its next n bits if no byte in the way is an FF byte,
+ * so the move is a single jump. Returns 0 if it moved and 1 otherwise, in
+ * which case cursor is left as it was
+ */
+int jumpCursor(bitCursor *cursor, unsigned char n);
+
+/*
+ * Moves cursor past its next n bits. Returns 0 on success and 1 if this goes
+ * past end
+ */
+int skipCursor(bitCursor *cursor, unsigned char n);
+
+/*
+ * Decodes the symbol after cursor by walking table with the bits of its code,
+ * without moving cursor, storing the symbol in *value and the length of its
+ * code in *length. Returns 0 on success and 1 if the bits are no code of
+ * table
+ */
+int walkCursor(const bitCursor *cursor, dhtTrie *table, unsigned char *value,
+               unsigned char *length);
+
+/*
+ * Takes the AC symbols of entry, in order, that fit in a block which has
+ * *acs of its ACs read, adding the ACs they code to *acs and storing in
+ * *bits the bits up to the end of the values of the last one taken. Those
+ * of 2 value bits or more (which can hold a hidden bit) are added to *slots
+ * unless it is NULL. Stops after an EOB or the last AC of the block. If
+ * onlyPlain, stops before the first symbol that is an EOB, that could hold
+ * a bit or that would end the block instead. Returns the number of symbols
+ * taken
+ */
+unsigned char takeLookupAcs(const dhtLookupEntry *entry,
+                            unsigned char onlyPlain, unsigned char *acs,
+                            unsigned char *bits, unsigned long long *slots);
+
+#endif
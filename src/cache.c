@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cache.h"
+#include "hash.h"
+
+#define INITIAL_SLOTS_CAPACITY 4096
+#define HEADER_FIELDS 6  // 64-bit fields following the magic of an entry
+#define IMAGE_HASH_SEED 0x637374656749ULL
+
+slotIndex* initSlotIndex() {
+    return calloc(1, sizeof(slotIndex));
+}
+
+void destroySlotIndex(slotIndex *index) {
+    if (index == NULL)
+        return;
+    free(index->slots);
+    free(index);
+}
+
+int appendSlot(slotIndex *index, unsigned long long position) {
+    // At most 10 bytes are needed to encode a 64-bit delta
+    if (index->slotsLength + 10 > index->slotsCapacity) {
+        size_t newCapacity = index->slotsCapacity ? 2*index->slotsCapacity :
+                             INITIAL_SLOTS_CAPACITY;
+        unsigned char *grown = realloc(index->slots, newCapacity);
+        if (grown == NULL) {
+            return 1;
+        }
+        index->slots = grown;
+        index->slotsCapacity = newCapacity;
+    }
+
+    unsigned long long delta = position - index->lastSlot;
+    do {
+        unsigned char byte = delta & 0x7F;
+        delta >>= 7;
+        index->slots[index->slotsLength++] = byte | (delta ? 0x80 : 0);
+    } while (delta);
+    index->lastSlot = position;
+    index->slotCount++;
+    return 0;
+}
+
+void startSlotIterator(slotIterator *iterator, const slotIndex *index) {
+    iterator->cursor = index->slots;
+    iterator->end = index->slots + index->slotsLength;
+    iterator->position = 0;
+}
+
+int nextSlot(slotIterator *iterator, unsigned long long *position) {
+    unsigned long long delta = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        if (iterator->cursor >= iterator->end || shift > 63) {
+            return 1;
+        }
+        byte = *iterator->cursor++;
+        delta |= (unsigned long long)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    iterator->position += delta;
+    *position = iterator->position;
+    return 0;
+}
+
+unsigned long long hashImageFile(FILE *file, long fileLength) {
+    if (fileLength <= 0)
+        return 0;
+    fflush(file);  // make sure pending writes are part of the hash
+    void *content = mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE,
+                         fileno(file), 0);
+    if (content == MAP_FAILED)
+        return 0;
+    unsigned long long hash = hash64(content, fileLength, IMAGE_HASH_SEED);
+    munmap(content, fileLength);
+    return hash;
+}
+
+/**
+ * Returns the path (in allocated memory) of the entry for imagePath with
+ * content hash key
+ */
+static char* getEntryPath(const char *imagePath, const char *cacheDir,
+                          unsigned long long key) {
+    size_t length = (cacheDir ? strlen(cacheDir) + 18 : strlen(imagePath)) +
+                    strlen(SLOT_INDEX_EXTENSION) + 1;
+    char *path = malloc(length);
+    if (path == NULL)
+        return NULL;
+    if (cacheDir) {
+        snprintf(path, length, "%s/%016llx%s", cacheDir, key,
+                 SLOT_INDEX_EXTENSION);
+    } else {
+        snprintf(path, length, "%s%s", imagePath, SLOT_INDEX_EXTENSION);
+    }
+    return path;
+}
+
+/**
+ * Stores value into bytes as a little-endian number
+ */
+static void writeField(unsigned char *bytes, unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = value >> (8*i);
+    }
+}
+
+/**
+ * Returns the little-endian number stored in bytes
+ */
+static unsigned long long readField(const unsigned char *bytes) {
+    unsigned long long value = 0;
+    for (int i = 7; i >= 0; i--) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+slotIndex* loadSlotIndex(const char *imagePath, const char *cacheDir,
+                         unsigned long long key, long fileLength,
+                         long scanOffset) {
+    char *path = getEntryPath(imagePath, cacheDir, key);
+    if (path == NULL)
+        return NULL;
+    FILE *entry = fopen(path, "rb");
+    free(path);
+    if (entry == NULL)
+        return NULL;
+
+    unsigned char header[SLOT_INDEX_MAGIC_LENGTH + 8*HEADER_FIELDS];
+    slotIndex *index = NULL;
+    if (fread(header, 1, sizeof(header), entry) != sizeof(header) ||
+        memcmp(header, SLOT_INDEX_MAGIC, SLOT_INDEX_MAGIC_LENGTH) != 0) {
+        fclose(entry);
+        return NULL;
+    }
+    const unsigned char *field = &header[SLOT_INDEX_MAGIC_LENGTH];
+    // Entry must describe exactly this content
+    if (readField(field) != key || readField(field + 8) != fileLength ||
+        readField(field + 16) != scanOffset ||
+        (index = initSlotIndex()) == NULL) {
+        fclose(entry);
+        return NULL;
+    }
+    index->key = key;
+    index->fileLength = fileLength;
+    index->scanOffset = scanOffset;
+    index->slotCount = readField(field + 24);
+    index->lastSlot = readField(field + 32);
+    index->slotsLength = readField(field + 40);
+    index->slotsCapacity = index->slotsLength;
+    index->slots = malloc(index->slotsLength ? index->slotsLength : 1);
+    if (index->slots == NULL ||
+        fread(index->slots, 1, index->slotsLength, entry) !=
+            index->slotsLength) {
+        destroySlotIndex(index);
+        index = NULL;
+    }
+    fclose(entry);
+    return index;
+}
+
+int saveSlotIndex(const char *imagePath, const char *cacheDir,
+                  const slotIndex *index) {
+    char *path = getEntryPath(imagePath, cacheDir, index->key);
+    if (path == NULL)
+        return 1;
+    // Write to a temporary file first so readers never see half an entry
+    char *tempPath = malloc(strlen(path) + 16);
+    if (tempPath == NULL) {
+        free(path);
+        return 1;
+    }
+    sprintf(tempPath, "%s.%ld", path, (long)getpid());
+
+    unsigned char header[SLOT_INDEX_MAGIC_LENGTH + 8*HEADER_FIELDS];
+    memcpy(header, SLOT_INDEX_MAGIC, SLOT_INDEX_MAGIC_LENGTH);
+    unsigned char *field = &header[SLOT_INDEX_MAGIC_LENGTH];
+    writeField(field, index->key);
+    writeField(field + 8, index->fileLength);
+    writeField(field + 16, index->scanOffset);
+    writeField(field + 24, index->slotCount);
+    writeField(field + 32, index->lastSlot);
+    writeField(field + 40, index->slotsLength);
+
+    int result = 1;
+    FILE *entry = fopen(tempPath, "wb");
+    if (entry != NULL) {
+        result = fwrite(header, 1, sizeof(header), entry) != sizeof(header) ||
+                 fwrite(index->slots, 1, index->slotsLength, entry) !=
+                     index->slotsLength;
+        result = fclose(entry) != 0 || result;
+        result = result || rename(tempPath, path) != 0;
+        if (result)
+            remove(tempPath);
+    }
+    if (result)
+        printf("ERROR: could not write slot index %s\n", path);
+    free(tempPath);
+    free(path);
+    return result;
+}
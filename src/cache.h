@@ -0,0 +1,87 @@
+#ifndef __SLOT_CACHE__
+#define __SLOT_CACHE__
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Persistent record of where the eligible AC coefficients (slots) of a JPEG
+ * scan are, so capacity queries, hiding and extracting can skip entropy
+ * decoding. Entries are keyed by a hash of the image's whole content, so an
+ * image that changed in any way never matches an old entry.
+ */
+
+#define SLOT_INDEX_EXTENSION ".cstegidx"  // appended to sidecar/entry names
+#define SLOT_INDEX_MAGIC "CSTGIDX1"       // first 8 bytes of entry files
+#define SLOT_INDEX_MAGIC_LENGTH 8
+
+/*
+ * Slot positions are bit offsets into the scan data (8*byte + bit, counting
+ * stuff-bytes and restart markers), stored as LEB128 encoded deltas.
+ */
+typedef struct slotIndex {
+    unsigned long long key;         // hash of the image content indexed
+    unsigned long long fileLength;  // size of image file in bytes
+    unsigned long long scanOffset;  // file offset of first byte of scan data
+    unsigned long long slotCount;   // number of slots, capacity in bits
+    unsigned long long lastSlot;    // position of last slot appended
+    unsigned char *slots;           // encoded deltas between slot positions
+    size_t slotsLength;             // bytes of slots in use
+    size_t slotsCapacity;           // bytes allocated for slots
+} slotIndex;
+
+/*
+ * Cursor for reading the positions in a slotIndex in order
+ */
+typedef struct slotIterator {
+    const unsigned char *cursor;
+    const unsigned char *end;
+    unsigned long long position;  // position returned by last nextSlot()
+} slotIterator;
+
+/*
+ * Returns an empty slotIndex, or NULL on failiure
+ */
+slotIndex* initSlotIndex();
+
+void destroySlotIndex(slotIndex*);
+
+/*
+ * Appends position (greater than all positions already in index) to index.
+ * Returns 0 on success and 1 otherwise
+ */
+int appendSlot(slotIndex*, unsigned long long position);
+
+/*
+ * Points iterator at the first slot of index
+ */
+void startSlotIterator(slotIterator*, const slotIndex*);
+
+/*
+ * Stores the next slot position in *position. Returns 0 on success and 1 if
+ * there are no slots left
+ */
+int nextSlot(slotIterator*, unsigned long long *position);
+
+/*
+ * Returns the hash identifying the content of the image file of the given
+ * length, without moving its cursor
+ */
+unsigned long long hashImageFile(FILE*, long fileLength);
+
+/*
+ * Loads the entry for the image at imagePath with content hash key from
+ * cacheDir (or from the image's sidecar file if cacheDir is NULL). Returns
+ * NULL if there is no entry or the entry is for different content.
+ */
+slotIndex* loadSlotIndex(const char *imagePath, const char *cacheDir,
+                         unsigned long long key, long fileLength,
+                         long scanOffset);
+
+/*
+ * Stores index in cacheDir (or as a sidecar of imagePath if cacheDir is NULL),
+ * replacing any existing entry. Returns 0 on success and 1 otherwise
+ */
+int saveSlotIndex(const char *imagePath, const char *cacheDir,
+                  const slotIndex*);
+
+#endif
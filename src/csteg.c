@@ -1,9 +1,20 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "csteg.h"
+#include "hash.h"
 #include "scanWorker.h"
+#include "inspect.h"
+#include "ioring.h"
+#include "arena.h"
+#include "batch.h"
+#include "restart.h"
+#include "shard.h"
+#include "sniff.h"
+#include "timer.h"
 
 #ifdef TESTING
     #include <assert.h>
@@ -14,23 +25,39 @@
  *      system is little endian
  */
 
+char *traceFilePath = NULL;  // set by --trace, where to write phase timings
+int threadCount = 0;  // set by --threads, 0 lets batch modes pick
+int useSlotCache = 0;  // set by --cache, reuse slot indexes between runs
+char *cacheDirectory = NULL;  // set by --cache=DIR, NULL means sidecar files
+int framePayloads = 0;  // set by --framed, hide messages with a header
+unsigned int estimateSamples = 0;  // set by --estimate, 0 for exact capacity
+unsigned char payloadFlags = 0;  // set by --crc, PAYLOAD_ flags when framed
+int readRange = 0;  // set by --offset or --length, extract part of a payload
+unsigned long long rangeOffset = 0;  // set by --offset
+unsigned long long rangeLength = ~0ULL;  // set by --length, default is all
+unsigned short restartInterval = 0;  // set by --interval, 0 picks one for -t
+char *slotKey = NULL;  // set by --key, scatters payloads in the order it gives
+
 
 void destroyJpegStats(jpegStats* x) {
+    destroyDhts(x->scanTables);
     for (int i = 0; i < 3; i++) {
-        if (x->dcHuffmanTables[i] != NULL) 
+        if (x->dcHuffmanTables[i] != NULL) {
             destroyDhtTrie(x->dcHuffmanTables[i]);
             // Prevent freeing of same address referenced elsewhere
             for(int j = i+1; j < 3; j++) {
                 if (x->dcHuffmanTables[i] == x->dcHuffmanTables[j])
                     x->dcHuffmanTables[j] = NULL;
             }
-        if (x->acHuffmanTables[i] != NULL) 
+        }
+        if (x->acHuffmanTables[i] != NULL) {
             destroyDhtTrie(x->acHuffmanTables[i]);
             // Prevent freeing of same address referenced elsewhere
             for(int j = i+1; j < 3; j++) {
                 if (x->acHuffmanTables[i] == x->acHuffmanTables[j])
                     x->acHuffmanTables[j] = NULL;
             }
+        }
     }
     free(x);
 }
@@ -47,7 +74,7 @@ void destroyJpegStats(jpegStats* x) {
 int isNotJPEG(char *fileName, FILE *filePointer ) {
     // Make short equal to value read fo fgets()
     unsigned short jpegStart = 0;
-    fgets( ((char*)&jpegStart), 3, filePointer);
+    fread(&jpegStart, 2, 1, filePointer);
     jpegStart = BYTE_TO_SHORT_VALUE(jpegStart);
 
     return jpegStart != JPEG_START;
@@ -63,6 +90,7 @@ int populatejpegStats(jpegStats** jpegStatsHolder, FILE* jpegFile,
                         unsigned short numberOfComponents) {
                             
     (*jpegStatsHolder)->totalColorCounts = 0;
+    unsigned char mcuColumns = 1, mcuRows = 1;  // 8x8 blocks of Y per MCU
     unsigned char component_data[3*numberOfComponents];
     fread(component_data, 3, numberOfComponents, jpegFile);
     // Calculate number of components of each color value per MCU
@@ -76,8 +104,13 @@ int populatejpegStats(jpegStats** jpegStatsHolder, FILE* jpegFile,
         unsigned char horizontal = component_data[3*i+1] >> 4;
         unsigned char vertical = component_data[3*i+1] & 15; // 15 = 0b1111
         (*jpegStatsHolder)->colorCounts[colorId - 1] = vertical * horizontal;
+        (*jpegStatsHolder)->sampling[colorId - 1] = component_data[3*i+1];
         (*jpegStatsHolder)->totalColorCounts += 
             (*jpegStatsHolder)->colorCounts[colorId - 1];
+        if (colorId == Y_ID) {
+            mcuColumns = horizontal ? horizontal : 1;
+            mcuRows = vertical ? vertical : 1;
+        }
         
         if (colorId != Y_ID &&
             (*jpegStatsHolder)->colorCounts[colorId - 1] != 1) {
@@ -91,23 +124,27 @@ int populatejpegStats(jpegStats** jpegStatsHolder, FILE* jpegFile,
             );
         #endif
     }
-    // Calculate total number of MCUs in image
-    unsigned int totalPixels = length * height;
-    unsigned int mcuSize = STD_MCU_SIZE * 
-                             (*jpegStatsHolder)->colorCounts[Y_ID - 1];
+    // Calculate total number of MCUs in image. SOF stores the number of lines
+    // (length) before the number of samples per line (height); partial MCUs
+    // at the edges are still coded, and 64 bits hold any 65535x65535 image
+    unsigned long long mcusPerColumn = (length + 8*mcuRows - 1) / (8*mcuRows);
+    unsigned long long mcusPerRow = (height + 8*mcuColumns - 1) /
+                                    (8*mcuColumns);
     #ifdef TESTING
-        // Make sure that mcuSize makes sense for image
+        // Make sure that mcu count makes sense for image
         printf("\tLENGTH: %d HEIGHT: %d\n", length, height);
-        printf("\tTOTAL PIXELS: %d MCU SIZE: %d\n", totalPixels, mcuSize);
-        //assert(totalPixels % mcuSize == 0);
+        printf("\tMCUS: %llu x %llu\n", mcusPerRow, mcusPerColumn);
     #endif
     
-    (*jpegStatsHolder)->mcuCount = totalPixels / mcuSize;
+    (*jpegStatsHolder)->mcuCount = mcusPerRow * mcusPerColumn;
+    (*jpegStatsHolder)->lines = length;
+    (*jpegStatsHolder)->samplesPerLine = height;
     return 0; // all is well
 }
 
 /**
- * Get info from START OF FRAME-0 SEGMENT while advancing cursor
+ * Get info from START OF FRAME-0 SEGMENT while advancing cursor. SOF-2
+ * segments of progressive images are laid out the same way
  */ 
 int getSOF0Data(FILE *jpegFile, unsigned short segment_length, 
                 jpegStats** jpegStatsHolder) {
@@ -216,8 +253,9 @@ int matchColorsToTables(FILE* jpegFile, jpegStats* jpegStats,
 
 /**
  * Moves the cursor of jpegFile to the byte immediately after the Start of 
- * Scan (SOS) flag of the SOS section. Also initialises dhts object, storeing
- * it in dhtTables.
+ * Scan (SOS) flag of the SOS section, or to the SOS marker itself for
+ * progressive images, whose tables are then kept in their jpegStats instead.
+ * Also initialises dhts object, storeing it in dhtTables.
  *
  * Assumes jpegFile is pointing to the third byte of a JPEG file
  *
@@ -228,17 +266,17 @@ int matchColorsToTables(FILE* jpegFile, jpegStats* jpegStats,
 int setFileCursor(FILE *jpegFile, dhts** dhtTables, 
                   jpegStats** jpegStatsHolder) {
     // Allocate space for needed structs
-    *jpegStatsHolder = malloc(sizeof(jpegStats));
+    *jpegStatsHolder = calloc(1, sizeof(jpegStats));  // All tables start NULL
     *dhtTables = (dhts*)calloc(1, sizeof(dhts));  // All tables start NULL
-    (*dhtTables)->tablesLeftToMake = MAX_NUMBER_OF_TABLES_ALLOWED;
-    if (*dhtTables == NULL || jpegStatsHolder == NULL) {
+    if (*dhtTables == NULL || *jpegStatsHolder == NULL) {
         puts("ERROR ALLOCATING NEEDED SPACE");
         destroyDhts(*dhtTables);
-        if (*jpegStatsHolder != NULL) {
-            free(*jpegStatsHolder);
-        }
+        *dhtTables = NULL;
+        free(*jpegStatsHolder);
+        *jpegStatsHolder = NULL;
         return 1;
     }
+    (*dhtTables)->tablesLeftToMake = MAX_NUMBER_OF_TABLES_ALLOWED;
 
     unsigned short buffer[3]; // Stores section marker and length respectively.
     fread((void*)&buffer, 1, 4, jpegFile);
@@ -254,6 +292,10 @@ int setFileCursor(FILE *jpegFile, dhts** dhtTables,
             case START_OF_FRAME_0 :
                 result = getSOF0Data(jpegFile, buffer[1], jpegStatsHolder);
                 break;
+            case START_OF_FRAME_2 :
+                result = getSOF0Data(jpegFile, buffer[1], jpegStatsHolder);
+                (*jpegStatsHolder)->progressive = 1;
+                break;
             case DRI_MARKER :
                 result = getRestartData(jpegFile, buffer[1], *jpegStatsHolder);
                 break;
@@ -268,9 +310,10 @@ int setFileCursor(FILE *jpegFile, dhts** dhtTables,
 
         // Return 1 if error occurred
         if (result) {
-            if (jpegStatsHolder != NULL) 
-                free(*jpegStatsHolder);
+            free(*jpegStatsHolder);
+            *jpegStatsHolder = NULL;
             destroyDhts(*dhtTables);
+            *dhtTables = NULL;
             return 1;
         }
 
@@ -284,6 +327,20 @@ int setFileCursor(FILE *jpegFile, dhts** dhtTables,
     #ifdef TESTING
 	    printf("SECTION: %hX | LENGTH-ENTRY: %u\n", buffer[0], buffer[1]);
 	#endif
+    if ((*jpegStatsHolder)->progressive) {
+        // Every scan is read later, from its SOS segment on, with the tables
+        // defined before it (see progressive.h)
+        if (fseek(jpegFile, -4, SEEK_CUR)) {
+            free(*jpegStatsHolder);
+            *jpegStatsHolder = NULL;
+            destroyDhts(*dhtTables);
+            *dhtTables = NULL;
+            return 1;
+        }
+        (*jpegStatsHolder)->scanTables = *dhtTables;
+        *dhtTables = NULL;
+        return 0;
+    }
     return matchColorsToTables(jpegFile, *jpegStatsHolder, *dhtTables,buffer[1]);
 }
 
@@ -305,9 +362,8 @@ jpegStats* getJpegStats(char *filePath, FILE *imgFile) {
         if(dhtTables != NULL) {
             destroyDhts(dhtTables);
         }
-        if (jpegStats != NULL) {
-            destroyJpegStats(jpegStats);
-        }
+        // Tables referenced by jpegStats are owned by dhtTables until success
+        free(jpegStats);
 	    fclose(imgFile);
         return NULL;
     }
@@ -318,15 +374,12 @@ jpegStats* getJpegStats(char *filePath, FILE *imgFile) {
 }
 
 /**
- * Given the name of a file, calculate its length in bytes.
- *
- * Assumes filePath exists
+ * Given the name of a file, calculate its length in bytes, or -1 if it
+ * does not exist
  */
 long getFileSize(char* filePath) {
-    FILE *file = fopen(filePath, "rb");
-    fseek (file, 0, SEEK_END);
-    long length = ftell(file);
-    fclose(file);
+    struct stat info;
+    long length = stat(filePath, &info) == 0 ? info.st_size : -1;
 
     #ifdef TESTING
         printf("FILE SIZE: %ld bytes\n\n", length);
@@ -387,25 +440,157 @@ char* loadMessage(char* filePath, long maxMessageSize) {
     return mssg;
 }
 
+/**
+ * Returns the key of the slot index of imgFile: the hash of its content,
+ * mixed with the channel mask unless it is the default one, as the mask
+ * decides which coeficients are slots
+ */
+unsigned long long getIndexKey(FILE *imgFile, long fileSize) {
+    unsigned long long key = hashImageFile(imgFile, fileSize);
+    unsigned char mask = getChannelMask();
+    return mask == DEFAULT_CHANNELS ? key : fnv1a64(&mask, 1, key);
+}
+
+/**
+ * Returns the slotIndex of the JPG filePath (opened as imgFile, whose cursor is
+ * at the start of its scan) from the cache, or builds it with a full decode
+ * and stores it in the cache if there is no entry for the image's current
+ * content. The cache is left alone unless --cache is given.
+ * Returns NULL on failiure.
+ */
+slotIndex* getSlotIndex(char *filePath, FILE *imgFile, jpegStats *stats,
+                        long fileSize) {
+    long scanOffset = ftell(imgFile);
+    unsigned long long key = useSlotCache ? getIndexKey(imgFile, fileSize) : 0;
+    slotIndex *index = useSlotCache ?
+                       loadSlotIndex(filePath, cacheDirectory, key, fileSize,
+                                     scanOffset) : NULL;
+    if (index != NULL) {
+        puts("Using cached slot index");
+        return index;
+    }
+
+    index = initSlotIndex();
+    if (index == NULL) {
+        return NULL;
+    }
+    index->key = key;
+    index->fileLength = fileSize;
+    index->scanOffset = scanOffset;
+    if (buildSlotIndex(imgFile, stats, fileSize, index, NULL) < 0) {
+        destroySlotIndex(index);
+        return NULL;
+    }
+    if (useSlotCache) {
+        saveSlotIndex(filePath, cacheDirectory, index);
+    }
+    return index;
+}
+
+/**
+ * Writes the payload hidden in imgFile (the JPG at imgFilePath, whose cursor
+ * is at the start of its scan) to outputFile while the scan is decoded,
+ * through the fixed buffers of a writeBehind, so memory does not grow with
+ * the payload and writing overlaps decoding. The payload is read at the
+ * positions of index unless it is NULL. A regular outputFile is removed if
+ * the payload cannot be read. Returns 0 on success and 1 otherwise
+ */
+int streamMessage(char *imgFilePath, FILE *imgFile, jpegStats *stats,
+                  long fileSize, slotIndex *index, char *outputFile) {
+    FILE *out = fopen(outputFile, "wb");
+    writeBehind *writer = out ? writeBehindInit(fileno(out)) : NULL;
+    if (writer == NULL) {
+        printf("ERROR: could not write %s\n", outputFile);
+        if (out != NULL) {
+            fclose(out);
+        }
+        return 1;
+    }
+    payloadHeader header;
+    unsigned long long length;
+    int result = index ?
+        scannerWriteIndexed(imgFile, fileSize, index, writeBehindPut, writer,
+                            &header, &length) :
+        scannerWriteMessage(imgFile, stats, fileSize, writeBehindPut, writer,
+                            &header, &length);
+    result = finishWriteBehind(writer) || result;
+    struct stat info;
+    int regular = fstat(fileno(out), &info) == 0 && S_ISREG(info.st_mode);
+    result = fclose(out) != 0 || result;
+    if (result) {
+        if (regular) {
+            remove(outputFile);  // part of a payload, or a damaged one
+        }
+        return 1;
+    }
+    if (header.version != 0 && header.total != 1) {
+        printf("WARNING: %s holds part %d of %d of a payload, use -R\n",
+               imgFilePath, header.sequence + 1, header.total);
+    }
+    printf("EXTRACTED MESSAGE FROM %s INTO %s\n", imgFilePath, outputFile);
+    return 0;
+}
 
 int extractMessage(char *imgFilePath, char *outputFile) { 
+    phaseTimer timer;
+    timerBegin(&timer, "parse", imgFilePath);
     FILE *imgFile = fopen(imgFilePath, "rb");
      jpegStats *jpegStats = getJpegStats(imgFilePath, imgFile);
+    timerEnd(&timer);
     if (jpegStats == NULL) {
         return 1;
     }
 
     // Obtain hidden message and write to outputFile
     long fileSize = getFileSize(imgFilePath);
-    char *hiddenMessage = scannerReadMessage(imgFile, jpegStats, fileSize);
+    timerBegin(&timer, "extract", imgFilePath);
+    slotIndex *index = NULL;
+    // Indexed reads need the whole scan in memory
+    if (useSlotCache && !isStreamedScan(imgFile, fileSize)) {
+        index = loadSlotIndex(imgFilePath, cacheDirectory,
+                              getIndexKey(imgFile, fileSize), fileSize,
+                              ftell(imgFile));
+    }
+    payloadHeader header;
+    size_t length;
+    unsigned char *hiddenMessage;
+    if (!readRange) {
+        // Whole payloads go to outputFile as they are read
+        int result = streamMessage(imgFilePath, imgFile, jpegStats, fileSize,
+                                   index, outputFile);
+        timerEnd(&timer);
+        destroySlotIndex(index);
+        fclose(imgFile);
+        destroyJpegStats(jpegStats);
+        return result;
+    } else if (index) {
+        // Without decoding, reading the whole payload is already cheap
+        hiddenMessage = scannerReadIndexed(imgFile, fileSize, index, &header,
+                                           &length);
+        hiddenMessage = cutRange(hiddenMessage, length, rangeOffset,
+                                 rangeLength, &length);
+    } else {
+        hiddenMessage = scannerReadRange(imgFile, jpegStats, fileSize,
+                                         rangeOffset, rangeLength, &header,
+                                         &length);
+    }
+    destroySlotIndex(index);
+    timerEnd(&timer);
     if (hiddenMessage == NULL) {
+        fclose(imgFile);
         destroyJpegStats(jpegStats);
         return 1;
     }
-    FILE *out = fopen(outputFile, "w");
+    timerBegin(&timer, "output", outputFile);
+    if (header.version != 0 && header.total != 1) {
+        printf("WARNING: %s holds part %d of %d of a payload, use -R\n",
+               imgFilePath, header.sequence + 1, header.total);
+    }
+    FILE *out = fopen(outputFile, "wb");
     printf("EXTRACTED MESSAGE FROM %s INTO %s\n", imgFilePath, outputFile);
-    fprintf(out, "%s", hiddenMessage);
+    fwrite(hiddenMessage, 1, length, out);
     fclose(out);
+    timerEnd(&timer);
 
     free(hiddenMessage);
     fclose(imgFile);
@@ -413,6 +598,189 @@ int extractMessage(char *imgFilePath, char *outputFile) {
     return 0;
 }
 
+/**
+ * Copies length bytes from the cursor of from to the cursor of to.
+ * Returns 0 on success and 1 otherwise
+ */
+int copyBytes(FILE *from, FILE *to, long length) {
+    char buffer[65536];
+    while (length > 0) {
+        size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (fread(buffer, 1, chunk, from) != chunk ||
+            fwrite(buffer, 1, chunk, to) != chunk) {
+            return 1;
+        }
+        length -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Creates a temporary file next to filePath (opened as imgFile), with the
+ * same permissions, to write a new version of the image to. Stores its path,
+ * in allocated memory, in *tempPath. Returns NULL on failiure
+ */
+FILE* createTempCopy(char *filePath, FILE *imgFile, char **tempPath) {
+    *tempPath = malloc(strlen(filePath) + 16);
+    if (*tempPath == NULL) {
+        return NULL;
+    }
+    sprintf(*tempPath, "%s.%ld", filePath, (long)getpid());
+    FILE *output = fopen(*tempPath, "wb");
+    if (output == NULL) {
+        printf("ERROR: could not create %s\n", *tempPath);
+        free(*tempPath);
+        return NULL;
+    }
+    struct stat info;  // keep permissions of the original image
+    if (fstat(fileno(imgFile), &info) == 0) {
+        fchmod(fileno(output), info.st_mode & 07777);
+    }
+    return output;
+}
+
+/**
+ * Closes output, the temporary file at tempPath, and makes it replace the
+ * image at filePath unless failed is non-zero, in which case it is removed.
+ * Frees tempPath. Returns 0 on success and 1 otherwise
+ */
+int finishTempCopy(FILE *output, char *tempPath, char *filePath, int failed) {
+    failed = fclose(output) != 0 || failed;
+    failed = failed || rename(tempPath, filePath) != 0;
+    if (failed) {
+        remove(tempPath);
+    }
+    free(tempPath);
+    return failed;
+}
+
+/**
+ * Creates a temporary copy of filePath (opened as imgFile, whose cursor is at
+ * the start of its scan) holding only its headers, which the modified scan is
+ * then written after (see createTempCopy()). Returns NULL on failiure
+ */
+FILE* copyHeaders(char *filePath, FILE *imgFile, char **tempPath) {
+    FILE *output = createTempCopy(filePath, imgFile, tempPath);
+    if (output == NULL) {
+        return NULL;
+    }
+    long scanOffset = ftell(imgFile);
+    rewind(imgFile);
+    if (copyBytes(imgFile, output, scanOffset)) {
+        puts("ERROR: could not copy image headers");
+        finishTempCopy(output, *tempPath, filePath, 1);
+        return NULL;
+    }
+    return output;
+}
+
+/**
+ * Hides message in the JPG at filePath (opened as imgFile, whose cursor is at
+ * the start of its scan) by writing the modified image to a temporary file
+ * next to it, which then replaces the original. Used for scans too long to be
+ * rewritten in place from memory. Returns 0 on success and 1 otherwise
+ */
+int hideThroughCopy(char *filePath, FILE *imgFile, jpegStats *stats,
+                    const unsigned char *data, size_t length,
+                    long fileSize) {
+    // Headers are copied as they are, then the scan is streamed through
+    char *tempPath;
+    FILE *output = copyHeaders(filePath, imgFile, &tempPath);
+    if (output == NULL) {
+        return 1;
+    }
+    int result = scannerHideStreamed(imgFile, output, stats, data, length,
+                                     fileSize);
+    return finishTempCopy(output, tempPath, filePath, result);
+}
+
+/**
+ * Hides data in the JPG at filePath, in place or through a temporary copy
+ * depending on how long its scan is
+ */
+int hideBytes(char *filePath, FILE *imgFile, jpegStats *stats,
+              const unsigned char *data, size_t length, long fileSize) {
+    if (isStreamedScan(imgFile, fileSize)) {
+        return hideThroughCopy(filePath, imgFile, stats, data, length,
+                               fileSize);
+    }
+    return scannerHideMessage(imgFile, stats, data, length, fileSize);
+}
+
+/**
+ * Hides the plain message in the file inputFilePath (its first
+ * maxMessageSize bytes, up to its first 0 byte) along with a terminating 0
+ * byte in the JPG at filePath, like hideBytes(). The message is read and
+ * hidden a chunk at a time, so it is never all in memory and the scan is
+ * decoded while it is read. Stores the number of bytes hidden in *length.
+ * Returns 0 on success and 1 otherwise
+ */
+int hideMessageFile(char *filePath, FILE *imgFile, jpegStats *stats,
+                    char *inputFilePath, long maxMessageSize, long fileSize,
+                    size_t *length) {
+    printf("Loading at most %ld characters from %s\n",
+            maxMessageSize, inputFilePath);
+    FILE *mssgFile = fopen(inputFilePath, "rb");
+    if (mssgFile == NULL) {
+        printf("ERROR reading file %s\n", inputFilePath);
+        return 1;
+    }
+    char *tempPath = NULL;
+    FILE *output = NULL;
+    if (isStreamedScan(imgFile, fileSize)) {
+        output = copyHeaders(filePath, imgFile, &tempPath);
+        if (output == NULL) {
+            fclose(mssgFile);
+            return 1;
+        }
+    }
+    hideSession *session = scannerHideBegin(imgFile, output, stats, fileSize);
+    int result = session == NULL;
+
+    phaseTimer timer;
+    timerBegin(&timer, "embed", inputFilePath);
+    unsigned char chunk[MESSAGE_CHUNK_SIZE];
+    *length = 0;
+    int done = 0;
+    while (!result && !done) {
+        size_t wanted = maxMessageSize - *length;
+        if (wanted > sizeof(chunk)) {
+            wanted = sizeof(chunk);
+        }
+        size_t chunkLength = fread(chunk, 1, wanted, mssgFile);
+        if (chunkLength != wanted && ferror(mssgFile)) {
+            printf("ERROR reading file %s\n", inputFilePath);
+            result = 1;
+            break;
+        }
+        // The message ends at its first 0 byte, the end of its file or
+        // once maxMessageSize bytes are read
+        unsigned char *end = memchr(chunk, 0, chunkLength);
+        if (end != NULL) {
+            chunkLength = end - chunk;
+        }
+        done = end != NULL || chunkLength != wanted ||
+               *length + chunkLength == (size_t)maxMessageSize;
+        result = scannerHideFeed(session, chunk, chunkLength);
+        *length += chunkLength;
+    }
+    unsigned char terminator = 0;
+    result = result || scannerHideFeed(session, &terminator, 1);
+    *length += 1;
+    timerEnd(&timer);
+    fclose(mssgFile);
+
+    if (result) {
+        destroyHideSession(session);
+    } else {
+        result = scannerHideFinish(session);
+    }
+    if (output != NULL) {
+        result = finishTempCopy(output, tempPath, filePath, result);
+    }
+    return result;
+}
+
 /**
  * Hides a user-defined message (from inputFilePath text file or stdin if
  * inputFilePath is NULL) inside JPG pointed to by filePath, modifying
@@ -420,46 +788,430 @@ int extractMessage(char *imgFilePath, char *outputFile) {
  * operation variable in main()
  */
 int hideMessage(char* filePath, char* inputFilePath) {
+    phaseTimer timer;
+    timerBegin(&timer, "parse", filePath);
     FILE *imgFile = fopen(filePath, "r+b");  // pointer to jpg file
     jpegStats *jpegStats = getJpegStats(filePath, imgFile);
+    timerEnd(&timer);
     if (jpegStats == NULL) {
         return 1;
     }
     long fileSize = getFileSize(filePath);
     puts("Loading Max Message Size");
-    long maxMessageSize = getMaxMessageSize(imgFile, jpegStats, fileSize);
+    timerBegin(&timer, "capacity", filePath);
+    slotIndex *index = NULL;
+    slotCheckpoints checkpoints = {0};  // only found when decoding the scan
+    long maxMessageSize;
+    int streamed = isStreamedScan(imgFile, fileSize);
+    // Progressive images are decoded once, for both capacity and hiding
+    if ((useSlotCache || jpegStats->progressive) && !streamed) {
+        index = getSlotIndex(filePath, imgFile, jpegStats, fileSize);
+        maxMessageSize = index ? index->slotCount / 8 - 1 : -1;
+    } else {
+        // Scattered payloads cannot be read from a checkpoint
+        maxMessageSize = buildSlotIndex(imgFile, jpegStats, fileSize, NULL,
+                                        framePayloads && !slotKey ?
+                                        &checkpoints : NULL);
+    }
+    if (framePayloads && maxMessageSize >= 0) {
+        // Framed payloads need a header but no terminating 0 byte
+        fitCheckpoints(&checkpoints, maxMessageSize + 1);
+        maxMessageSize += 1 - (long)framingLength(payloadFlags, &checkpoints);
+    }
+    timerEnd(&timer);
     if (maxMessageSize <= 0) {
         printf("ERROR Loading max message size\n");
+        destroySlotIndex(index);
+        destroyCheckpoints(&checkpoints);
+        fclose(imgFile);
         destroyJpegStats(jpegStats);
         return 1;
     }
 
+    // Plain messages from files are hidden as they are read
+    if (inputFilePath && !framePayloads && !index) {
+        size_t length;
+        int result = hideMessageFile(filePath, imgFile, jpegStats,
+                                     inputFilePath, maxMessageSize, fileSize,
+                                     &length);
+        destroyCheckpoints(&checkpoints);
+        fclose(imgFile);
+        destroyJpegStats(jpegStats);
+        return result;
+    }
+
     // Get message and hide it in imgFile
     char*(*obtainMssg)(char*,long) = inputFilePath ? loadMessage: askForMessage;
     inputFilePath = obtainMssg == askForMessage ? filePath : inputFilePath;
+    timerBegin(&timer, "load", inputFilePath);
     char *message = obtainMssg(inputFilePath, maxMessageSize);
-    if (message) {
-        scannerHideMessage(imgFile, jpegStats, message, fileSize);
+    timerEnd(&timer);
+    int result = message == NULL;  // Do check on obtainMssg success here!
+    // The message is hidden along with its terminating 0 byte, or its header
+    size_t length = message ? strlen(message) + 1 : 0;
+    unsigned char *data = (unsigned char*)message;
+    if (message && framePayloads) {
+        data = framePayload(0, 1, payloadFlags, &checkpoints, data,
+                            length - 1, &length);
+        result = data == NULL;
+    }
+    destroyCheckpoints(&checkpoints);
+    if (result) {
+        // nothing to hide
+    } else if (index) {
+        result = scannerHideIndexed(imgFile, data, length, fileSize, index);
+        // Index still describes the image, but under its new content
+        if (!result && useSlotCache) {
+            index->key = getIndexKey(imgFile, index->fileLength);
+            saveSlotIndex(filePath, cacheDirectory, index);
+        }
+    } else {
+        result = hideBytes(filePath, imgFile, jpegStats, data, length,
+                           fileSize);
     }
 
     // free alloced space
+    if (data != (unsigned char*)message) {
+        free(data);
+    }
     free(message);
+    destroySlotIndex(index);
     fclose(imgFile);
     destroyJpegStats(jpegStats);
-    return message == NULL; // Do check on obtainMssg success here!
+    return result;
+}
+
+/**
+ * Replaces the message hidden in the JPG at filePath with the one from
+ * inputFilePath (or stdin if NULL) without finding the capacity of the image
+ * first: the scan is only decoded as far as the new message reaches, only
+ * coeficients whose bit differs are changed and only the bytes that changed
+ * are written back. Framed messages get no checkpoints, as they would need
+ * the whole scan decoded. Returns 0 on success and 1 otherwise
+ */
+int updateMessage(char* filePath, char* inputFilePath) {
+    phaseTimer timer;
+    timerBegin(&timer, "parse", filePath);
+    FILE *imgFile = fopen(filePath, "r+b");
+    jpegStats *jpegStats = getJpegStats(filePath, imgFile);
+    timerEnd(&timer);
+    if (jpegStats == NULL) {
+        return 1;
+    }
+    long fileSize = getFileSize(filePath);
+
+    // A message can never be longer than the scan holding it
+    if (inputFilePath && !framePayloads && !useSlotCache) {
+        size_t length;
+        int result = hideMessageFile(filePath, imgFile, jpegStats,
+                                     inputFilePath, fileSize, fileSize,
+                                     &length);
+        if (!result) {
+            printf("UPDATED MESSAGE IN %s (%zu bytes)\n", filePath, length);
+        }
+        fclose(imgFile);
+        destroyJpegStats(jpegStats);
+        return result;
+    }
+    char*(*obtainMssg)(char*,long) = inputFilePath ? loadMessage: askForMessage;
+    inputFilePath = obtainMssg == askForMessage ? filePath : inputFilePath;
+    timerBegin(&timer, "load", inputFilePath);
+    char *message = obtainMssg(inputFilePath, fileSize);
+    timerEnd(&timer);
+    int result = message == NULL;
+    size_t length = message ? strlen(message) + 1 : 0;
+    unsigned char *data = (unsigned char*)message;
+    if (message && framePayloads) {
+        data = framePayload(0, 1, payloadFlags, NULL, data, length - 1,
+                            &length);
+        result = data == NULL;
+    }
+
+    slotIndex *index = NULL;
+    if (!result && useSlotCache && !isStreamedScan(imgFile, fileSize)) {
+        index = getSlotIndex(filePath, imgFile, jpegStats, fileSize);
+        result = index == NULL;
+    }
+    if (result) {
+        // nothing to hide
+    } else if (index) {
+        result = scannerHideIndexed(imgFile, data, length, fileSize, index);
+        if (!result) {
+            index->key = getIndexKey(imgFile, index->fileLength);
+            saveSlotIndex(filePath, cacheDirectory, index);
+        }
+    } else {
+        result = hideBytes(filePath, imgFile, jpegStats, data, length,
+                           fileSize);
+    }
+    if (!result) {
+        printf("UPDATED MESSAGE IN %s (%zu bytes)\n", filePath, length);
+    }
+
+    if (data != (unsigned char*)message) {
+        free(data);
+    }
+    free(message);
+    destroySlotIndex(index);
+    fclose(imgFile);
+    destroyJpegStats(jpegStats);
+    return result;
+}
+
+/**
+ * Returns the number of message bytes (minus ending 0 byte) that slots usable
+ * coeficients can hold
+ */
+long long slotsToBytes(long long slots) {
+    return slots >= 8 ? slots / 8 - 1 : 0;
+}
+
+/**
+ * Prints the capacity of the JPG at filePath given by estimate
+ */
+void printEstimate(char *filePath, slotEstimate *estimate) {
+    if (estimate->intervals == 0) {
+        printf("MAX MESSAGE SIZE OF %s: %lld bytes (exact, no restart markers "
+               "to sample)\n", filePath, slotsToBytes(estimate->slots));
+        return;
+    }
+    long long slots = estimate->slots;
+    long long margin = estimate->margin;
+    printf("ESTIMATED MAX MESSAGE SIZE OF %s: %lld bytes (95%% confidence "
+           "%lld to %lld bytes, decoded %u of %llu restart intervals)\n",
+           filePath, slotsToBytes(slots), slotsToBytes(slots - margin),
+           slotsToBytes(slots + margin), estimate->sampled,
+           estimate->intervals);
+}
+
+/**
+ * Prints the number of bytes that can be hidden in the JPG at filePath. unused
+ * is ignored; only used to match type of operation variable in main()
+ */
+int printCapacity(char *filePath, char *unused) {
+    phaseTimer timer;
+    timerBegin(&timer, "parse", filePath);
+    FILE *imgFile = fopen(filePath, "rb");
+    jpegStats *jpegStats = getJpegStats(filePath, imgFile);
+    timerEnd(&timer);
+    if (jpegStats == NULL) {
+        return 1;
+    }
+    long fileSize = getFileSize(filePath);
+    timerBegin(&timer, "capacity", filePath);
+    long maxMessageSize;
+    if (estimateSamples != 0) {
+        slotEstimate estimate;
+        int result = estimateSlots(imgFile, jpegStats, fileSize,
+                                   estimateSamples, &estimate);
+        timerEnd(&timer);
+        if (result == 0) {
+            printEstimate(filePath, &estimate);
+        }
+        fclose(imgFile);
+        destroyJpegStats(jpegStats);
+        return result;
+    } else if (useSlotCache) {
+        slotIndex *index = getSlotIndex(filePath, imgFile, jpegStats, fileSize);
+        maxMessageSize = index ? index->slotCount / 8 - 1 : -1;
+        destroySlotIndex(index);
+    } else {
+        maxMessageSize = getMaxMessageSize(imgFile, jpegStats, fileSize);
+    }
+    timerEnd(&timer);
+
+    if (maxMessageSize >= 0) {
+        printf("MAX MESSAGE SIZE OF %s: %ld bytes\n", filePath, maxMessageSize);
+    }
+    fclose(imgFile);
+    destroyJpegStats(jpegStats);
+    return maxMessageSize < 0;
 }
 
 /**
  * Returns 1 if the file referenced by filePath exists and 0 otherwise
  */
 int fileExists(char *filePath) {
-    FILE *file = fopen(filePath, "r");
-    if (file != NULL) {
-        fclose(file);
+    return access(filePath, F_OK) == 0;
+}
+
+/**
+ * Returns 1 if filePath ends in one of the extensions used for JPEG files and
+ * 0 otherwise
+ */
+int hasJpegExtension(const char *filePath) {
+    const char *extension = strrchr(filePath, '.');
+    return extension != NULL &&
+           (strcmp(extension, ".jpg") == 0 ||
+            strcmp(extension, ".jpeg") == 0 ||
+            strcmp(extension, ".jpe") == 0 ||
+            strcmp(extension, ".jfif") == 0);
+}
+
+/**
+ * Rewrites the JPG at filePath with a restart marker every restartInterval
+ * MCUs (or an interval picked from its size), keeping every coeficient.
+ * unused is ignored; only used to match type of operation variable in main()
+ */
+int addRestarts(char *filePath, char *unused) {
+    phaseTimer timer;
+    timerBegin(&timer, "parse", filePath);
+    FILE *imgFile = fopen(filePath, "rb");
+    jpegStats *stats = getJpegStats(filePath, imgFile);
+    timerEnd(&timer);
+    if (stats == NULL) {
         return 1;
-   } else {
-        return 0;
-   }
+    }
+    if (stats->progressive) {
+        puts("ERROR: restart markers can only be added to baseline images");
+        fclose(imgFile);
+        destroyJpegStats(stats);
+        return 1;
+    }
+    unsigned short interval = restartInterval ? restartInterval :
+                              defaultRestartInterval(stats);
+    char *tempPath;
+    FILE *output = createTempCopy(filePath, imgFile, &tempPath);
+    int result = output == NULL;
+    if (!result) {
+        timerBegin(&timer, "transcode", filePath);
+        result = writeWithRestarts(imgFile, output, stats, interval);
+        timerEnd(&timer);
+        result = finishTempCopy(output, tempPath, filePath, result);
+    }
+    if (!result) {
+        printf("ADDED A RESTART MARKER EVERY %d MCUS TO %s\n", interval,
+               filePath);
+    }
+    fclose(imgFile);
+    destroyJpegStats(stats);
+    return result;
+}
+
+/**
+ * Prints a JSON description of the headers of the JPEG file, or of every JPEG
+ * in the directory, at path. unused is ignored; only used to match type of
+ * operation variable in main()
+ */
+int inspectImages(char *path, char *unused) {
+    return inspectPath(path, threadCount);
+}
+
+/**
+ * Prints the paths and payload headers of the JPEG file, or of every JPEG in
+ * the directory, at path that hold a framed payload. unused is ignored; only
+ * used to match type of operation variable in main()
+ */
+int sniffImages(char *path, char *unused) {
+    return sniffPath(path, threadCount);
+}
+
+/**
+ * Sets the channel mask from a comma separated list of channels (y, cb, cr).
+ * Returns 0 on success and 1 if the list is invalid
+ */
+int parseChannels(const char *list) {
+    unsigned char mask = 0;
+    while (*list) {
+        size_t length = strcspn(list, ",");
+        if (length == 1 && list[0] == 'y') {
+            mask |= CHANNEL_Y;
+        } else if (length == 2 && strncmp(list, "cb", 2) == 0) {
+            mask |= CHANNEL_CB;
+        } else if (length == 2 && strncmp(list, "cr", 2) == 0) {
+            mask |= CHANNEL_CR;
+        } else {
+            return 1;
+        }
+        list += length + (list[length] == ',');
+    }
+    if (mask == 0) {
+        return 1;
+    }
+    setChannelMask(mask);
+    return 0;
+}
+
+/**
+ * Removes every "--name[=value]" option from argv, applying it as it goes, and
+ * updates *argc to the number of positional arguments left.
+ * Returns 0 if all options are valid and 1 otherwise
+ */
+int parseOptions(int *argc, char **argv) {
+    int kept = 1;  // argv[0] is always kept
+    for (int i = 1; i < *argc; i++) {
+        char *arg = argv[i];
+        if (strncmp(arg, "--", 2) != 0) {
+            argv[kept++] = arg;
+            continue;
+        }
+
+        if (strncmp(arg, "--trace=", 8) == 0 && arg[8] != 0) {
+            traceFilePath = &arg[8];
+            timerEnable();
+        } else if (strcmp(arg, "--cache") == 0) {
+            useSlotCache = 1;  // sidecar files
+        } else if (strncmp(arg, "--cache=", 8) == 0 && arg[8] != 0) {
+            useSlotCache = 1;
+            cacheDirectory = &arg[8];
+            mkdir(cacheDirectory, 0777);  // may already exist
+        } else if (strcmp(arg, "--framed") == 0) {
+            framePayloads = 1;
+        } else if (strcmp(arg, "--crc") == 0) {
+            framePayloads = 1;  // the checksum is kept in the header
+            payloadFlags |= PAYLOAD_CHECKSUM;
+            setShardFlags(payloadFlags);
+        } else if (strncmp(arg, "--offset=", 9) == 0 && arg[9] != 0) {
+            readRange = 1;
+            rangeOffset = strtoull(&arg[9], NULL, 10);
+        } else if (strncmp(arg, "--length=", 9) == 0 && arg[9] != 0) {
+            readRange = 1;
+            rangeLength = strtoull(&arg[9], NULL, 10);
+        } else if (strcmp(arg, "--estimate") == 0) {
+            estimateSamples = DEFAULT_ESTIMATE_SAMPLES;
+        } else if (strncmp(arg, "--estimate=", 11) == 0) {
+            estimateSamples = atoi(&arg[11]);
+            if ((int)estimateSamples <= 0) {
+                printf("ERROR: invalid sample count %s\n", &arg[11]);
+                return 1;
+            }
+        } else if (strncmp(arg, "--channels=", 11) == 0) {
+            if (parseChannels(&arg[11])) {
+                printf("ERROR: invalid channels %s, expected a comma "
+                       "separated list of y, cb and cr\n", &arg[11]);
+                return 1;
+            }
+        } else if (strncmp(arg, "--interval=", 11) == 0) {
+            long interval = atol(&arg[11]);
+            if (interval < MIN_RESTART_INTERVAL ||
+                interval > MAX_RESTART_INTERVAL) {
+                printf("ERROR: invalid restart interval %s, expected %d to "
+                       "%d MCUs\n", &arg[11], MIN_RESTART_INTERVAL,
+                       MAX_RESTART_INTERVAL);
+                return 1;
+            }
+            restartInterval = interval;
+        } else if (strncmp(arg, "--key=", 6) == 0 && arg[6] != 0) {
+            slotKey = &arg[6];
+            setScatterKey(slotKey);
+        } else if (strcmp(arg, "--verify") == 0) {
+            setHideVerification(1);
+        } else if (strcmp(arg, "--stream") == 0) {
+            setStreamingThreshold(0);  // stream every scan
+        } else if (strncmp(arg, "--threads=", 10) == 0) {
+            threadCount = atoi(&arg[10]);
+            if (threadCount <= 0) {
+                printf("ERROR: invalid thread count %s\n", &arg[10]);
+                return 1;
+            }
+        } else {
+            printf("ERROR: unknown option %s\n", arg);
+            return 1;
+        }
+    }
+    *argc = kept;
+    argv[kept] = NULL;
+    return 0;
 }
 
 /**
@@ -482,28 +1234,55 @@ int checkArgs(int argc, char **argv, char **tag, char **jpgFile,
     }
     // Check that tag is valid
     *tag = argv[1];
-    if ((*tag)[0] != '-' || ((*tag)[1] != 'w' && (*tag)[1] != 'r')) {
-        printf("ERROR: invalid tag %s, %c\n", *tag, *tag[1]);
+    if ((*tag)[0] != '-' || ((*tag)[1] != 'w' && (*tag)[1] != 'r' &&
+        (*tag)[1] != 'i' && (*tag)[1] != 'c' && (*tag)[1] != 'W' &&
+        (*tag)[1] != 'R' && (*tag)[1] != 's' && (*tag)[1] != 't' &&
+        (*tag)[1] != 'u')) {
+        printf("ERROR: invalid tag %s, %c\n", *tag, (*tag)[1]);
         return 1;
     }
-    // Basic check on jpeg argument
-    // Make sure file ends in a jpeg extenssion and that it exists
+    // Multi-image modes take a payload file followed by the images
+    if ((*tag)[1] == 'W' || (*tag)[1] == 'R') {
+        *mssgFilePath = argv[2];
+        *jpgFile = argc > 3 ? argv[3] : NULL;
+        if (argc < 4) {
+            puts("ERROR: expected a payload file and at least one image");
+            return 1;
+        }
+        if ((*tag)[1] == 'W' && !fileExists(*mssgFilePath)) {
+            printf("ERROR: If hiding a payload, %s must exist\n",
+                   *mssgFilePath);
+            return 1;
+        }
+        for (int i = 3; i < argc; i++) {
+            if (!hasJpegExtension(argv[i]) || !fileExists(argv[i])) {
+                printf("ERROR: Invalid image file path %s\n", argv[i]);
+                return 1;
+            }
+        }
+        return 0;
+    }
+    // Inspecting and sniffing take a single file or directory of files
     *jpgFile = argv[2];
-    size_t dotIndex = strlen(*jpgFile) - 1;
-    for (; dotIndex > 0; dotIndex--) {
-        if ((*jpgFile)[dotIndex] == '.')
-            break;
+    if ((*tag)[1] == 'i' || (*tag)[1] == 's') {
+        *mssgFilePath = NULL;
+        if (argc != 3 || !fileExists(*jpgFile)) {
+            printf("ERROR: Invalid path %s\n", *jpgFile);
+            return 1;
+        }
+        return 0;
     }
-    if ((*jpgFile)[dotIndex] != '.' ||
-        (strcmp(&((*jpgFile)[dotIndex]), ".jpg") != 0 &&
-        strcmp(&((*jpgFile)[dotIndex]), ".jpeg") != 0 &&
-        strcmp(&((*jpgFile)[dotIndex]), ".jpe") != 0 &&
-        strcmp(&((*jpgFile)[dotIndex]), ".jfif" ) != 0) ||
-        !fileExists(*jpgFile)) {
+    // Basic check on jpeg argument
+    // Make sure file ends in a jpeg extenssion and that it exists
+    if (!hasJpegExtension(*jpgFile) || !fileExists(*jpgFile)) {
         printf("ERROR: Invalid image file path %s\n \tMake sure the file exists and is a jpg\n",
                *jpgFile);
         return 1;
     }
+    if ((*tag)[1] == 'c' || (*tag)[1] == 't') {
+        *mssgFilePath = NULL;
+        return argc != 3;
+    }
     // Do check on optional message text file
     // Make sure it has .txt extenssion and exists if tag is -w
     *mssgFilePath = argc == 2 ? NULL : argv[3];
@@ -519,7 +1298,8 @@ int checkArgs(int argc, char **argv, char **tag, char **jpgFile,
             return 1;
         }
         // Existance check
-        if (*tag[1] == 'w' && !fileExists(*mssgFilePath)) {
+        if (((*tag)[1] == 'w' || (*tag)[1] == 'u') &&
+            !fileExists(*mssgFilePath)) {
             printf("ERROR: If hiding a message, %s must exist\n",*mssgFilePath);
             return 1;
         }
@@ -539,11 +1319,13 @@ int main(int argc, char** argv) {
     char* tag;           // command parameter to use, should be argv[1]
     char* mssgFilePath;  // jpg parameter, should be argv[2]
     char* imgFileName;   // txt parameter, should be NULL or argv[3]
-    if (checkArgs(argc, argv, &tag, &imgFileName, &mssgFilePath)) {
+    if (parseOptions(&argc, argv) ||
+        checkArgs(argc, argv, &tag, &imgFileName, &mssgFilePath)) {
         return 1;
     }
 
-    int (*operation)(char*,char*);
+    int (*operation)(char*,char*) = NULL;
+    int (*shardOperation)(char*,char**,int,int) = NULL;
     switch(tag[1]) {
         case 'r':  // read/extract  message from file
             if (mssgFilePath == NULL) {
@@ -554,17 +1336,61 @@ int main(int argc, char** argv) {
         case 'w':  // write/hide message in file
             operation = &hideMessage;
             break;
+        case 'u':  // replace message hidden in file
+            operation = &updateMessage;
+            break;
+        case 'c':  // print capacity of file
+            operation = &printCapacity;
+            break;
+        case 't':  // transcode file to add restart markers
+            operation = &addRestarts;
+            break;
+        case 'i':  // inspect headers of file or directory
+            operation = &inspectImages;
+            break;
+        case 's':  // list files or directory holding framed payloads
+            operation = &sniffImages;
+            break;
+        case 'W':  // split payload over many files
+            shardOperation = &hideShards;
+            break;
+        case 'R':  // reassemble payload from many files
+            shardOperation = &extractShards;
+            break;
         default:
             // Should never happen because of checkArgs
             return 1;
     }
     
-    if((*operation)(imgFileName, mssgFilePath)) {
-        printf("WARNING, %s failed for %s\n", tag, imgFileName);
+    // Keep stdout to one line per file when inspecting or sniffing
+    FILE *status = tag[1] == 'i' || tag[1] == 's' ? stderr : stdout;
+    int failed;
+    if (shardOperation != NULL) {
+        imgFileName = mssgFilePath;  // report on the payload as a whole
+        failed = (*shardOperation)(mssgFilePath, &argv[3], argc - 3,
+                                   threadCount);
+    } else {
+        if (tag[1] != 'i' && tag[1] != 's') {
+            // A single image can still spread its restart intervals
+            setDecodeThreads(threadCount > 0 ? threadCount :
+                             defaultThreadCount());
+        }
+        failed = (*operation)(imgFileName, mssgFilePath);
+    }
+    releaseThreadArena();
+    if(failed) {
+        fprintf(status, "WARNING, %s failed for %s\n", tag, imgFileName);
     }
     else {
-        printf("COMPLETED TASK FOR %s\n", imgFileName);
+        fprintf(status, "COMPLETED TASK FOR %s\n", imgFileName);
     }
 
+    if (traceFilePath != NULL) {
+        timerPrintSummary();
+        if (timerWriteTrace(traceFilePath)) {
+            return 1;
+        }
+        printf("WROTE TRACE TO %s\n", traceFilePath);
+    }
     return 0;
 }
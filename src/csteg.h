@@ -1,6 +1,8 @@
 #ifndef __C_STEGANOGRAPHY__
 #define __C_STEGANOGRAPHY__
 
+#include <stdio.h>
+#include <stddef.h>
 #include "trie.h"
 /* 
  * struct for holding data for jpeg
@@ -10,19 +12,29 @@
 typedef struct jpegStats {
     unsigned short restartInterval;  // number of MCUs before a restart token
                                      // is encountered
-    unsigned int mcuCount;           // number of MCUs in file
+    unsigned long long mcuCount;     // number of MCUs in file
     unsigned short colorCounts[3];   // color_id - 1 ---> number of color 
                                      //values with that ID in MCU
     unsigned int totalColorCounts;  // sum of all elements in colorCounts
     // color_id - 1 ---> corresponding DC and AC tables
     dhtTrie* dcHuffmanTables[3];
     dhtTrie* acHuffmanTables[3];
-    
+
+    // Frame data only progressive images need, as their scans hold one
+    // channel at a time (see progressive.h)
+    unsigned char progressive;     // 1 for SOF2 frames and 0 for SOF0 ones
+    unsigned short lines;          // height of the image in pixels
+    unsigned short samplesPerLine; // width of the image in pixels
+    unsigned char sampling[3];     // color_id - 1 ---> horizontal << 4 |
+                                   // vertical sampling factor
+    dhts *scanTables;  // tables defined before the first scan of a
+                       // progressive image, owned by it; NULL otherwise
 } jpegStats;
 
 #define JPEG_START 0xFFD8       // Starting two bytes of JPEG file
 #define DQT_START  0xFFDB
 #define START_OF_FRAME_0    0xFFC0
+#define START_OF_FRAME_2    0xFFC2
 #define DRI_MARKER          0xFFDD
 #define DHT_START  0xFFC4
 #define JPEG_SOS   0xFFDA         // Starting two bytes of JPEG IMG data
@@ -31,6 +43,12 @@ typedef struct jpegStats {
 #define EOB 0 // End of line value, says to stop processing DC or AC of MCU
 #define ZRL 0xF0 // Signifies 16 0-value coeficients
 #define MARKER_LENGTH 2  // length of the marker of a JPEG segment
+#define DRI_LENGTH 4     // length field of a DRI segment
+#define RST_MARKER_0 0xD0  // second byte of the first restart marker
+#define RST_MARKER_7 0xD7  // second byte of the last restart marker
+#define RST_MARKERS 8      // restart markers cycle through RST0 to RST7
+#define MAX_CODE_LENGTH 16  // bits of the longest Huffman code
+#define MAX_MCU_BLOCKS 10   // most blocks an MCU may have in a baseline JPEG
 
 // Constants for ids of specific color values:
 #define Y_ID 1   // luminance
@@ -49,6 +67,7 @@ typedef struct jpegStats {
 
 
 #define MAX_MESSAGE_LENGTH_PLUS_1 1001 // max length of user's message.
+#define MESSAGE_CHUNK_SIZE 65536  // bytes of a message file hidden at once
 
 // Bit masks to use for extracting particular bits of message char
 #define FOURTH_2_BITS 3
@@ -58,4 +77,28 @@ typedef struct jpegStats {
 #define NUMBER_OF_BITMASKS 4
 #define BITS_PER_MASK 2
 
+/*
+ * Returns 1 if the path ends in a JPEG file extension and 0 otherwise
+ */
+int hasJpegExtension(const char*);
+
+/*
+ * Parses the headers of the JPG at filePath (opened as imgFile), leaving the
+ * cursor at the start of its scan. Returns NULL (closing imgFile) on failiure
+ */
+jpegStats* getJpegStats(char *filePath, FILE *imgFile);
+
+void destroyJpegStats(jpegStats*);
+
+long getFileSize(char *filePath);
+
+/*
+ * Hides the length bytes of data in the JPG at filePath (opened as imgFile
+ * for reading and writing, cursor at the start of its scan), streaming the
+ * scan through a temporary copy of the image if it is too long to be held in
+ * memory. Returns 0 on success and 1 otherwise
+ */
+int hideBytes(char *filePath, FILE *imgFile, jpegStats*,
+              const unsigned char *data, size_t length, long fileSize);
+
 #endif
@@ -1,30 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include "fifo.h"
 
 #define OK 0
 #define FAILURE 1
 
-/**
- * node of an element in in our fifo queue
-**/
-typedef struct node {
-	void* value;  // element stored in node
-	struct node* next;  // next node in FIFO queue, appended right after node
-} node;
-
-#define NODE_SIZE sizeof(node)
+#define INITIAL_FIFO_CAPACITY 64  // elements held before the ring first grows
 
 /**
  * Implementation invariants:
- *     len == 1 <--> start == end
- *     end->next == NULL
- *     NOTE that when len == 0, it does not matter the values
- *         of the other parameters since queue is basicly inaccessible,
- *         except for iterate, and unmodifyable in this state.
+ *     capacity is a power of two and len <= capacity
+ *     the elements are values[start & (capacity - 1)] up to
+ *         values[(start + len - 1) & (capacity - 1)], oldest first
 **/
 typedef struct fifo {
-	node* start;  // head of queue
-	node* end;    // last element of queue, one most recently added
+	void** values;   // ring of elements
+	size_t start;    // position of head of queue
+	size_t capacity;
 	int len;
 } fifo;
 
@@ -32,47 +24,43 @@ fifo* fifoInit() {
 	fifo* q = malloc(sizeof(fifo));
 	if(q == NULL)
 		return q;
+	q->values = malloc(INITIAL_FIFO_CAPACITY * sizeof(void*));
+	if(q->values == NULL) {
+		free(q);
+		return NULL;
+	}
 	q->len = 0;
-	q->start = NULL;
-	q->end = NULL;
+	q->start = 0;
+	q->capacity = INITIAL_FIFO_CAPACITY;
 	return q;
 }
 
 /**
- * Helpper function for the prepend and append functions.
- * Inserts elem into q assuming that q is currently empty.
+ * Helpper function for the append function.
+ * Doubles the ring of q, which is full, keeping its elements in order.
  * Assumes q is not NULL
 **/
-int addFirst(fifo* q, void* elem) {
-	node* e = malloc(NODE_SIZE);
-	if(e == NULL)
+int growFifo(fifo* q) {
+	void** grown = malloc(2 * q->capacity * sizeof(void*));
+	if(grown == NULL)
 		return FAILURE;
-
-	e->value = elem;
-	e->next = NULL;
-
-	q->start = e;
-	q->end = e;
-	q->len = 1;
+	for(int i = 0; i < q->len; i++)
+		grown[i] = q->values[(q->start + i) & (q->capacity - 1)];
+	free(q->values);
+	q->values = grown;
+	q->start = 0;
+	q->capacity *= 2;
 	return OK;
 }
 
 int fifoAppend(fifo* q, void* elem) {
 	if(q == NULL)
 		return FAILURE;
-	
-	if(q->len == 0)
-		return addFirst(q, elem);
 
-	node* newNode = malloc(NODE_SIZE);
-	if(newNode == NULL) 
+	if((size_t)q->len == q->capacity && growFifo(q) != OK)
 		return FAILURE;
 
-	newNode->value = elem;
-	newNode->next = NULL;
-	
-	q->end->next = newNode;
-	q->end = newNode;
+	q->values[(q->start + q->len) & (q->capacity - 1)] = elem;
 	q->len++;
 	return OK;
 }
@@ -85,11 +73,8 @@ int fifoRemove(fifo* q, void** result) {
 		*result = NULL;
 		return FAILURE;
 	}
-	*result = q->start->value;
-	// Perform removal
-	node* rem = q->start;
-	q->start =rem->next;
-	free(rem);
+	*result = q->values[q->start & (q->capacity - 1)];
+	q->start++;
 	q->len--;
 
 	return OK;
@@ -98,6 +83,7 @@ int fifoRemove(fifo* q, void** result) {
 int destroyFifo (fifo* q) {
 	if(q == NULL || q->len != 0)
 		return FAILURE;
+	free(q->values);
 	free(q);
 	return OK;
 }
@@ -5,10 +5,11 @@
  * fifo is a pointer to a FIFO queue, one in which elements are ordered based on
  * when they were added to the queue and the first item added to the queue is
  * the first to be removed.
- * 
+ *
  * This queue is very basic; it only implements the core functionality of a
  * FIFO queue (appending and popping as fifoAppend and fifoRemove respectively),
- * all that is required for this project
+ * all that is required for this project. Elements are kept in a ring buffer
+ * that doubles when full, so appending does not allocate per element.
  */
 typedef struct fifo fifo;
 
@@ -0,0 +1,176 @@
+#include <pthread.h>
+#include <string.h>
+#include "hash.h"
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#endif
+
+unsigned long long fnv1a64(const void *data, size_t length,
+                           unsigned long long hash) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Constants and round functions of xxHash64 */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define ROTATE_LEFT(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+/**
+ * Reads 8 bytes starting at p as a little-endian number
+ */
+static unsigned long long readWord(const unsigned char *p) {
+    unsigned long long word = 0;
+    for (int i = 7; i >= 0; i--) {
+        word = word << 8 | p[i];
+    }
+    return word;
+}
+
+/**
+ * Mixes one 8 byte word into a lane of the hash
+ */
+static unsigned long long hashRound(unsigned long long lane,
+                                    unsigned long long word) {
+    lane += word * PRIME64_2;
+    lane = ROTATE_LEFT(lane, 31);
+    return lane * PRIME64_1;
+}
+
+/**
+ * Folds a lane into the final hash value
+ */
+static unsigned long long mergeLane(unsigned long long hash,
+                                    unsigned long long lane) {
+    hash ^= hashRound(0, lane);
+    return hash * PRIME64_1 + PRIME64_4;
+}
+
+unsigned long long hash64(const void *data, size_t length,
+                          unsigned long long seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + length;
+    unsigned long long hash;
+
+    if (length >= 32) {
+        // Four independent lanes let consecutive words be mixed in parallel
+        unsigned long long lanes[4] = {seed + PRIME64_1 + PRIME64_2,
+                                       seed + PRIME64_2, seed,
+                                       seed - PRIME64_1};
+        for (; p + 32 <= end; p += 32) {
+            for (int i = 0; i < 4; i++) {
+                lanes[i] = hashRound(lanes[i], readWord(p + 8*i));
+            }
+        }
+        hash = ROTATE_LEFT(lanes[0], 1) + ROTATE_LEFT(lanes[1], 7) +
+               ROTATE_LEFT(lanes[2], 12) + ROTATE_LEFT(lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            hash = mergeLane(hash, lanes[i]);
+        }
+    } else {
+        hash = seed + PRIME64_5;
+    }
+    hash += length;
+
+    // Mix in the last bytes that did not fill a round
+    for (; p + 8 <= end; p += 8) {
+        hash ^= hashRound(0, readWord(p));
+        hash = ROTATE_LEFT(hash, 27) * PRIME64_1 + PRIME64_4;
+    }
+    for (; p < end; p++) {
+        hash ^= *p * PRIME64_5;
+        hash = ROTATE_LEFT(hash, 11) * PRIME64_1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+#define CRC32C_POLYNOMIAL 0x82F63B78  // reversed Castagnoli polynomial
+
+/* Software CRC32C, consuming 8 bytes at once through 8 tables */
+static unsigned int crcTables[8][256];
+static unsigned int (*crcUpdate)(unsigned int, const unsigned char*, size_t);
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * Updates the (inverted) crc with the length bytes at p, 8 bytes at a time
+ */
+static unsigned int crcSoftware(unsigned int crc, const unsigned char *p,
+                                size_t length) {
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned int low = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+                                  (unsigned int)p[3] << 24);
+        crc = crcTables[7][low & 0xFF] ^ crcTables[6][(low >> 8) & 0xFF] ^
+              crcTables[5][(low >> 16) & 0xFF] ^ crcTables[4][low >> 24] ^
+              crcTables[3][p[4]] ^ crcTables[2][p[5]] ^
+              crcTables[1][p[6]] ^ crcTables[0][p[7]];
+    }
+    for (; length > 0; p++, length--) {
+        crc = crcTables[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HAVE_SSE42_CRC
+/**
+ * Same as crcSoftware() using the crc32 instruction on 8 byte words
+ */
+__attribute__((target("sse4.2")))
+static unsigned int crcHardware(unsigned int crc, const unsigned char *p,
+                                size_t length) {
+    unsigned long long wide = crc;
+    for (; length >= 8; p += 8, length -= 8) {
+        unsigned long long word;
+        memcpy(&word, p, 8);  // p need not be aligned
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = wide;
+    for (; length > 0; p++, length--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * Builds the tables of crcSoftware() and picks the fastest implementation
+ */
+static void initCrc(void) {
+    for (int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        }
+        crcTables[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            unsigned int previous = crcTables[t - 1][i];
+            crcTables[t][i] = crcTables[0][previous & 0xFF] ^ (previous >> 8);
+        }
+    }
+    crcUpdate = crcSoftware;
+    #ifdef HAVE_SSE42_CRC
+        if (__builtin_cpu_supports("sse4.2")) {
+            crcUpdate = crcHardware;
+        }
+    #endif
+}
+
+unsigned int crc32c(unsigned int crc, const void *data, size_t length) {
+    pthread_once(&crcOnce, initCrc);
+    return ~crcUpdate(~crc, data, length);
+}
@@ -0,0 +1,30 @@
+#ifndef __CSTEG_HASH__
+#define __CSTEG_HASH__
+#include <stddef.h>
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL  // starting value of a hash
+#define FNV_PRIME 0x100000001b3ULL
+
+/*
+ * Returns the 64-bit FNV-1a hash of the bytes in data, continuing from hash.
+ * Pass FNV_OFFSET_BASIS as hash to start a new hash.
+ */
+unsigned long long fnv1a64(const void *data, size_t length,
+                           unsigned long long hash);
+
+/*
+ * Returns a 64-bit hash of the bytes in data using seed. Processes 32 bytes
+ * per round, so it is much faster than fnv1a64() on large inputs such as the
+ * contents of a whole image.
+ */
+unsigned long long hash64(const void *data, size_t length,
+                          unsigned long long seed);
+
+/*
+ * Returns the CRC32C (Castagnoli) checksum of the bytes in data, continuing
+ * from crc. Pass 0 as crc to start a new checksum. Uses the SSE4.2 crc32
+ * instruction when the CPU has it.
+ */
+unsigned int crc32c(unsigned int crc, const void *data, size_t length);
+
+#endif
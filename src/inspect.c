@@ -0,0 +1,330 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "inspect.h"
+#include "batch.h"
+#include "csteg.h"
+#include "hash.h"
+#include "ioring.h"
+#include "timer.h"
+
+#define MAX_COMPONENTS 4
+
+/**
+ * Window over a file that is only refilled when a segment lies outside of it,
+ * so the headers of most files are parsed from a single read.
+ */
+typedef struct headerReader {
+    FILE *file;
+    long long fileSize;
+    long long bufferStart;  // file offset of buffer[0]
+    size_t bufferLength;    // valid bytes in buffer
+    unsigned char buffer[INSPECT_READ_SIZE];
+} headerReader;
+
+/**
+ * Text being built for one line of output
+ */
+typedef struct jsonLine {
+    char *text;
+    size_t size;
+    size_t length;
+} jsonLine;
+
+/**
+ * Returns a pointer to length bytes of the file starting at offset, reading
+ * them in if they are not buffered yet. Returns NULL if they do not exist.
+ */
+static const unsigned char* fetchBytes(headerReader *reader, long long offset,
+                                       size_t length) {
+    if (offset >= reader->bufferStart &&
+        offset + length <= reader->bufferStart + reader->bufferLength) {
+        return &reader->buffer[offset - reader->bufferStart];
+    }
+    if (length > INSPECT_READ_SIZE || offset + length > reader->fileSize) {
+        return NULL;
+    }
+    if (fseek(reader->file, offset, SEEK_SET) != 0) {
+        return NULL;
+    }
+    size_t bytesRead = fread(reader->buffer, 1, INSPECT_READ_SIZE,
+                             reader->file);
+    if (bytesRead < length) {
+        return NULL;
+    }
+    reader->bufferStart = offset;
+    reader->bufferLength = bytesRead;
+    return reader->buffer;
+}
+
+/**
+ * Appends printf-style formatted text to line, silently truncating it if
+ * there is no more space
+ */
+static void appendJson(jsonLine *line, const char *format, ...) {
+    if (line->length >= line->size)
+        return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(&line->text[line->length],
+                            line->size - line->length, format, args);
+    va_end(args);
+    if (written > 0)
+        line->length += written;
+    if (line->length >= line->size)
+        line->length = line->size - 1;
+}
+
+/**
+ * Appends s to line as a quoted JSON string
+ */
+static void appendJsonString(jsonLine *line, const char *s) {
+    appendJson(line, "\"");
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            appendJson(line, "\\%c", c);
+        } else if (c < 0x20) {
+            appendJson(line, "\\u%04x", c);
+        } else {
+            appendJson(line, "%c", c);
+        }
+    }
+    appendJson(line, "\"");
+}
+
+/**
+ * Appends the tables of one DHT segment (payload of the given length, without
+ * marker and length bytes) to line, mixing every table into *setHash.
+ * Returns 0 on success and 1 if the segment is malformed
+ */
+static int describeDht(jsonLine *line, const unsigned char *payload,
+                       size_t length, int *tablesSeen,
+                       unsigned long long *setHash) {
+    size_t position = 0;
+    while (position < length) {
+        if (position + 1 + DHT_COUNTS_LENGTH > length)
+            return 1;
+        unsigned char indexData = payload[position];
+        const unsigned char *table = &payload[position + 1];
+        size_t symbols = 0;
+        for (int i = 0; i < DHT_COUNTS_LENGTH; i++) {
+            symbols += table[i];
+        }
+        size_t tableLength = DHT_COUNTS_LENGTH + symbols;
+        if (position + 1 + tableLength > length)
+            return 1;
+
+        // Identity of a table is its counts and symbols, not its slot
+        unsigned long long hash = fnv1a64(table, tableLength,
+                                          FNV_OFFSET_BASIS);
+        *setHash = fnv1a64(&payload[position], 1 + tableLength, *setHash);
+        appendJson(line, "%s{\"class\":%u,\"id\":%u,\"symbols\":%zu,"
+                   "\"hash\":\"%016llx\"}", *tablesSeen ? "," : "",
+                   GET_4_MSBs(indexData), GET_FIRST_4_BITS(indexData),
+                   symbols, hash);
+        (*tablesSeen)++;
+        position += 1 + tableLength;
+    }
+    return 0;
+}
+
+/**
+ * Writes an error line for path into line and returns 1
+ */
+static int inspectError(jsonLine *line, const char *path, const char *error) {
+    line->length = 0;
+    appendJson(line, "{\"file\":");
+    appendJsonString(line, path);
+    appendJson(line, ",\"error\":\"%s\"}", error);
+    return 1;
+}
+
+/**
+ * Walks the segments of the file in reader up to the SOS segment, describing
+ * them in line. Returns NULL on success, else a description of the error
+ */
+static const char* describeHeaders(headerReader *reader, jsonLine *line) {
+    const unsigned char *bytes = fetchBytes(reader, 0, MARKER_LENGTH);
+    if (bytes == NULL || (bytes[0] << 8 | bytes[1]) != JPEG_START)
+        return "not a JPEG file";
+
+    // Table and frame data are gathered here, then appended in a fixed order
+    char tables[INSPECT_LINE_SIZE / 2] = {0};
+    jsonLine tableLine = {tables, sizeof(tables), 0};
+    int tablesSeen = 0;
+    unsigned long long setHash = FNV_OFFSET_BASIS;
+    unsigned int restartInterval = 0;
+    int sawFrame = 0;
+
+    long long offset = MARKER_LENGTH;
+    while (1) {
+        bytes = fetchBytes(reader, offset, 2*MARKER_LENGTH);
+        if (bytes == NULL)
+            return "truncated before start of scan";
+        if (bytes[0] != 0xFF)
+            return "invalid segment marker";
+        if (bytes[1] == 0xFF) {  // fill byte before a marker
+            offset++;
+            continue;
+        }
+        unsigned short marker = bytes[0] << 8 | bytes[1];
+        unsigned short length = bytes[2] << 8 | bytes[3];
+        if (marker == JPEG_END)
+            return "no start of scan";
+        if (length < MARKER_LENGTH)
+            return "invalid segment length";
+        const unsigned char *payload = fetchBytes(reader,
+                                                  offset + 2*MARKER_LENGTH,
+                                                  length - MARKER_LENGTH);
+        if (payload == NULL)
+            return "truncated segment";
+        size_t payloadLength = length - MARKER_LENGTH;
+
+        if (marker == DHT_START) {
+            if (describeDht(&tableLine, payload, payloadLength, &tablesSeen,
+                            &setHash))
+                return "invalid DHT segment";
+        } else if (marker == DRI_MARKER) {
+            if (payloadLength < 2)
+                return "invalid DRI segment";
+            restartInterval = payload[0] << 8 | payload[1];
+        } else if (marker >= START_OF_FRAME_0 && marker <= 0xFFCF &&
+                   marker != DHT_START && marker != 0xFFC8 &&
+                   marker != 0xFFCC) {
+            // Any SOFn; other fields only make sense once per image
+            if (sawFrame || payloadLength < 6)
+                return "invalid SOF segment";
+            unsigned char n = payload[5];
+            if (n == 0 || n > MAX_COMPONENTS || payloadLength < 6 + 3*n)
+                return "invalid SOF segment";
+            appendJson(line, ",\"sof\":%d,\"precision\":%u,\"width\":%u,"
+                       "\"height\":%u,\"components\":[",
+                       marker - START_OF_FRAME_0, payload[0],
+                       payload[3] << 8 | payload[4],
+                       payload[1] << 8 | payload[2]);
+            for (int i = 0; i < n; i++) {
+                const unsigned char *component = &payload[6 + 3*i];
+                appendJson(line, "%s{\"id\":%u,\"h\":%u,\"v\":%u,\"tq\":%u}",
+                           i ? "," : "", component[0],
+                           GET_4_MSBs(component[1]),
+                           GET_FIRST_4_BITS(component[1]), component[2]);
+            }
+            appendJson(line, "]");
+            sawFrame = 1;
+        } else if (marker == JPEG_SOS) {
+            if (!sawFrame)
+                return "start of scan before frame";
+            unsigned char n = payloadLength ? payload[0] : 0;
+            if (n == 0 || n > MAX_COMPONENTS || payloadLength != 1 + 2*n + 3)
+                return "invalid SOS segment";
+            appendJson(line, ",\"restartInterval\":%u,\"huffman\":[%s],"
+                       "\"huffmanSet\":\"%016llx\",\"scan\":[",
+                       restartInterval, tables, setHash);
+            for (int i = 0; i < n; i++) {
+                const unsigned char *component = &payload[1 + 2*i];
+                appendJson(line, "%s{\"id\":%u,\"dc\":%u,\"ac\":%u}",
+                           i ? "," : "", component[0],
+                           GET_4_MSBs(component[1]),
+                           GET_FIRST_4_BITS(component[1]));
+            }
+            appendJson(line, "],\"scanOffset\":%lld}",
+                       offset + MARKER_LENGTH + length);
+            return NULL;
+        }
+        offset += MARKER_LENGTH + length;
+    }
+}
+
+/**
+ * Same as inspectFile() for the JPEG at path opened as file (fileSize bytes
+ * long, or NULL if it could not be opened), which gets closed
+ */
+static int inspectStream(const char *path, FILE *file, long long fileSize,
+                         char *text, size_t lineSize) {
+    jsonLine line = {text, lineSize, 0};
+    if (file == NULL)
+        return inspectError(&line, path, "cannot open file");
+    headerReader *reader = malloc(sizeof(headerReader));
+    if (reader == NULL) {
+        fclose(file);
+        return inspectError(&line, path, "out of memory");
+    }
+    reader->file = file;
+    reader->fileSize = fileSize;
+    reader->bufferStart = 0;
+    reader->bufferLength = 0;
+
+    appendJson(&line, "{\"file\":");
+    appendJsonString(&line, path);
+    appendJson(&line, ",\"size\":%lld", reader->fileSize);
+    const char *error = describeHeaders(reader, &line);
+
+    fclose(reader->file);
+    free(reader);
+    if (error != NULL)
+        return inspectError(&line, path, error);
+    if (line.length >= lineSize - 1)
+        return inspectError(&line, path, "description too long");
+    return 0;
+}
+
+int inspectFile(const char *path, char *text, size_t lineSize) {
+    FILE *file = fopen(path, "rb");
+    struct stat info;
+    if (file != NULL && fstat(fileno(file), &info) != 0) {
+        fclose(file);
+        file = NULL;
+    }
+    return inspectStream(path, file, file ? info.st_size : 0, text,
+                         lineSize);
+}
+
+/**
+ * Files being inspected by a call to inspectPath()
+ */
+typedef struct inspectJobs {
+    char **files;
+    filePrefetch *prefetch;  // first INSPECT_READ_SIZE bytes of every file
+} inspectJobs;
+
+/**
+ * runBatch() job: inspects one file and prints its line
+ */
+static int inspectJob(size_t index, void *context) {
+    inspectJobs *jobs = context;
+    char line[INSPECT_LINE_SIZE];
+    phaseTimer timer;
+    timerBegin(&timer, "inspect", jobs->files[index]);
+    long fileSize = 0;
+    FILE *file = openPrefetched(jobs->prefetch, index, &fileSize);
+    int result = inspectStream(jobs->files[index], file, fileSize, line,
+                               sizeof(line));
+    timerEnd(&timer);
+
+    flockfile(stdout);  // keep lines from different threads whole
+    fputs(line, stdout);
+    fputc('\n', stdout);
+    funlockfile(stdout);
+    return result;
+}
+
+int inspectPath(char *path, int threadCount) {
+    inspectJobs jobs;
+    size_t fileCount;
+    if (collectJpegFiles(path, &jobs.files, &fileCount)) {
+        return 1;
+    }
+    jobs.prefetch = prefetchFiles(jobs.files, fileCount, INSPECT_READ_SIZE);
+    if (jobs.prefetch == NULL) {
+        puts("ERROR: cannot start reading files");
+        destroyFileList(jobs.files, fileCount);
+        return 1;
+    }
+    size_t failures = runBatch(fileCount, threadCount, inspectJob, &jobs);
+    destroyPrefetch(jobs.prefetch);
+    destroyFileList(jobs.files, fileCount);
+    return failures != 0;
+}
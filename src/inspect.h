@@ -0,0 +1,22 @@
+#ifndef __CSTEG_INSPECT__
+#define __CSTEG_INSPECT__
+#include <stddef.h>
+
+#define INSPECT_READ_SIZE 65536  // bytes read at once while parsing headers
+#define INSPECT_LINE_SIZE 4096   // max length of one line of inspect output
+
+/*
+ * Parses the headers (SOF, DHT, DRI and SOS) of the JPEG at path without
+ * building any Huffman tables and writes a one line JSON description of it,
+ * including a hash of every Huffman table, into line. Returns 0 on success
+ * and 1 otherwise, in which case line describes the error.
+ */
+int inspectFile(const char *path, char *line, size_t lineSize);
+
+/*
+ * Prints one JSON line per JPEG file found under path (a file or directory)
+ * using threadCount threads. Returns 0 if every file could be inspected
+ */
+int inspectPath(char *path, int threadCount);
+
+#endif
@@ -0,0 +1,831 @@
+#define _GNU_SOURCE  // fopencookie()
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "ioring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define USE_IO_URING
+#endif
+
+#define MAX_TRANSFER (1U << 30)  // most bytes asked of the kernel at once
+#define MAX_SPARE_SIZE (1UL << 20)  // largest buffer kept for another file
+#define PREFETCH_TAIL 16            // last bytes of a file read ahead
+// Space for the tail: stdio reads whole blocks of BUFSIZ bytes after seeking
+#define TAIL_SPACE (BUFSIZ + PREFETCH_TAIL)
+
+#define PREFETCH_QUEUED 0   // file not read yet
+#define PREFETCH_READ 1     // start of file is in memory
+#define PREFETCH_SKIPPED 2  // file is left for its job to open itself
+#define PREFETCH_CLOSED 3   // file was read and its stream closed
+
+struct ioRing {
+    unsigned int depth;
+    unsigned int inFlight;  // queued requests not returned by ioRingWait()
+    ioRequest **done;       // requests done with pread() or pwrite()
+    unsigned int doneStart;
+    unsigned int doneCount;
+    int fd;                 // io_uring, -1 if pread() and pwrite() are used
+#ifdef USE_IO_URING
+    unsigned int toSubmit;  // queued requests not sent to the kernel yet
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;           // same as sqRing if the kernel maps both at once
+    size_t cqRingSize;
+    size_t sqesSize;
+#endif
+};
+
+/**
+ * Start of a file read ahead of the job that opens it
+ */
+typedef struct prefetchedFile {
+    ioRequest read;      // read.buffer holds read.done bytes of the file
+    size_t capacity;     // bytes allocated for read.buffer
+    ioRequest tail;      // end of the file, if read does not reach it
+    int readsLeft;       // requests of the file in flight
+    long long fileSize;
+    int state;           // one of the PREFETCH_ states
+} prefetchedFile;
+
+struct filePrefetch {
+    char **paths;
+    size_t count;
+    size_t readLimit;
+    prefetchedFile *files;
+    size_t heldFiles;        // files being read or open
+    size_t heldBytes;        // buffer space of held files
+    unsigned char *spares[PREFETCH_FILES];  // buffers of closed files
+    size_t spareSizes[PREFETCH_FILES];
+    size_t spareCount;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t fileRead;   // signalled when a file is read or skipped
+    pthread_cond_t roomFreed;  // signalled when enough files are closed
+    pthread_t thread;
+};
+
+/**
+ * Position of a stream opened by openPrefetched()
+ */
+typedef struct prefetchCursor {
+    filePrefetch *prefetch;
+    prefetchedFile *file;
+    long long position;
+} prefetchCursor;
+
+/**
+ * Does what is left of request with open(), pread() or pwrite()
+ */
+static void transferRest(ioRequest *request) {
+    if (request->kind == IO_OPEN) {
+        request->fd = open((char*)request->buffer, O_RDONLY);
+        request->error = request->fd < 0 ? errno : 0;
+        return;
+    }
+    while (request->done < request->length) {
+        size_t left = request->length - request->done;
+        ssize_t moved = request->kind == IO_WRITE ?
+            pwrite(request->fd, &request->buffer[request->done], left,
+                   request->offset + request->done) :
+            pread(request->fd, &request->buffer[request->done], left,
+                  request->offset + request->done);
+        if (moved < 0 && errno == EINTR) {
+            continue;
+        }
+        if (moved < 0) {
+            request->error = errno;
+            return;
+        }
+        if (moved == 0) {
+            return;  // end of file
+        }
+        request->done += moved;
+    }
+}
+
+#ifdef USE_IO_URING
+/**
+ * Unmaps the rings of ring and closes its io_uring
+ */
+static void closeUring(ioRing *ring) {
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED &&
+        ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * Sets up an io_uring for ring and maps its rings.
+ * Returns 0 on success and 1 if io_uring cannot be used
+ */
+static int openUring(ioRing *ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, ring->depth, &params);
+    if (ring->fd < 0) {
+        ring->fd = -1;
+        return 1;
+    }
+    ring->sqRingSize = params.sq_off.array +
+                       params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes +
+                       params.cq_entries * sizeof(struct io_uring_cqe);
+    int singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap && ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cqRing = singleMap || ring->sqRing == MAP_FAILED ? ring->sqRing :
+                   mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring->cqRing == MAP_FAILED ? MAP_FAILED :
+                 mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        closeUring(ring);
+        return 1;
+    }
+
+    unsigned char *sq = ring->sqRing;
+    ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+    unsigned char *cq = ring->cqRing;
+    ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+/**
+ * Adds a submission entry for what is left of request to ring's queue
+ */
+static void queueEntry(ioRing *ring, ioRequest *request) {
+    unsigned int tail = *ring->sqTail;  // only this thread moves the tail
+    unsigned int index = tail & ring->sqMask;
+    struct io_uring_sqe *entry = &ring->sqes[index];
+    size_t left = request->length - request->done;
+    memset(entry, 0, sizeof(struct io_uring_sqe));
+    if (request->kind == IO_OPEN) {
+        entry->opcode = IORING_OP_OPENAT;
+        entry->fd = AT_FDCWD;
+        entry->addr = (uintptr_t)request->buffer;
+        entry->open_flags = O_RDONLY;
+    } else {
+        entry->opcode = request->kind == IO_WRITE ? IORING_OP_WRITE :
+                        IORING_OP_READ;
+        entry->fd = request->fd;
+        entry->addr = (uintptr_t)&request->buffer[request->done];
+        entry->len = left < MAX_TRANSFER ? left : MAX_TRANSFER;
+        entry->off = request->offset + request->done;
+    }
+    entry->user_data = (uintptr_t)request;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+/**
+ * Accounts for result, the outcome of the latest entry of request, queueing
+ * another entry for what is left of it if needed.
+ * Returns 1 if request is done and 0 otherwise
+ */
+static int finishEntry(ioRing *ring, ioRequest *request, int result) {
+    if (result == -EINTR || result == -EAGAIN) {
+        queueEntry(ring, request);
+        return 0;
+    }
+    if (result == -EINVAL) {
+        // Kernels before 5.6 have no opens or plain reads and writes
+        transferRest(request);
+        return 1;
+    }
+    if (result < 0) {
+        request->error = -result;
+        return 1;
+    }
+    if (request->kind == IO_OPEN) {
+        request->fd = result;
+        return 1;
+    }
+    request->done += result;
+    if (result == 0 || request->done == request->length) {
+        return 1;
+    }
+    queueEntry(ring, request);  // short transfer
+    return 0;
+}
+
+/**
+ * Same as ioRingWait() for a ring using io_uring
+ */
+static ioRequest* waitUring(ioRing *ring) {
+    while (1) {
+        unsigned int head = *ring->cqHead;  // only this thread moves the head
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *entry = &ring->cqes[head & ring->cqMask];
+            ioRequest *request = (ioRequest*)(uintptr_t)entry->user_data;
+            int result = entry->res;
+            __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+            if (finishEntry(ring, request, result)) {
+                return request;
+            }
+            continue;
+        }
+        // Send every queued entry and wait for one to complete in one call
+        int sent = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0);
+        if (sent < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            return NULL;
+        }
+        if (sent > 0) {
+            ring->toSubmit -= sent;
+        }
+    }
+}
+#endif
+
+ioRing* ioRingInit(unsigned int depth) {
+    ioRing *ring = calloc(1, sizeof(ioRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->depth = depth != 0 ? depth : 1;
+    ring->fd = -1;
+    #ifdef USE_IO_URING
+        if (openUring(ring) == 0) {
+            return ring;
+        }
+    #endif
+    ring->done = malloc(ring->depth * sizeof(ioRequest*));
+    if (ring->done == NULL) {
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void destroyIoRing(ioRing *ring) {
+    if (ring == NULL) {
+        return;
+    }
+    #ifdef USE_IO_URING
+        if (ring->fd >= 0) {
+            closeUring(ring);
+        }
+    #endif
+    free(ring->done);
+    free(ring);
+}
+
+int ioRingSubmit(ioRing *ring, ioRequest *request) {
+    if (ring->inFlight == ring->depth) {
+        return 1;
+    }
+    ring->inFlight++;
+    request->done = 0;
+    request->error = 0;
+    #ifdef USE_IO_URING
+        if (ring->fd >= 0) {
+            queueEntry(ring, request);
+            return 0;
+        }
+    #endif
+    transferRest(request);
+    ring->done[(ring->doneStart + ring->doneCount) % ring->depth] = request;
+    ring->doneCount++;
+    return 0;
+}
+
+ioRequest* ioRingWait(ioRing *ring) {
+    if (ring->inFlight == 0) {
+        return NULL;
+    }
+    ioRequest *request;
+    #ifdef USE_IO_URING
+        if (ring->fd >= 0) {
+            request = waitUring(ring);
+            ring->inFlight -= request != NULL;
+            return request;
+        }
+    #endif
+    request = ring->done[ring->doneStart];
+    ring->doneStart = (ring->doneStart + 1) % ring->depth;
+    ring->doneCount--;
+    ring->inFlight--;
+    return request;
+}
+
+size_t ioRingRun(ioRing *ring, ioRequest *requests, size_t count) {
+    size_t next = 0;      // next request to submit
+    size_t finished = 0;  // requests returned by ioRingWait()
+    size_t failures = 0;
+    while (finished < count) {
+        while (next < count && ioRingSubmit(ring, &requests[next]) == 0) {
+            next++;
+        }
+        ioRequest *request = ioRingWait(ring);
+        if (request == NULL) {
+            return failures + count - finished;
+        }
+        finished++;
+        failures += request->error != 0 || request->done != request->length;
+    }
+    return failures;
+}
+
+/**
+ * Turns the open request of file, once done, into a read of its first
+ * readLimit bytes (all of it if readLimit is 0) and sets up its tail to read
+ * the block holding its last PREFETCH_TAIL bytes. Their memory is the
+ * buffer of a closed file if one is large enough, since fresh memory costs a
+ * page fault every 4 KiB. Returns 0 on success and 1 otherwise
+ */
+static int startRead(filePrefetch *prefetch, prefetchedFile *file) {
+    struct stat info;
+    if (fstat(file->read.fd, &info) != 0) {
+        return 1;
+    }
+    size_t readLimit = prefetch->readLimit;
+    file->read.kind = IO_READ;
+    file->read.buffer = NULL;
+    file->fileSize = info.st_size;
+    file->read.length = readLimit != 0 && (long long)readLimit < info.st_size ?
+                        readLimit : (size_t)info.st_size;
+    if (file->read.length != (size_t)info.st_size) {
+        long long tailStart = (info.st_size - PREFETCH_TAIL) &
+                              ~(long long)(BUFSIZ - 1);
+        if (tailStart < (long long)file->read.length) {
+            tailStart = file->read.length;
+        }
+        ioRequest tail = {file->read.fd, IO_READ, NULL,
+                          info.st_size - tailStart, tailStart};
+        tail.context = file;
+        file->tail = tail;
+    }
+    // Buffers of readLimit bytes and a tail fit any file
+    file->capacity = readLimit != 0 && readLimit <= MAX_SPARE_SIZE ?
+                     readLimit + TAIL_SPACE :
+                     file->read.length + file->tail.length;
+    pthread_mutex_lock(&prefetch->lock);
+    if (prefetch->spareCount != 0 &&
+        prefetch->spareSizes[prefetch->spareCount - 1] >= file->capacity) {
+        prefetch->spareCount--;
+        file->read.buffer = prefetch->spares[prefetch->spareCount];
+        file->capacity = prefetch->spareSizes[prefetch->spareCount];
+    }
+    prefetch->heldBytes += file->capacity;
+    pthread_mutex_unlock(&prefetch->lock);
+    if (file->read.buffer == NULL) {
+        file->read.buffer = malloc(file->capacity ? file->capacity : 1);
+    }
+    if (file->read.buffer == NULL) {
+        return 1;
+    }
+    file->tail.buffer = &file->read.buffer[file->read.length];
+    return 0;
+}
+
+/**
+ * Closes file and frees its memory, moving it to state. Once half of what
+ * prefetch may hold is free it is woken to read more, so that it reads
+ * files in batches. Assumes prefetch->lock is held
+ */
+static void releaseFile(filePrefetch *prefetch, prefetchedFile *file,
+                        int state) {
+    if (file->read.fd >= 0) {
+        close(file->read.fd);
+        file->read.fd = -1;
+    }
+    if (file->read.buffer != NULL && file->capacity <= MAX_SPARE_SIZE &&
+        prefetch->spareCount < PREFETCH_FILES) {
+        prefetch->spares[prefetch->spareCount] = file->read.buffer;
+        prefetch->spareSizes[prefetch->spareCount] = file->capacity;
+        prefetch->spareCount++;
+    } else {
+        free(file->read.buffer);
+    }
+    file->read.buffer = NULL;
+    prefetch->heldFiles--;
+    prefetch->heldBytes -= file->capacity;
+    file->state = state;
+    if (state == PREFETCH_SKIPPED) {
+        pthread_cond_broadcast(&prefetch->fileRead);
+    }
+    if (prefetch->heldFiles == 0 ||
+        (prefetch->heldFiles <= PREFETCH_FILES / 2 &&
+         prefetch->heldBytes <= PREFETCH_BYTES / 2)) {
+        pthread_cond_signal(&prefetch->roomFreed);
+    }
+}
+
+/**
+ * Thread body of a filePrefetch: opens and reads files in order, keeping up
+ * to IO_RING_DEPTH requests in flight while there is room to hold the files
+ */
+static void* prefetchThread(void *arg) {
+    filePrefetch *prefetch = arg;
+    ioRing *ring = ioRingInit(IO_RING_DEPTH);
+    size_t next = 0;        // next file to open
+    unsigned int busy = 0;  // files with up to 2 requests in flight each
+    pthread_mutex_lock(&prefetch->lock);
+    while (ring != NULL) {
+        int more = !prefetch->stop && next < prefetch->count;
+        // A file too large to fit in the budget is read once nothing is held
+        int room = prefetch->heldFiles == 0 ||
+                   (prefetch->heldFiles < PREFETCH_FILES &&
+                    prefetch->heldBytes < PREFETCH_BYTES);
+        if (more && busy < ring->depth / 2 && room) {
+            // Even opening a file may wait on storage
+            prefetchedFile *file = &prefetch->files[next];
+            ioRequest open = {-1, IO_OPEN, (unsigned char*)prefetch->paths[next]};
+            open.context = file;
+            file->read = open;
+            prefetch->heldFiles++;
+            next++;
+            pthread_mutex_unlock(&prefetch->lock);
+            int failed = ioRingSubmit(ring, &file->read);
+            pthread_mutex_lock(&prefetch->lock);
+            if (failed) {
+                releaseFile(prefetch, file, PREFETCH_SKIPPED);
+            } else {
+                busy++;
+            }
+        } else if (ring->inFlight != 0) {
+            pthread_mutex_unlock(&prefetch->lock);
+            ioRequest *request = ioRingWait(ring);
+            prefetchedFile *file = request ? request->context : NULL;
+            int opened = request != NULL && request->kind == IO_OPEN;
+            if (opened) {
+                file->readsLeft = request->error == 0 &&
+                                  !startRead(prefetch, file) &&
+                                  !ioRingSubmit(ring, &file->read);
+                if (file->readsLeft != 0 && file->tail.length != 0) {
+                    file->readsLeft += !ioRingSubmit(ring, &file->tail);
+                }
+            } else if (request != NULL) {
+                file->readsLeft--;
+            }
+            pthread_mutex_lock(&prefetch->lock);
+            if (request == NULL) {
+                break;  // requests in flight are lost along with their memory
+            }
+            if (file->readsLeft != 0) {
+                continue;
+            }
+            busy--;
+            if (opened || file->read.error != 0 || file->tail.error != 0) {
+                releaseFile(prefetch, file, PREFETCH_SKIPPED);
+            } else {
+                file->state = PREFETCH_READ;
+                pthread_cond_broadcast(&prefetch->fileRead);
+            }
+        } else if (more) {
+            pthread_cond_wait(&prefetch->roomFreed, &prefetch->lock);
+        } else {
+            break;
+        }
+    }
+    // Jobs open whatever could not be read for them
+    for (size_t i = 0; i < prefetch->count; i++) {
+        if (prefetch->files[i].state == PREFETCH_QUEUED) {
+            prefetch->files[i].state = PREFETCH_SKIPPED;
+        }
+    }
+    pthread_cond_broadcast(&prefetch->fileRead);
+    pthread_mutex_unlock(&prefetch->lock);
+    if (ring != NULL && ring->inFlight == 0) {
+        destroyIoRing(ring);
+    }
+    return NULL;
+}
+
+filePrefetch* prefetchFiles(char **paths, size_t count, size_t readLimit) {
+    filePrefetch *prefetch = calloc(1, sizeof(filePrefetch));
+    if (prefetch == NULL) {
+        return NULL;
+    }
+    prefetch->files = calloc(count ? count : 1, sizeof(prefetchedFile));
+    if (prefetch->files == NULL) {
+        free(prefetch);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        prefetch->files[i].read.fd = -1;
+        prefetch->files[i].state = PREFETCH_QUEUED;
+    }
+    prefetch->paths = paths;
+    prefetch->count = count;
+    prefetch->readLimit = readLimit;
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->fileRead, NULL);
+    pthread_cond_init(&prefetch->roomFreed, NULL);
+    if (pthread_create(&prefetch->thread, NULL, prefetchThread, prefetch)) {
+        pthread_mutex_destroy(&prefetch->lock);
+        pthread_cond_destroy(&prefetch->fileRead);
+        pthread_cond_destroy(&prefetch->roomFreed);
+        free(prefetch->files);
+        free(prefetch);
+        return NULL;
+    }
+    return prefetch;
+}
+
+/**
+ * fopencookie() read function of streams made by openPrefetched()
+ */
+static ssize_t readPrefetched(void *cookie, char *buffer, size_t size) {
+    prefetchCursor *cursor = cookie;
+    prefetchedFile *file = cursor->file;
+    if (cursor->position >= file->fileSize) {
+        return 0;
+    }
+    if ((long long)size > file->fileSize - cursor->position) {
+        size = file->fileSize - cursor->position;
+    }
+    long long tailEnd = file->tail.offset + file->tail.done;
+    if (cursor->position < (long long)file->read.done) {
+        if ((long long)size > (long long)file->read.done - cursor->position) {
+            size = file->read.done - cursor->position;
+        }
+        memcpy(buffer, &file->read.buffer[cursor->position], size);
+    } else if (cursor->position >= file->tail.offset &&
+               cursor->position < tailEnd) {
+        if ((long long)size > tailEnd - cursor->position) {
+            size = tailEnd - cursor->position;
+        }
+        memcpy(buffer,
+               &file->tail.buffer[cursor->position - file->tail.offset], size);
+    } else {
+        ssize_t bytesRead = pread(file->read.fd, buffer, size,
+                                  cursor->position);
+        if (bytesRead < 0) {
+            return -1;
+        }
+        size = bytesRead;
+    }
+    cursor->position += size;
+    return size;
+}
+
+/**
+ * fopencookie() seek function of streams made by openPrefetched()
+ */
+static int seekPrefetched(void *cookie, off64_t *offset, int whence) {
+    prefetchCursor *cursor = cookie;
+    long long base = whence == SEEK_SET ? 0 :
+                     whence == SEEK_CUR ? cursor->position :
+                     cursor->file->fileSize;
+    if (base + *offset < 0) {
+        return -1;
+    }
+    cursor->position = base + *offset;
+    *offset = cursor->position;
+    return 0;
+}
+
+/**
+ * fopencookie() close function of streams made by openPrefetched()
+ */
+static int closePrefetched(void *cookie) {
+    prefetchCursor *cursor = cookie;
+    pthread_mutex_lock(&cursor->prefetch->lock);
+    releaseFile(cursor->prefetch, cursor->file, PREFETCH_CLOSED);
+    pthread_mutex_unlock(&cursor->prefetch->lock);
+    free(cursor);
+    return 0;
+}
+
+FILE* openPrefetched(filePrefetch *prefetch, size_t index, long *fileSize) {
+    prefetchedFile *file = &prefetch->files[index];
+    pthread_mutex_lock(&prefetch->lock);
+    while (file->state == PREFETCH_QUEUED) {
+        pthread_cond_wait(&prefetch->fileRead, &prefetch->lock);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+
+    FILE *stream;
+    if (file->state == PREFETCH_SKIPPED) {
+        stream = fopen(prefetch->paths[index], "rb");
+        struct stat info;
+        if (stream != NULL && fstat(fileno(stream), &info) != 0) {
+            fclose(stream);
+            return NULL;
+        }
+        *fileSize = stream != NULL ? info.st_size : -1;
+        return stream;
+    }
+    prefetchCursor *cursor = malloc(sizeof(prefetchCursor));
+    cookie_io_functions_t functions = {readPrefetched, NULL, seekPrefetched,
+                                       closePrefetched};
+    stream = cursor == NULL ? NULL : fopencookie(cursor, "rb", functions);
+    if (stream == NULL) {
+        free(cursor);
+        pthread_mutex_lock(&prefetch->lock);
+        releaseFile(prefetch, file, PREFETCH_CLOSED);
+        pthread_mutex_unlock(&prefetch->lock);
+        return NULL;
+    }
+    cursor->prefetch = prefetch;
+    cursor->file = file;
+    cursor->position = 0;
+    *fileSize = file->fileSize;
+    return stream;
+}
+
+void destroyPrefetch(filePrefetch *prefetch) {
+    if (prefetch == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&prefetch->lock);
+    prefetch->stop = 1;
+    pthread_cond_signal(&prefetch->roomFreed);
+    pthread_mutex_unlock(&prefetch->lock);
+    pthread_join(prefetch->thread, NULL);
+    // Files read for jobs that never opened them
+    for (size_t i = 0; i < prefetch->count; i++) {
+        if (prefetch->files[i].state == PREFETCH_READ) {
+            releaseFile(prefetch, &prefetch->files[i], PREFETCH_CLOSED);
+        }
+    }
+    for (size_t i = 0; i < prefetch->spareCount; i++) {
+        free(prefetch->spares[i]);
+    }
+    pthread_mutex_destroy(&prefetch->lock);
+    pthread_cond_destroy(&prefetch->fileRead);
+    pthread_cond_destroy(&prefetch->roomFreed);
+    free(prefetch->files);
+    free(prefetch);
+}
+
+struct writeBehind {
+    int fd;
+    unsigned char *buffers[2];
+    size_t queued[2];  // bytes of each buffer left to write, 0 if none
+    int filling;       // buffer filled by writeBehindPut()
+    size_t used;       // bytes of that buffer filled so far
+    int threaded;      // 0 if buffers are written by the caller
+    int stop;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t bufferQueued;   // signalled when a buffer is queued or stop
+    pthread_cond_t bufferWritten;  // signalled when a buffer is written
+    pthread_t thread;
+};
+
+/**
+ * Writes all length bytes at data to fd. Returns 0 on success and 1 otherwise
+ */
+static int writeAll(int fd, const unsigned char *data, size_t length) {
+    while (length != 0) {
+        ssize_t written = write(fd, data, length < MAX_TRANSFER ? length :
+                                          MAX_TRANSFER);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return 1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Thread body of a writeBehind: writes its buffers in turn as they are queued
+ */
+static void* writeBehindThread(void *arg) {
+    writeBehind *writer = arg;
+    int next = 0;  // buffer queued first
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->queued[next] == 0 && !writer->stop) {
+            pthread_cond_wait(&writer->bufferQueued, &writer->lock);
+        }
+        size_t length = writer->queued[next];
+        if (length == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        int failed = writeAll(writer->fd, writer->buffers[next], length);
+        pthread_mutex_lock(&writer->lock);
+        writer->failed |= failed;
+        writer->queued[next] = 0;
+        next ^= 1;
+        pthread_cond_signal(&writer->bufferWritten);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+writeBehind* writeBehindInit(int fd) {
+    writeBehind *writer = calloc(1, sizeof(writeBehind));
+    unsigned char *buffers = writer ? malloc(2*WRITE_BEHIND_SIZE) : NULL;
+    if (buffers == NULL) {
+        free(writer);
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->buffers[0] = buffers;
+    writer->buffers[1] = &buffers[WRITE_BEHIND_SIZE];
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->bufferQueued, NULL);
+    pthread_cond_init(&writer->bufferWritten, NULL);
+    writer->threaded = pthread_create(&writer->thread, NULL,
+                                      writeBehindThread, writer) == 0;
+    return writer;
+}
+
+/**
+ * Hands the buffer being filled over to be written and waits for the other
+ * one to be written, so it can be filled next.
+ * Returns 0 on success and 1 once a write failed
+ */
+static int queueBuffer(writeBehind *writer) {
+    if (!writer->threaded) {
+        writer->failed |= writeAll(writer->fd, writer->buffers[0],
+                                   writer->used);
+        writer->used = 0;
+        return writer->failed;
+    }
+    pthread_mutex_lock(&writer->lock);
+    writer->queued[writer->filling] = writer->used;
+    pthread_cond_signal(&writer->bufferQueued);
+    writer->filling ^= 1;
+    while (writer->queued[writer->filling] != 0) {
+        pthread_cond_wait(&writer->bufferWritten, &writer->lock);
+    }
+    int failed = writer->failed;
+    pthread_mutex_unlock(&writer->lock);
+    writer->used = 0;
+    return failed;
+}
+
+int writeBehindPut(void *arg, const unsigned char *data, size_t length) {
+    writeBehind *writer = arg;
+    while (length != 0) {
+        size_t part = WRITE_BEHIND_SIZE - writer->used;
+        if (part > length) {
+            part = length;
+        }
+        memcpy(&writer->buffers[writer->filling][writer->used], data, part);
+        writer->used += part;
+        data += part;
+        length -= part;
+        if (writer->used == WRITE_BEHIND_SIZE && queueBuffer(writer)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int finishWriteBehind(writeBehind *writer) {
+    int failed = writer->used != 0 && queueBuffer(writer);
+    if (writer->threaded) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stop = 1;
+        pthread_cond_signal(&writer->bufferQueued);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    failed = failed || writer->failed;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->bufferQueued);
+    pthread_cond_destroy(&writer->bufferWritten);
+    free(writer->buffers[0]);
+    free(writer);
+    return failed;
+}
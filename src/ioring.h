@@ -0,0 +1,119 @@
+#ifndef __CSTEG_IORING__
+#define __CSTEG_IORING__
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * Batched file I/O. Opens, reads and writes are queued on an io_uring, so many
+ * of them are in flight at once and a whole batch costs a single system call.
+ * Where io_uring is not available (older kernels, sandboxes forbidding it or
+ * other systems) each request is done on its own with open(), pread() or
+ * pwrite().
+ */
+typedef struct ioRing ioRing;
+typedef struct filePrefetch filePrefetch;
+
+#define IO_RING_DEPTH 16              // most requests in flight on a ring
+#define PREFETCH_FILES 32             // most files prefetched and not closed
+#define PREFETCH_BYTES (256UL << 20)  // most bytes prefetched and not closed
+
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_OPEN 2   // opens the file at path buffer for reading into fd
+
+/*
+ * Read or write of length bytes at offset of fd, or opening of a file
+ */
+typedef struct ioRequest {
+    int fd;
+    int kind;       // one of the IO_ kinds
+    unsigned char *buffer;
+    size_t length;
+    long long offset;
+    size_t done;    // bytes transferred so far
+    int error;      // errno of a failed request, 0 if none
+    void *context;  // left to the caller
+} ioRequest;
+
+/*
+ * Returns a ring keeping up to depth requests in flight, or NULL on
+ * failiure. A ring may only be used by one thread at a time
+ */
+ioRing* ioRingInit(unsigned int depth);
+
+/*
+ * Frees ring, which must have no requests in flight
+ */
+void destroyIoRing(ioRing*);
+
+/*
+ * Queues request, which must stay valid until ioRingWait() returns it.
+ * Queued requests are only sent to the kernel by ioRingWait(), all at once.
+ * Returns 0 on success and 1 if depth requests are in flight already
+ */
+int ioRingSubmit(ioRing*, ioRequest *request);
+
+/*
+ * Waits for a queued request to be done and returns it, or NULL if none are
+ * queued. A request is done once all of its bytes are transferred, a read
+ * reaches the end of its file or it fails (request->error is set)
+ */
+ioRequest* ioRingWait(ioRing*);
+
+/*
+ * Does all count requests, keeping as many in flight as ring allows.
+ * Returns the number of requests that failed or were cut short
+ */
+size_t ioRingRun(ioRing*, ioRequest *requests, size_t count);
+
+/*
+ * Reads files ahead of the jobs of a batch: a thread of its own reads the
+ * first readLimit bytes (all of them if readLimit is 0) of each of the count
+ * files at paths, in order, so that jobs find them in memory, along with
+ * the last few bytes of files read in part, where the EOI marker is. At most
+ * PREFETCH_FILES files or PREFETCH_BYTES bytes are held at once. Every file
+ * must be opened and closed once, in about the order of paths, which
+ * runBatch() jobs do. Returns NULL on failiure
+ */
+filePrefetch* prefetchFiles(char **paths, size_t count, size_t readLimit);
+
+/*
+ * Waits for file index of prefetch to be read and returns a read only stream
+ * over it, storing its size in *fileSize. Bytes past the ones prefetched are
+ * read from the file as needed. Closing the stream gives its memory back.
+ * Returns NULL if the file could not be read
+ */
+FILE* openPrefetched(filePrefetch*, size_t index, long *fileSize);
+
+/*
+ * Stops prefetch and frees it. Streams opened from it must be closed first
+ */
+void destroyPrefetch(filePrefetch*);
+
+typedef struct writeBehind writeBehind;
+
+#define WRITE_BEHIND_SIZE (256UL << 10)  // bytes of each buffer of a writeBehind
+
+/*
+ * Writes to fd from a thread of its own through 2 buffers of
+ * WRITE_BEHIND_SIZE bytes: one is filled by writeBehindPut() while the other
+ * is written, so callers only wait on storage when they fill a buffer before
+ * the last one is written. Where no thread can be started buffers are written
+ * as soon as they are full. Returns NULL on failiure
+ */
+writeBehind* writeBehindInit(int fd);
+
+/*
+ * Queues the length bytes at data to be written by writer, a writeBehind
+ * passed as void* so it can be handed to writePayload(). Returns 0 on success
+ * and 1 once a write failed
+ */
+int writeBehindPut(void *writer, const unsigned char *data, size_t length);
+
+/*
+ * Writes whatever is left queued, stops writer and frees it. Returns 0 if
+ * every byte was written and 1 otherwise
+ */
+int finishWriteBehind(writeBehind*);
+
+#endif
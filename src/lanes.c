@@ -0,0 +1,212 @@
+#include <stdlib.h>
+#include "lanes.h"
+#include "scanWorker.h"
+#include "bits.h"
+#include "trie.h"
+
+/**
+ * Tables shared by the lanes decoding the intervals of one scan
+ */
+typedef struct laneTables {
+    unsigned char blockColor[MAX_MCU_BLOCKS];  // color index of each block
+    unsigned char totalBlocks;
+    unsigned char channelMask;
+    dhtTrie *dcTables[3];
+    dhtTrie *acTables[3];
+    const dhtLookupEntry *dcLookups[3];
+    const dhtLookupEntry *acLookups[3];
+} laneTables;
+
+/**
+ * Decoding state of one restart interval
+ */
+typedef struct lane {
+    bitCursor cursor;             // ends at the marker ending the interval
+    size_t interval;              // interval being decoded
+    unsigned long long mcusLeft;  // MCUs of the interval not fully read yet
+    unsigned char block;          // block of the MCU being read
+    unsigned char acs;            // ACs of the block read so far
+    unsigned char readingDc;      // 1 if the next symbol is a DC
+    unsigned long long slots;     // slots of the interval found so far
+} lane;
+
+/**
+ * Decodes the symbol at l's cursor with table by walking it, for codes too
+ * long for its lookup, storing the symbol in *value and the bits it takes
+ * along with its value bits in *bits. Returns 0 on success and 1 otherwise
+ */
+static int walkSymbol(const lane *l, dhtTrie *table, unsigned char isAc,
+                      unsigned char *value, unsigned char *bits) {
+    unsigned char length;
+    if (walkCursor(&l->cursor, table, value, &length)) {
+        return 1;
+    }
+    *bits = length + (isAc ? GET_FIRST_4_BITS(*value) : *value);
+    return 0;
+}
+
+/**
+ * Decodes the next symbol of l, or as many ACs of the current block as one
+ * lookup probe gives, counting those that are slots.
+ * Returns 0 on success and 1 otherwise
+ */
+static int stepLane(lane *l, const laneTables *tables) {
+    unsigned char colorIndex = tables->blockColor[l->block];
+    unsigned char bits = 0;
+    unsigned int probe = peekCursor(&l->cursor, DHT_LOOKUP_BITS);
+    if (l->readingDc) {
+        const dhtLookupEntry *entry = &tables->dcLookups[colorIndex][probe];
+        unsigned char value;
+        if (entry->count != 0) {
+            bits = entry->ends[0];
+        } else if (walkSymbol(l, tables->dcTables[colorIndex], 0, &value,
+                              &bits)) {
+            return 1;
+        }
+        l->readingDc = 0;
+        l->acs = 0;
+        return skipCursor(&l->cursor, bits);
+    }
+
+    const dhtLookupEntry *entry = &tables->acLookups[colorIndex][probe];
+    dhtLookupEntry walked;  // stands in for entry when its code is too long
+    if (entry->count == 0) {
+        walked.count = 1;
+        if (walkSymbol(l, tables->acTables[colorIndex], 1, &walked.values[0],
+                       &walked.ends[0])) {
+            return 1;
+        }
+        entry = &walked;
+    }
+    unsigned char isCarrier = tables->channelMask & CHANNEL_BIT(colorIndex);
+    // No symbol fits only if the first one codes too many ACs
+    if (takeLookupAcs(entry, 0, &l->acs, &bits,
+                      isCarrier ? &l->slots : NULL) == 0 ||
+        skipCursor(&l->cursor, bits)) {
+        return 1;
+    }
+    if (l->acs == MAX_AC_COEFFICIENTS) {
+        // Move onto next block, or next MCU if at last block
+        l->readingDc = 1;
+        l->block++;
+        if (l->block == tables->totalBlocks) {
+            l->block = 0;
+            l->mcusLeft--;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Points l at the start of interval of the scan
+ */
+static void startLane(lane *l, const unsigned char *scan,
+                      const unsigned long *starts, size_t interval,
+                      jpegStats *stats) {
+    l->cursor.data = scan;
+    l->cursor.byte = starts[interval];
+    l->cursor.bit = 0;
+    l->cursor.end = starts[interval + 1] - MARKER_LENGTH;
+    l->interval = interval;
+    l->mcusLeft = stats->restartInterval;
+    l->block = 0;
+    l->readingDc = 1;
+    l->slots = 0;
+}
+
+/**
+ * Returns 1 if l, which has read all MCUs of its interval, stopped right
+ * before the marker ending it (but for padding bits) and 0 otherwise
+ */
+static int endsInterval(const lane *l) {
+    bitCursor cursor = l->cursor;
+    if (cursor.bit != 0) {
+        stepCursor(&cursor, 8 - cursor.bit);
+    }
+    return cursor.byte == cursor.end;
+}
+
+/**
+ * Fills tables for decoding the blocks of an MCU of the image described by
+ * stats. Returns 0 on success and 1 otherwise
+ */
+static int initLaneTables(laneTables *tables, jpegStats *stats,
+                          unsigned char channelMask) {
+    if (stats->totalColorCounts == 0 ||
+        stats->totalColorCounts > MAX_MCU_BLOCKS) {
+        return 1;
+    }
+    tables->totalBlocks = stats->totalColorCounts;
+    tables->channelMask = channelMask;
+    unsigned char block = 0;
+    for (int colorIndex = 0; colorIndex < CR_ID; colorIndex++) {
+        for (int i = 0; i < stats->colorCounts[colorIndex]; i++) {
+            tables->blockColor[block++] = colorIndex;
+        }
+        tables->dcTables[colorIndex] = stats->dcHuffmanTables[colorIndex];
+        tables->acTables[colorIndex] = stats->acHuffmanTables[colorIndex];
+        if (stats->colorCounts[colorIndex] == 0) {
+            continue;
+        }
+        if (tables->dcTables[colorIndex] == NULL ||
+            tables->acTables[colorIndex] == NULL) {
+            return 1;
+        }
+        tables->dcLookups[colorIndex] =
+            getDhtLookup(tables->dcTables[colorIndex], 0);
+        tables->acLookups[colorIndex] =
+            getDhtLookup(tables->acTables[colorIndex], 1);
+        if (tables->dcLookups[colorIndex] == NULL ||
+            tables->acLookups[colorIndex] == NULL) {
+            return 1;
+        }
+    }
+    return block != tables->totalBlocks;
+}
+
+int countIntervalSlots(const unsigned char *scan, const unsigned long *starts,
+                       size_t first, size_t last, jpegStats *stats,
+                       unsigned char channelMask, unsigned long long *slots) {
+    laneTables tables;
+    if (stats->restartInterval == 0 ||
+        initLaneTables(&tables, stats, channelMask)) {
+        return 1;
+    }
+
+    lane lanes[LANE_COUNT];
+    unsigned char busy[LANE_COUNT];  // 1 if lane has an interval left to read
+    size_t next = first;  // next interval to hand to a lane
+    int active = 0;       // number of busy lanes
+    for (int i = 0; i < LANE_COUNT; i++) {
+        busy[i] = next < last;
+        if (busy[i]) {
+            startLane(&lanes[i], scan, starts, next++, stats);
+            active++;
+        }
+    }
+    // Lanes take turns so their decoding overlaps
+    while (active != 0) {
+        for (int i = 0; i < LANE_COUNT; i++) {
+            if (!busy[i]) {
+                continue;
+            }
+            if (stepLane(&lanes[i], &tables)) {
+                return 1;
+            }
+            if (lanes[i].mcusLeft != 0) {
+                continue;
+            }
+            if (!endsInterval(&lanes[i])) {
+                return 1;
+            }
+            slots[lanes[i].interval] = lanes[i].slots;
+            busy[i] = next < last;
+            if (busy[i]) {
+                startLane(&lanes[i], scan, starts, next++, stats);
+            } else {
+                active--;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __CSTEG_LANES__
+#define __CSTEG_LANES__
+#include <stddef.h>
+#include "csteg.h"
+
+/*
+ * Decoding of several restart intervals at once on a single thread. Huffman
+ * decoding is one long chain of dependent steps, each waiting for the code
+ * before it, so a lone decoder leaves most of a core idle. Each lane has a
+ * bit cursor of its own over a different interval, and the lanes take turns
+ * decoding one lookup probe each, which lets the CPU overlap their chains.
+ */
+
+#define LANE_COUNT 4  // intervals decoded in lockstep by one thread
+
+/*
+ * Counts the AC coeficients able to hold a bit (see mcuNotPropper()) in the
+ * channels of channelMask of every restart interval i in [first, last) of
+ * scan, storing their number in slots[i]. Interval i starts at byte
+ * starts[i] and ends with the restart marker 2 bytes before starts[i + 1],
+ * and holds stats->restartInterval MCUs.
+ *
+ * Returns 0 on success and 1 if an interval does not decode to exactly its
+ * MCUs, in which case the scan should be decoded the usual way instead
+ */
+int countIntervalSlots(const unsigned char *scan, const unsigned long *starts,
+                       size_t first, size_t last, jpegStats *stats,
+                       unsigned char channelMask, unsigned long long *slots);
+
+#endif
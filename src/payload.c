@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "payload.h"
+#include "hash.h"
+
+#define INITIAL_MESSAGE_CAPACITY 16
+#define PAYLOAD_CHUNK_SIZE 4096  // bytes handed to the sink of writePayload()
+
+/**
+ * Stores value into the length bytes at bytes, most significant byte first
+ */
+static void writeBigEndian(unsigned char *bytes, unsigned long long value,
+                           int length) {
+    for (int i = length - 1; i >= 0; i--) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+/**
+ * Returns the number stored in the length bytes at bytes, most significant
+ * byte first
+ */
+static unsigned long long readBigEndian(const unsigned char *bytes,
+                                        int length) {
+    unsigned long long value = 0;
+    for (int i = 0; i < length; i++) {
+        value = value << 8 | bytes[i];
+    }
+    return value;
+}
+
+void destroyCheckpoints(slotCheckpoints *checkpoints) {
+    free(checkpoints->slots);
+    checkpoints->slots = NULL;
+    checkpoints->count = 0;
+}
+
+void fitCheckpoints(slotCheckpoints *checkpoints,
+                    unsigned long long capacity) {
+    while (checkpoints->count > 1 &&
+           CHECKPOINTS_HEADER_LENGTH + 8ULL*checkpoints->count >
+           capacity / CHECKPOINTS_SHARE) {
+        // Keeping every other checkpoint doubles the stride
+        for (unsigned int i = 0; 2*i < checkpoints->count; i++) {
+            checkpoints->slots[i] = checkpoints->slots[2*i];
+        }
+        checkpoints->count = (checkpoints->count + 1) / 2;
+        checkpoints->stride *= 2;
+    }
+    if (checkpoints->count <= 1) {
+        destroyCheckpoints(checkpoints);
+    }
+}
+
+void encodePayloadHeader(const payloadHeader *header, unsigned char *bytes) {
+    memcpy(bytes, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH);
+    bytes[4] = header->version;
+    bytes[5] = header->flags;
+    writeBigEndian(&bytes[6], header->sequence, 2);
+    writeBigEndian(&bytes[8], header->total, 2);
+    writeBigEndian(&bytes[10], header->length, 8);
+}
+
+/**
+ * Fills header from the PAYLOAD_HEADER_LENGTH bytes at bytes, whose magic
+ * has already been checked. Returns 0 on success and 1 if the header is of
+ * an unknown version
+ */
+static int decodePayloadHeader(const unsigned char *bytes,
+                               payloadHeader *header) {
+    header->version = bytes[4];
+    header->flags = bytes[5];
+    header->sequence = readBigEndian(&bytes[6], 2);
+    header->total = readBigEndian(&bytes[8], 2);
+    header->length = readBigEndian(&bytes[10], 8);
+    if (header->version == 0 || header->version > PAYLOAD_VERSION) {
+        printf("ERROR: unsupported payload version %d\n", header->version);
+        return 1;
+    }
+    return 0;
+}
+
+size_t framingLength(unsigned char flags, const slotCheckpoints *checkpoints) {
+    size_t length = PAYLOAD_HEADER_LENGTH;
+    if (flags & PAYLOAD_CHECKSUM) {
+        length += CHECKSUM_LENGTH;
+    }
+    if (checkpoints != NULL && checkpoints->count != 0) {
+        length += CHECKPOINTS_HEADER_LENGTH + 8*(size_t)checkpoints->count;
+    }
+    return length;
+}
+
+unsigned long long hiddenLength(const unsigned char *bytes, size_t count) {
+    if (count >= PAYLOAD_HEADER_LENGTH &&
+        memcmp(bytes, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH) == 0) {
+        unsigned char flags = bytes[5];
+        size_t framing = PAYLOAD_HEADER_LENGTH;
+        if (flags & PAYLOAD_CHECKSUM) {
+            framing += CHECKSUM_LENGTH;
+        }
+        if (flags & PAYLOAD_CHECKPOINTS) {
+            if (count < framing + CHECKPOINTS_HEADER_LENGTH) {
+                return 0;
+            }
+            framing += CHECKPOINTS_HEADER_LENGTH +
+                       8*readBigEndian(&bytes[framing + 4], 4);
+        }
+        // Lengths from a damaged header must not wrap around
+        unsigned long long length = readBigEndian(&bytes[10], 8);
+        return length > ~0ULL - framing ? ~0ULL : framing + length;
+    }
+    const unsigned char *end = memchr(bytes, 0, count);
+    return end == NULL ? 0 : end - bytes + 1;
+}
+
+unsigned char* framePayload(unsigned short sequence, unsigned short total,
+                            unsigned char flags,
+                            const slotCheckpoints *checkpoints,
+                            const unsigned char *data, size_t length,
+                            size_t *framedLength) {
+    size_t framing = framingLength(flags, checkpoints);
+    unsigned char *framed = malloc(framing + length);
+    if (framed == NULL) {
+        printf("ERROR allocating space of size %zu\n", framing + length);
+        return NULL;
+    }
+    payloadHeader header = {PAYLOAD_VERSION, flags & PAYLOAD_CHECKSUM,
+                            sequence, total, length};
+    unsigned char *next = &framed[PAYLOAD_HEADER_LENGTH];
+    if (header.flags & PAYLOAD_CHECKSUM) {
+        writeBigEndian(next, crc32c(0, data, length), CHECKSUM_LENGTH);
+        next += CHECKSUM_LENGTH;
+    }
+    if (checkpoints != NULL && checkpoints->count != 0) {
+        header.flags |= PAYLOAD_CHECKPOINTS;
+        unsigned char *table = next;
+        writeBigEndian(table, checkpoints->stride, 4);
+        writeBigEndian(&table[4], checkpoints->count, 4);
+        for (unsigned int i = 0; i < checkpoints->count; i++) {
+            writeBigEndian(&table[CHECKPOINTS_HEADER_LENGTH + 8*i],
+                           checkpoints->slots[i], 8);
+        }
+    }
+    encodePayloadHeader(&header, framed);
+    memcpy(&framed[framing], data, length);
+    *framedLength = framing + length;
+    return framed;
+}
+
+/**
+ * Reads the checkpoint table following a header with PAYLOAD_CHECKPOINTS set
+ * into checkpoints, or skips it if checkpoints is NULL.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readCheckpoints(int (*nextByte)(void*, unsigned char*),
+                           void *source, slotCheckpoints *checkpoints) {
+    unsigned char bytes[8];
+    for (int i = 0; i < CHECKPOINTS_HEADER_LENGTH; i++) {
+        if (nextByte(source, &bytes[i])) {
+            return 1;
+        }
+    }
+    unsigned int stride = readBigEndian(bytes, 4);
+    unsigned int count = readBigEndian(&bytes[4], 4);
+    if (stride == 0 || count == 0 || count > MAX_CHECKPOINTS) {
+        puts("ERROR: invalid checkpoint table");
+        return 1;
+    }
+    unsigned long long *slots = NULL;
+    if (checkpoints != NULL) {
+        slots = malloc(count * sizeof(unsigned long long));
+        if (slots == NULL) {
+            return 1;
+        }
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        for (int j = 0; j < 8; j++) {
+            if (nextByte(source, &bytes[j])) {
+                free(slots);
+                return 1;
+            }
+        }
+        if (slots != NULL) {
+            slots[i] = readBigEndian(bytes, 8);
+        }
+    }
+    if (checkpoints != NULL) {
+        checkpoints->stride = stride;
+        checkpoints->count = count;
+        checkpoints->slots = slots;
+    }
+    return 0;
+}
+
+/**
+ * Reads whatever follows a header with the given flags into header->checksum
+ * and checkpoints (skipping the checkpoints if it is NULL), then checks that
+ * the framing and the header->length bytes of data fit in the capacity bytes
+ * of the source, as the length comes from the image and cannot be trusted.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readFraming(int (*nextByte)(void*, unsigned char*), void *source,
+                       unsigned long long capacity, payloadHeader *header,
+                       slotCheckpoints *checkpoints) {
+    if (header->flags & PAYLOAD_CHECKSUM) {
+        unsigned char bytes[CHECKSUM_LENGTH];
+        for (int i = 0; i < CHECKSUM_LENGTH; i++) {
+            if (nextByte(source, &bytes[i])) {
+                return 1;
+            }
+        }
+        header->checksum = readBigEndian(bytes, CHECKSUM_LENGTH);
+    }
+    slotCheckpoints skipped = {0};  // stands in for checkpoints if NULL
+    slotCheckpoints *table = checkpoints ? checkpoints : &skipped;
+    if ((header->flags & PAYLOAD_CHECKPOINTS) &&
+        readCheckpoints(nextByte, source, table)) {
+        return 1;
+    }
+    size_t framing = framingLength(header->flags, table);
+    destroyCheckpoints(&skipped);
+    if (framing > capacity || header->length > capacity - framing) {
+        printf("ERROR: payload of %llu bytes is longer than the image can "
+               "hold\n", header->length);
+        return 1;
+    }
+    return 0;
+}
+
+int verifyChecksum(const payloadHeader *header, unsigned int crc) {
+    if ((header->flags & PAYLOAD_CHECKSUM) && crc != header->checksum) {
+        printf("ERROR: payload checksum %08x does not match %08x, the payload "
+               "is damaged\n", crc, header->checksum);
+        return 1;
+    }
+    return 0;
+}
+
+int sniffPayloadHeader(int (*nextByte)(void*, unsigned char*), void *source,
+                       payloadHeader *header) {
+    memset(header, 0, sizeof(payloadHeader));
+    unsigned char bytes[PAYLOAD_HEADER_LENGTH];
+    for (int i = 0; i < PAYLOAD_HEADER_LENGTH; i++) {
+        if (nextByte(source, &bytes[i])) {
+            return 1;
+        }
+        if (i < PAYLOAD_MAGIC_LENGTH &&
+            bytes[i] != (unsigned char)PAYLOAD_MAGIC[i]) {
+            return 1;
+        }
+    }
+    return decodePayloadHeader(bytes, header);
+}
+
+int readPayloadHeader(int (*nextByte)(void*, unsigned char*), void *source,
+                      unsigned long long capacity, payloadHeader *header,
+                      slotCheckpoints *checkpoints) {
+    return sniffPayloadHeader(nextByte, source, header) ||
+           readFraming(nextByte, source, capacity, header, checkpoints);
+}
+
+int checkCheckpoints(const slotCheckpoints *checkpoints,
+                     unsigned long long intervals, unsigned long long slots) {
+    if (checkpoints->count == 0) {
+        return 0;
+    }
+    if ((unsigned long long)(checkpoints->count - 1)*checkpoints->stride >=
+        intervals) {
+        puts("ERROR: invalid checkpoint table");
+        return 1;
+    }
+    for (unsigned int i = 0; i < checkpoints->count; i++) {
+        if (checkpoints->slots[i] > slots ||
+            (i != 0 && checkpoints->slots[i] < checkpoints->slots[i - 1])) {
+            puts("ERROR: invalid checkpoint table");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned char* cutRange(unsigned char *data, size_t length,
+                        unsigned long long offset, unsigned long long count,
+                        size_t *rangeLength) {
+    if (data == NULL) {
+        return NULL;
+    }
+    if (offset > length) {
+        offset = length;
+    }
+    if (count > length - offset) {
+        count = length - offset;
+    }
+    memmove(data, &data[offset], count);
+    data[count] = 0;  // data always has a 0 byte after its length
+    *rangeLength = count;
+    return data;
+}
+
+/**
+ * Reads a plain message whose first prefixLength bytes (none of them 0) have
+ * already been read into prefix. Returns it in allocated memory
+ */
+static unsigned char* readPlainMessage(int (*nextByte)(void*, unsigned char*),
+                                       void *source,
+                                       const unsigned char *prefix,
+                                       size_t prefixLength, size_t *length) {
+    size_t capacity = INITIAL_MESSAGE_CAPACITY;
+    size_t counter = prefixLength;
+    unsigned char *mssg = malloc(capacity);
+    if (mssg == NULL) {
+        return NULL;
+    }
+    memcpy(mssg, prefix, prefixLength);
+    while (1) {
+        unsigned char byte;
+        if (nextByte(source, &byte)) {
+            // Ran out of coeficients before end of message
+            free(mssg);
+            return NULL;
+        }
+        mssg[counter] = byte;
+        if (byte == 0) {
+            break;
+        }
+        // Increment counter and double capacity if need be
+        counter++;
+        if (counter == capacity) {
+            capacity = 2*capacity;
+            unsigned char *grown = realloc(mssg, capacity);
+            if (grown == NULL) {
+                free(mssg);
+                return NULL;
+            }
+            mssg = grown;
+        }
+    }
+    *length = counter;
+    return mssg;
+}
+
+unsigned char* readPayload(int (*nextByte)(void*, unsigned char*),
+                           void *source, unsigned long long capacity,
+                           payloadHeader *header, size_t *length) {
+    memset(header, 0, sizeof(payloadHeader));
+    // Stop looking for a header as soon as the magic does not match
+    unsigned char bytes[PAYLOAD_HEADER_LENGTH];
+    for (int i = 0; i < PAYLOAD_MAGIC_LENGTH; i++) {
+        if (nextByte(source, &bytes[i])) {
+            return NULL;
+        }
+        if (bytes[i] != (unsigned char)PAYLOAD_MAGIC[i]) {
+            if (bytes[i] == 0) {  // plain message shorter than the magic
+                unsigned char *mssg = malloc(i + 1);
+                if (mssg != NULL) {
+                    memcpy(mssg, bytes, i + 1);
+                    *length = i;
+                }
+                return mssg;
+            }
+            return readPlainMessage(nextByte, source, bytes, i + 1, length);
+        }
+    }
+
+    for (int i = PAYLOAD_MAGIC_LENGTH; i < PAYLOAD_HEADER_LENGTH; i++) {
+        if (nextByte(source, &bytes[i])) {
+            return NULL;
+        }
+    }
+    if (decodePayloadHeader(bytes, header) ||
+        readFraming(nextByte, source, capacity, header, NULL)) {
+        return NULL;
+    }
+
+    unsigned char *data = malloc(header->length + 1);
+    if (data == NULL) {
+        printf("ERROR allocating space of size %llu\n", header->length + 1);
+        return NULL;
+    }
+    // The checksum is updated a word at a time while the data is still cached
+    int checking = header->flags & PAYLOAD_CHECKSUM;
+    unsigned int crc = 0;
+    unsigned long long checked = 0;
+    for (unsigned long long i = 0; i < header->length; i++) {
+        if (nextByte(source, &data[i])) {
+            puts("ERROR: payload is longer than the image can hold");
+            free(data);
+            return NULL;
+        }
+        if (checking && i + 1 - checked == 8) {
+            crc = crc32c(crc, &data[checked], 8);
+            checked = i + 1;
+        }
+    }
+    if (checking) {
+        crc = crc32c(crc, &data[checked], header->length - checked);
+    }
+    if (checking && verifyChecksum(header, crc)) {
+        free(data);
+        return NULL;
+    }
+    data[header->length] = 0;
+    *length = header->length;
+    return data;
+}
+
+/**
+ * Hands a plain message to write(sink, ...) like readPlainMessage(). chunk,
+ * of PAYLOAD_CHUNK_SIZE bytes, holds the used bytes of the message read so
+ * far, only the last of which may be 0
+ */
+static int writePlainMessage(int (*nextByte)(void*, unsigned char*),
+                             void *source, unsigned char *chunk, size_t used,
+                             int (*write)(void*, const unsigned char*, size_t),
+                             void *sink, unsigned long long *length) {
+    while (chunk[used - 1] != 0) {
+        if (used == PAYLOAD_CHUNK_SIZE) {
+            if (write(sink, chunk, used)) {
+                return 1;
+            }
+            *length += used;
+            used = 0;
+        }
+        if (nextByte(source, &chunk[used])) {
+            // Ran out of coeficients before end of message
+            return 1;
+        }
+        used++;
+    }
+    *length += used - 1;
+    return write(sink, chunk, used - 1);
+}
+
+int writePayload(int (*nextByte)(void*, unsigned char*), void *source,
+                 unsigned long long capacity, payloadHeader *header,
+                 int (*write)(void*, const unsigned char*, size_t),
+                 void *sink, unsigned long long *length) {
+    memset(header, 0, sizeof(payloadHeader));
+    *length = 0;
+    // Stop looking for a header as soon as the magic does not match
+    unsigned char chunk[PAYLOAD_CHUNK_SIZE];
+    for (int i = 0; i < PAYLOAD_MAGIC_LENGTH; i++) {
+        if (nextByte(source, &chunk[i])) {
+            return 1;
+        }
+        if (chunk[i] != (unsigned char)PAYLOAD_MAGIC[i]) {
+            return writePlainMessage(nextByte, source, chunk, i + 1, write,
+                                     sink, length);
+        }
+    }
+
+    for (int i = PAYLOAD_MAGIC_LENGTH; i < PAYLOAD_HEADER_LENGTH; i++) {
+        if (nextByte(source, &chunk[i])) {
+            return 1;
+        }
+    }
+    if (decodePayloadHeader(chunk, header) ||
+        readFraming(nextByte, source, capacity, header, NULL)) {
+        return 1;
+    }
+
+    // The checksum is updated a chunk at a time while it is still cached
+    int checking = header->flags & PAYLOAD_CHECKSUM;
+    unsigned int crc = 0;
+    size_t used = 0;
+    for (unsigned long long i = 0; i < header->length; i++) {
+        if (nextByte(source, &chunk[used++])) {
+            puts("ERROR: payload is longer than the image can hold");
+            return 1;
+        }
+        if (used == PAYLOAD_CHUNK_SIZE || i + 1 == header->length) {
+            if (checking) {
+                crc = crc32c(crc, chunk, used);
+            }
+            if (write(sink, chunk, used)) {
+                return 1;
+            }
+            used = 0;
+        }
+    }
+    *length = header->length;
+    return checking && verifyChecksum(header, crc);
+}
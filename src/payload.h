@@ -0,0 +1,169 @@
+#ifndef __CSTEG_PAYLOAD__
+#define __CSTEG_PAYLOAD__
+#include <stddef.h>
+
+/*
+ * Format of the bytes hidden in an image. Framed payloads start with a header
+ * and may hold any bytes; anything else is read as a plain message ending at
+ * its first 0 byte, as written by -w.
+ *
+ * Header layout (multi-byte fields big-endian):
+ *     magic (4) | version (1) | flags (1) | sequence (2) | total (2) |
+ *     length (8)
+ *
+ * With PAYLOAD_CHECKSUM set, the header is followed by the CRC32C of the
+ * payload data (4). With PAYLOAD_CHECKPOINTS set, a checkpoint table follows:
+ *     stride (4) | count (4) | count x slots before interval i*stride (8)
+ * which lets readers jump to the restart interval holding any payload byte.
+ */
+
+#define PAYLOAD_MAGIC "\x89" "CSG"
+#define PAYLOAD_MAGIC_LENGTH 4
+#define PAYLOAD_VERSION 1
+#define PAYLOAD_HEADER_LENGTH 18
+
+// Flags of a payload header
+#define PAYLOAD_CHECKPOINTS 1  // a checkpoint table follows the header
+#define PAYLOAD_CHECKSUM 2     // a CRC32C of the data follows the header
+
+#define CHECKSUM_LENGTH 4
+
+#define MAX_CHECKPOINTS 256  // bounds checkpoint table to about 2KB
+#define CHECKPOINTS_SHARE 32  // table takes at most 1/32 of an image's room
+#define CHECKPOINTS_HEADER_LENGTH 8
+
+// Most bytes hidden before the data of a payload
+#define MAX_FRAMING_LENGTH (PAYLOAD_HEADER_LENGTH + CHECKSUM_LENGTH + \
+                            CHECKPOINTS_HEADER_LENGTH + 8*MAX_CHECKPOINTS)
+
+typedef struct payloadHeader {
+    unsigned char version;      // 0 if the payload was a plain message
+    unsigned char flags;        // PAYLOAD_ flags describing what follows
+    unsigned short sequence;    // index of this part among all parts
+    unsigned short total;       // number of images the payload is split over
+    unsigned long long length;  // bytes of payload following the header
+    unsigned int checksum;      // CRC32C of the data, if PAYLOAD_CHECKSUM
+} payloadHeader;
+
+/*
+ * Number of usable coeficients (slots) before every stride-th restart
+ * interval of a scan
+ */
+typedef struct slotCheckpoints {
+    unsigned int stride;        // restart intervals between checkpoints
+    unsigned int count;         // number of checkpoints, 0 if none
+    unsigned long long *slots;  // slots before restart interval i*stride
+} slotCheckpoints;
+
+/*
+ * Frees the table of checkpoints, leaving it empty
+ */
+void destroyCheckpoints(slotCheckpoints*);
+
+/*
+ * Merges neighbouring checkpoints until their table takes at most
+ * 1/CHECKPOINTS_SHARE of the capacity bytes an image can hold, emptying it
+ * if a single checkpoint would be left
+ */
+void fitCheckpoints(slotCheckpoints*, unsigned long long capacity);
+
+/*
+ * Stores the PAYLOAD_HEADER_LENGTH bytes describing header into bytes
+ */
+void encodePayloadHeader(const payloadHeader *header, unsigned char *bytes);
+
+/*
+ * Returns the number of bytes hidden before the payload data: the header,
+ * the checksum if flags has PAYLOAD_CHECKSUM and, if there are any, the
+ * checkpoints
+ */
+size_t framingLength(unsigned char flags, const slotCheckpoints *checkpoints);
+
+/*
+ * Returns the number of bytes hidden for the payload whose first count bytes
+ * are bytes: its framing and data if it has a header, or its message and
+ * terminating 0 byte if it is plain. Returns 0 if those bytes do not tell
+ */
+unsigned long long hiddenLength(const unsigned char *bytes, size_t count);
+
+/*
+ * Returns the header (with the given sequence, total and flags, of which only
+ * PAYLOAD_CHECKSUM is used) and checkpoints (which may be NULL or empty)
+ * followed by the length bytes of data, in allocated memory, storing their
+ * total length in *framedLength. Returns NULL on failiure
+ */
+unsigned char* framePayload(unsigned short sequence, unsigned short total,
+                            unsigned char flags,
+                            const slotCheckpoints *checkpoints,
+                            const unsigned char *data, size_t length,
+                            size_t *framedLength);
+
+/*
+ * Returns 0 if crc is the CRC32C stored in header, or header has none, and
+ * 1 (after reporting the damage) otherwise
+ */
+int verifyChecksum(const payloadHeader *header, unsigned int crc);
+
+/*
+ * Reads only the PAYLOAD_HEADER_LENGTH bytes of a payload header from
+ * nextByte (see readPayload()), stopping at the first byte that does not
+ * match the magic. Returns 0 on success and 1 if the payload has no header
+ * (header->version is then 0) or it cannot be read
+ */
+int sniffPayloadHeader(int (*nextByte)(void*, unsigned char*), void *source,
+                       payloadHeader *header);
+
+/*
+ * Reads a payload header, and its checkpoints into *checkpoints (if not
+ * NULL), from nextByte (see readPayload()). Returns 0 on success and 1 if the
+ * payload has no header (header->version is then 0), it cannot be read or it
+ * does not fit in capacity bytes
+ */
+int readPayloadHeader(int (*nextByte)(void*, unsigned char*), void *source,
+                      unsigned long long capacity, payloadHeader *header,
+                      slotCheckpoints *checkpoints);
+
+/*
+ * Returns 0 if checkpoints, read from an image with the given number of
+ * restart intervals and slots, only name intervals of the image and slot
+ * counts that never decrease and never exceed slots, and 1 (after reporting
+ * it) otherwise
+ */
+int checkCheckpoints(const slotCheckpoints *checkpoints,
+                     unsigned long long intervals, unsigned long long slots);
+
+/*
+ * Moves bytes [offset, offset + count) of the length bytes of data, clamped
+ * to length, to the start of data and stores their number in *rangeLength.
+ * Returns data, which may be NULL
+ */
+unsigned char* cutRange(unsigned char *data, size_t length,
+                        unsigned long long offset, unsigned long long count,
+                        size_t *rangeLength);
+
+/*
+ * Reads a payload from the bytes handed out by nextByte(source, &byte), which
+ * returns 0 on success and 1 once no bytes are left. Returns the payload data
+ * (followed by a 0 byte not counted in *length) in allocated memory, or NULL
+ * on failiure. header->version is 0 if the payload had no header. Headers
+ * whose payload would not fit in the capacity bytes source can hand out at
+ * most are rejected before anything is allocated. The checksum of payloads
+ * with PAYLOAD_CHECKSUM set is checked as they are read.
+ */
+unsigned char* readPayload(int (*nextByte)(void*, unsigned char*),
+                           void *source, unsigned long long capacity,
+                           payloadHeader *header, size_t *length);
+
+/*
+ * Same as readPayload(), but hands the payload data to write(sink, data,
+ * count) a few KB at a time as it is read, instead of keeping it, and stores
+ * its length in *length. Returns 0 on success and 1 otherwise, in which case
+ * what was handed to sink (possibly all of a payload whose checksum does not
+ * match) must be discarded
+ */
+int writePayload(int (*nextByte)(void*, unsigned char*), void *source,
+                 unsigned long long capacity, payloadHeader *header,
+                 int (*write)(void*, const unsigned char*, size_t),
+                 void *sink, unsigned long long *length);
+
+#endif
@@ -0,0 +1,381 @@
+#include <stdlib.h>
+#include <string.h>
+#include "progressive.h"
+#include "scanWorker.h"
+#include "bits.h"
+#include "trie.h"
+
+#define MAX_SCAN_COMPONENTS 3
+#define BLOCK_SIDE 8        // pixels along each side of a block
+
+/**
+ * What indexing an image found about one of its scans
+ */
+typedef struct progressiveScan {
+    unsigned long start;            // byte of data its coded bits start at
+    unsigned long end;              // byte of the marker ending them
+    unsigned char colorIndex;       // channel of the first component
+    unsigned char componentCount;
+    unsigned char spectralStart;    // first coeficient of the band, 0 is DC
+    unsigned char spectralEnd;      // last coeficient of the band
+    unsigned char approximationHigh;  // 0 for first scans of the band
+    unsigned short restartInterval;   // blocks between restart markers
+    dhtTrie *acTable;               // NULL for DC scans
+} progressiveScan;
+
+/**
+ * Scans of an image in the order they appear, along with the tables defined
+ * between them
+ */
+typedef struct scanList {
+    progressiveScan *scans;
+    size_t count;
+    size_t capacity;
+    dhts **tables;      // DHT segments found after the first scan
+    size_t tableCount;
+    size_t tableCapacity;
+} scanList;
+
+/**
+ * Frees what list holds, but not list itself
+ */
+static void destroyScanList(scanList *list) {
+    for (size_t i = 0; i < list->tableCount; i++) {
+        destroyDhts(list->tables[i]);
+    }
+    free(list->tables);
+    free(list->scans);
+}
+
+/**
+ * Returns the byte of the marker ending the coded bits of data starting at
+ * start, or size if there is none: the first FF byte not followed by a
+ * stuff-byte or restart marker
+ */
+static unsigned long findScanEnd(const unsigned char *data,
+                                 unsigned long size, unsigned long start) {
+    unsigned long index = start;
+    while (index + 1 < size) {
+        const unsigned char *found = memchr(&data[index], 0xFF,
+                                            size - 1 - index);
+        if (found == NULL) {
+            break;
+        }
+        index = found - data;
+        unsigned char next = data[index + 1];
+        if (next != 0 && (next < RST_MARKER_0 || next > RST_MARKER_7)) {
+            return index;
+        }
+        index += 2;
+    }
+    return size;
+}
+
+/**
+ * Fills scan from the length bytes of an SOS segment at header (past its
+ * length field), using the tables in force and the restart interval.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readScanHeader(const unsigned char *header, unsigned short length,
+                          dhtTrie **tables, unsigned short restartInterval,
+                          progressiveScan *scan) {
+    unsigned char n = header[0];
+    if (n == 0 || n > MAX_SCAN_COMPONENTS || length != 1 + 2*n + 3) {
+        puts("ERROR: Invalid SOS segment");
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (INVALID_COLOR(header[1 + 2*i])) {
+            puts("ERROR: Invalid SOS segment");
+            return 1;
+        }
+    }
+    scan->colorIndex = header[1] - 1;
+    scan->componentCount = n;
+    scan->spectralStart = header[1 + 2*n];
+    scan->spectralEnd = header[2 + 2*n];
+    scan->approximationHigh = header[3 + 2*n] >> 4;
+    scan->restartInterval = restartInterval;
+    scan->acTable = NULL;
+    if (scan->spectralStart == 0) {
+        return scan->spectralEnd != 0;  // DC scans hold nothing else
+    }
+    // Bands of ACs are only ever sent one channel at a time
+    unsigned char acId = 2*(header[2] & 15) + 1;
+    if (n != 1 || scan->spectralEnd < scan->spectralStart ||
+        scan->spectralEnd > MAX_AC_COEFFICIENTS ||
+        acId >= MAX_NUMBER_OF_TABLES || tables[acId] == NULL) {
+        puts("ERROR: Invalid progressive scan");
+        return 1;
+    }
+    scan->acTable = tables[acId];
+    return 0;
+}
+
+/**
+ * Builds the tables of the DHT segment of length bytes at segment, which
+ * replace any of tables with the same ids, keeping them in list.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readTables(const unsigned char *segment, unsigned long length,
+                      dhtTrie **tables, scanList *list) {
+    if (list->tableCount == list->tableCapacity) {
+        size_t capacity = list->tableCapacity ? 2*list->tableCapacity : 8;
+        dhts **grown = realloc(list->tables, capacity * sizeof(dhts*));
+        if (grown == NULL) {
+            return 1;
+        }
+        list->tables = grown;
+        list->tableCapacity = capacity;
+    }
+    dhts *defined = calloc(1, sizeof(dhts));
+    FILE *file = fmemopen((void*)segment, length, "rb");
+    if (defined == NULL || file == NULL) {
+        free(defined);
+        if (file != NULL) {
+            fclose(file);
+        }
+        return 1;
+    }
+    defined->tablesLeftToMake = MAX_NUMBER_OF_TABLES;
+    int result = buildDhts(file, defined);
+    fclose(file);
+    if (result) {
+        destroyDhts(defined);
+        return 1;
+    }
+    for (int i = 0; i < MAX_NUMBER_OF_TABLES; i++) {
+        if (defined->tables[i] != NULL) {
+            tables[i] = defined->tables[i];
+        }
+    }
+    list->tables[list->tableCount++] = defined;
+    return 0;
+}
+
+/**
+ * Appends scan to list. Returns 0 on success and 1 otherwise
+ */
+static int appendScan(scanList *list, progressiveScan *scan) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2*list->capacity : 16;
+        progressiveScan *grown = realloc(list->scans,
+                                         capacity * sizeof(progressiveScan));
+        if (grown == NULL) {
+            return 1;
+        }
+        list->scans = grown;
+        list->capacity = capacity;
+    }
+    list->scans[list->count++] = *scan;
+    return 0;
+}
+
+/**
+ * Fills list with the scans of the size bytes of data (see
+ * indexProgressiveSlots()), stepping over their coded bits without decoding
+ * them. Returns 0 on success and 1 otherwise
+ */
+static int indexScans(const unsigned char *data, unsigned long size,
+                      jpegStats *stats, scanList *list) {
+    dhtTrie *tables[MAX_NUMBER_OF_TABLES] = {NULL};  // tables in force
+    if (stats->scanTables != NULL) {
+        memcpy(tables, stats->scanTables->tables, sizeof(tables));
+    }
+    unsigned short restartInterval = stats->restartInterval;
+    unsigned long index = 0;
+    while (index + MARKER_LENGTH <= size && data[index] == 0xFF) {
+        unsigned short marker = data[index] << 8 | data[index + 1];
+        if (marker == 0xFFFF) {
+            index++;  // fill byte
+            continue;
+        }
+        if (marker == JPEG_END) {
+            return list->count == 0;
+        }
+        if (index + 2*MARKER_LENGTH > size) {
+            break;
+        }
+        unsigned short length = data[index + 2] << 8 | data[index + 3];
+        unsigned long next = index + MARKER_LENGTH + length;
+        if (length < MARKER_LENGTH || next > size) {
+            break;
+        }
+        int result = 0;
+        if (marker == JPEG_SOS) {
+            progressiveScan scan;
+            result = readScanHeader(&data[index + 4], length - MARKER_LENGTH,
+                                    tables, restartInterval, &scan);
+            scan.start = next;
+            scan.end = findScanEnd(data, size, next);
+            result = result || appendScan(list, &scan);
+            next = scan.end;
+        } else if (marker == DHT_START) {
+            result = readTables(&data[index], next - index, tables, list);
+        } else if (marker == DRI_MARKER) {
+            result = length != DRI_LENGTH;
+            restartInterval = data[index + 4] << 8 | data[index + 5];
+        }
+        if (result) {
+            return 1;
+        }
+        index = next;
+    }
+    puts("ERROR: progressive image does not end with an EOI marker");
+    return 1;
+}
+
+/**
+ * Decodes the symbol at cursor with the AC table and moves past its code,
+ * storing the symbol in *value. Returns 0 on success and 1 otherwise
+ */
+static int readScanSymbol(bitCursor *cursor, dhtTrie *table,
+                          unsigned char *value) {
+    const dhtLookupEntry *lookup = getDhtLookup(table, 1);
+    if (lookup != NULL) {
+        const dhtLookupEntry *entry =
+            &lookup[peekCursor(cursor, DHT_LOOKUP_BITS)];
+        if (entry->count != 0) {
+            // Only the code is used: symbols after it mean other things here
+            *value = entry->values[0];
+            return skipCursor(cursor, entry->codeEnds[0]);
+        }
+    }
+    unsigned char length;
+    return walkCursor(cursor, table, value, &length) ||
+           skipCursor(cursor, length);
+}
+
+/**
+ * Returns the number of blocks the scans of channel colorIndex alone hold:
+ * enough to cover its samples, which unlike those of MCUs are not padded to
+ * whole MCUs
+ */
+static unsigned long long channelBlocks(jpegStats *stats,
+                                        unsigned char colorIndex) {
+    unsigned char maxHorizontal = 1, maxVertical = 1;
+    for (int i = 0; i < MAX_SCAN_COMPONENTS; i++) {
+        if (GET_4_MSBs(stats->sampling[i]) > maxHorizontal) {
+            maxHorizontal = GET_4_MSBs(stats->sampling[i]);
+        }
+        if (GET_FIRST_4_BITS(stats->sampling[i]) > maxVertical) {
+            maxVertical = GET_FIRST_4_BITS(stats->sampling[i]);
+        }
+    }
+    unsigned long long width = ((unsigned long long)stats->samplesPerLine *
+                                GET_4_MSBs(stats->sampling[colorIndex]) +
+                                maxHorizontal - 1) / maxHorizontal;
+    unsigned long long height = ((unsigned long long)stats->lines *
+                                 GET_FIRST_4_BITS(stats->sampling[colorIndex]) +
+                                 maxVertical - 1) / maxVertical;
+    return ((width + BLOCK_SIDE - 1) / BLOCK_SIDE) *
+           ((height + BLOCK_SIDE - 1) / BLOCK_SIDE);
+}
+
+/**
+ * Moves cursor past the restart marker it should be at, after the padding
+ * bits before it. Returns 0 on success and 1 otherwise
+ */
+static int skipRestartMarker(bitCursor *cursor) {
+    if (cursor->bit != 0 && skipCursor(cursor, 8 - cursor->bit)) {
+        return 1;
+    }
+    if (cursor->byte + 1 >= cursor->end ||
+        cursor->data[cursor->byte] != 0xFF ||
+        cursor->data[cursor->byte + 1] < RST_MARKER_0 ||
+        cursor->data[cursor->byte + 1] > RST_MARKER_7) {
+        return 1;
+    }
+    cursor->byte += MARKER_LENGTH;
+    return 0;
+}
+
+/**
+ * Decodes the AC first scan of data, counting the coeficients of 2 bits or
+ * more in *slots and appending the position of their last bit to index
+ * (unless NULL). Returns 0 on success and 1 otherwise
+ */
+static int countScanSlots(const unsigned char *data, progressiveScan *scan,
+                          jpegStats *stats, slotIndex *index,
+                          unsigned long long *slots) {
+    bitCursor cursor = {data, scan->start, 0, scan->end};
+    unsigned long long blocks = channelBlocks(stats, scan->colorIndex);
+    unsigned int endOfBands = 0;  // blocks left in an EOB run
+    for (unsigned long long block = 0; block < blocks; block++) {
+        if (scan->restartInterval != 0 && block != 0 &&
+            block % scan->restartInterval == 0) {
+            if (skipRestartMarker(&cursor)) {
+                return 1;
+            }
+            endOfBands = 0;
+        }
+        if (endOfBands != 0) {
+            endOfBands--;
+            continue;
+        }
+        unsigned int k = scan->spectralStart;
+        while (k <= scan->spectralEnd) {
+            unsigned char value;
+            if (readScanSymbol(&cursor, scan->acTable, &value)) {
+                return 1;
+            }
+            unsigned char zeros = GET_4_MSBs(value);
+            unsigned char length = GET_FIRST_4_BITS(value);
+            if (length == 0 && zeros == 15) {
+                k += 16;  // ZRL
+                continue;
+            }
+            if (length == 0) {
+                // EOB run of this block and 2^zeros - 1 more, plus its bits
+                endOfBands = (1U << zeros) - 1;
+                if (zeros != 0) {
+                    endOfBands += peekCursor(&cursor, zeros);
+                    if (skipCursor(&cursor, zeros)) {
+                        return 1;
+                    }
+                }
+                break;
+            }
+            k += zeros;
+            if (k > scan->spectralEnd) {
+                return 1;
+            }
+            // Only the last bit of the value changes, as for baseline ACs
+            if (length > 1 && skipCursor(&cursor, length - 1)) {
+                return 1;
+            }
+            if (length > 1) {
+                if (index != NULL &&
+                    appendSlot(index, 8ULL*cursor.byte + cursor.bit)) {
+                    return 1;
+                }
+                (*slots)++;
+            }
+            if (skipCursor(&cursor, 1)) {
+                return 1;
+            }
+            k++;
+        }
+    }
+    return 0;
+}
+
+int indexProgressiveSlots(const unsigned char *data, unsigned long size,
+                          jpegStats *stats, unsigned char channelMask,
+                          slotIndex *index, unsigned long long *slots) {
+    scanList list = {0};
+    *slots = 0;
+    int result = indexScans(data, size, stats, &list);
+    for (size_t i = 0; !result && i < list.count; i++) {
+        progressiveScan *scan = &list.scans[i];
+        if (scan->spectralStart != 0 && scan->approximationHigh == 0 &&
+            (channelMask & CHANNEL_BIT(scan->colorIndex))) {
+            result = countScanSlots(data, scan, stats, index, slots);
+            if (result) {
+                printf("ERROR reading progressive scan %zu\n", i);
+            }
+        }
+    }
+    destroyScanList(&list);
+    return result;
+}
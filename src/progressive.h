@@ -0,0 +1,32 @@
+#ifndef __CSTEG_PROGRESSIVE__
+#define __CSTEG_PROGRESSIVE__
+#include "csteg.h"
+#include "cache.h"
+
+/*
+ * Progressive (SOF2) images spread the coeficients of each block over many
+ * scans: DC scans, first scans of a band of ACs of one channel, and
+ * refinement scans adding lower bits to coeficients already sent. Hidden
+ * bits go in the LSBs of the values of AC first scans, the same way they go
+ * in the ACs of baseline images. A value of 2 bits or more stays non-zero
+ * whatever its LSB, so refinement scans, which only depend on which
+ * coeficients are non-zero, decode as before and are never changed.
+ *
+ * The scans of an image are indexed once from their segment lengths and
+ * the markers ending them, so only the AC first scans of the channels in
+ * the mask are decoded and every other scan is stepped over unread.
+ */
+
+/*
+ * Counts the AC coeficients able to hold a bit (see mcuNotPropper()) in the
+ * channels of channelMask of the size bytes of data, which run from the
+ * first SOS marker of the progressive image described by stats to its EOI
+ * marker, storing their number in *slots. Their positions in data are
+ * appended to index, unless it is NULL.
+ * Returns 0 on success and 1 otherwise
+ */
+int indexProgressiveSlots(const unsigned char *data, unsigned long size,
+                          jpegStats *stats, unsigned char channelMask,
+                          slotIndex *index, unsigned long long *slots);
+
+#endif
@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "restart.h"
+#include "trie.h"
+
+#define MAX_DC_CATEGORY 11  // bits of the largest baseline DC difference
+
+/**
+ * Huffman code of one symbol, with a length of 0 if the table has none
+ */
+typedef struct huffmanCode {
+    unsigned short code;
+    unsigned char length;
+} huffmanCode;
+
+/**
+ * Reads the entropy coded bits of a scan, leaving out stuff-bytes
+ */
+typedef struct bitReader {
+    FILE *file;
+    size_t length;       // valid bytes in buffer
+    size_t next;         // next byte of buffer to read
+    unsigned char byte;  // byte bits are being read from
+    int bitsLeft;        // bits of byte not read yet
+    unsigned char buffer[RESTART_BUFFER_SIZE];
+} bitReader;
+
+/**
+ * Writes entropy coded bits, adding stuff-bytes after every FF byte
+ */
+typedef struct bitWriter {
+    FILE *file;
+    size_t length;              // bytes held in buffer
+    unsigned int bits;          // bits not yet in buffer, last one lowest
+    int bitCount;               // number of those bits
+    unsigned char buffer[RESTART_BUFFER_SIZE + 1];
+} bitWriter;
+
+/**
+ * Stores in codes (256 entries) the code of every symbol reachable from node,
+ * whose own code is the length bits of code
+ */
+static void collectCodes(dhtTrie *node, unsigned int code, int length,
+                         huffmanCode *codes) {
+    if (node == NULL) {
+        return;
+    }
+    if (!isEmpty(node)) {
+        codes[getValue(node)].code = code;
+        codes[getValue(node)].length = length;
+        return;
+    }
+    if (length < MAX_CODE_LENGTH) {
+        collectCodes(traverseTrie(node, 0), code << 1, length + 1, codes);
+        collectCodes(traverseTrie(node, 1), code << 1 | 1, length + 1, codes);
+    }
+}
+
+/**
+ * Returns the next byte of the scan, including markers and stuff-bytes, or
+ * -1 once the file ends
+ */
+static int readScanByte(bitReader *reader) {
+    if (reader->next == reader->length) {
+        reader->length = fread(reader->buffer, 1, RESTART_BUFFER_SIZE,
+                               reader->file);
+        reader->next = 0;
+        if (reader->length == 0) {
+            return -1;
+        }
+    }
+    return reader->buffer[reader->next++];
+}
+
+/**
+ * Returns the next bit of the scan, or -1 if it ends or reaches a marker
+ */
+static int readBit(bitReader *reader) {
+    if (reader->bitsLeft == 0) {
+        int byte = readScanByte(reader);
+        if (byte < 0) {
+            return -1;
+        }
+        if (byte == 0xFF && readScanByte(reader) != 0) {
+            puts("ERROR: unexpected marker in scan");
+            return -1;
+        }
+        reader->byte = byte;
+        reader->bitsLeft = 8;
+    }
+    reader->bitsLeft--;
+    return reader->byte >> reader->bitsLeft & 1;
+}
+
+/**
+ * Reads count bits (at most 16) into *value, first bit highest.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readBits(bitReader *reader, int count, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < count; i++) {
+        int bit = readBit(reader);
+        if (bit < 0) {
+            return 1;
+        }
+        *value = *value << 1 | bit;
+    }
+    return 0;
+}
+
+/**
+ * Reads the symbol of the next Huffman code of table into *symbol.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readSymbol(bitReader *reader, dhtTrie *table,
+                      unsigned char *symbol) {
+    while (isEmpty(table)) {
+        int bit = readBit(reader);
+        if (bit < 0) {
+            return 1;
+        }
+        table = traverseTrie(table, bit);
+        if (table == NULL) {
+            puts("ERROR: invalid Huffman code in scan");
+            return 1;
+        }
+    }
+    *symbol = getValue(table);
+    return 0;
+}
+
+/**
+ * Drops the padding bits before a restart marker and reads past the marker.
+ * Returns 0 on success and 1 otherwise
+ */
+static int readRestartMarker(bitReader *reader) {
+    reader->bitsLeft = 0;
+    int first = readScanByte(reader);
+    int second = readScanByte(reader);
+    if (first != 0xFF || second < RST_MARKER_0 ||
+        second >= RST_MARKER_0 + RST_MARKERS) {
+        puts("ERROR: missing restart marker in scan");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Writes the bytes in writer's buffer to its file.
+ * Returns 0 on success and 1 otherwise
+ */
+static int flushWriter(bitWriter *writer) {
+    int result = fwrite(writer->buffer, 1, writer->length, writer->file) !=
+                 writer->length;
+    writer->length = 0;
+    return result;
+}
+
+/**
+ * Writes the count (at most 16) lowest bits of value, highest first.
+ * Returns 0 on success and 1 otherwise
+ */
+static int writeBits(bitWriter *writer, unsigned int value, int count) {
+    writer->bits = writer->bits << count | (value & ((1U << count) - 1));
+    writer->bitCount += count;
+    while (writer->bitCount >= 8) {
+        writer->bitCount -= 8;
+        unsigned char byte = writer->bits >> writer->bitCount;
+        writer->buffer[writer->length++] = byte;
+        if (byte == 0xFF) {
+            writer->buffer[writer->length++] = 0;  // stuff-byte
+        }
+        if (writer->length >= RESTART_BUFFER_SIZE && flushWriter(writer)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pads the last byte written with 1 bits and, unless marker is negative,
+ * writes restart marker RSTmarker. Returns 0 on success and 1 otherwise
+ */
+static int writeRestartMarker(bitWriter *writer, int marker) {
+    if (writer->bitCount != 0 &&
+        writeBits(writer, 0xFF, 8 - writer->bitCount)) {
+        return 1;
+    }
+    if (marker < 0) {
+        return 0;
+    }
+    // Markers are written directly, as they must not be stuffed
+    if (writer->length + MARKER_LENGTH > RESTART_BUFFER_SIZE &&
+        flushWriter(writer)) {
+        return 1;
+    }
+    writer->buffer[writer->length++] = 0xFF;
+    writer->buffer[writer->length++] = RST_MARKER_0 + marker;
+    return 0;
+}
+
+/**
+ * Writes the code of symbol from codes. Returns 0 on success and 1 if the
+ * table has no code for it
+ */
+static int writeSymbol(bitWriter *writer, const huffmanCode *codes,
+                       unsigned char symbol) {
+    if (codes[symbol].length == 0) {
+        printf("ERROR: Huffman table has no code for symbol %02X\n", symbol);
+        return 1;
+    }
+    return writeBits(writer, codes[symbol].code, codes[symbol].length);
+}
+
+/**
+ * Returns the DC difference stored in the bits of value, which has category
+ * bits (see JPEG Annex F.2.2.1)
+ */
+static int extendDifference(unsigned int value, int category) {
+    if (category == 0) {
+        return 0;
+    }
+    if (value < 1U << (category - 1)) {
+        return (int)value - (int)(1U << category) + 1;
+    }
+    return value;
+}
+
+/**
+ * Writes the DC difference with the codes of a DC table.
+ * Returns 0 on success and 1 otherwise
+ */
+static int writeDifference(bitWriter *writer, const huffmanCode *codes,
+                           int difference) {
+    int magnitude = difference < 0 ? -difference : difference;
+    int category = 0;
+    while (magnitude >> category) {
+        category++;
+    }
+    if (category > MAX_DC_CATEGORY) {
+        printf("ERROR: DC difference %d is out of range\n", difference);
+        return 1;
+    }
+    unsigned int bits = difference < 0 ? difference + (1 << category) - 1 :
+                        difference;
+    return writeSymbol(writer, codes, category) ||
+           writeBits(writer, bits, category);
+}
+
+/**
+ * Copies one block of color index colorIndex from reader to writer,
+ * re-encoding its DC coefficient against prediction *written instead of
+ * *read, and updates both predictions. Returns 0 on success and 1 otherwise
+ */
+static int copyBlock(bitReader *reader, bitWriter *writer, jpegStats *stats,
+                     huffmanCode codes[][2][256], int colorIndex,
+                     int *read, int *written) {
+    unsigned char symbol;
+    unsigned int value;
+    if (readSymbol(reader, stats->dcHuffmanTables[colorIndex], &symbol) ||
+        symbol > MAX_DC_CATEGORY || readBits(reader, symbol, &value)) {
+        return 1;
+    }
+    int dc = *read + extendDifference(value, symbol);
+    if (writeDifference(writer, codes[colorIndex][0], dc - *written)) {
+        return 1;
+    }
+    *read = dc;
+    *written = dc;
+
+    // AC coeficients are copied as they are
+    int coeficient = 1;
+    while (coeficient <= MAX_AC_COEFFICIENTS) {
+        if (readSymbol(reader, stats->acHuffmanTables[colorIndex], &symbol) ||
+            writeSymbol(writer, codes[colorIndex][1], symbol)) {
+            return 1;
+        }
+        if (symbol == EOB) {
+            return 0;
+        }
+        int length = GET_FIRST_4_BITS(symbol);
+        if (readBits(reader, length, &value) ||
+            writeBits(writer, value, length)) {
+            return 1;
+        }
+        coeficient += symbol == ZRL ? 16 : GET_4_MSBs(symbol) + 1;
+    }
+    if (coeficient > MAX_AC_COEFFICIENTS + 1) {
+        puts("ERROR: block has more than 64 coeficients");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Copies the scan from reader to writer with a restart marker every interval
+ * MCUs. Returns 0 on success and 1 otherwise
+ */
+static int copyScan(bitReader *reader, bitWriter *writer, jpegStats *stats,
+                    unsigned short interval) {
+    huffmanCode (*codes)[2][256] = calloc(CR_ID, sizeof(*codes));
+    if (codes == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < CR_ID; i++) {
+        collectCodes(stats->dcHuffmanTables[i], 0, 0, codes[i][0]);
+        collectCodes(stats->acHuffmanTables[i], 0, 0, codes[i][1]);
+    }
+
+    int read[CR_ID] = {0};     // DC predictions of the original scan
+    int written[CR_ID] = {0};  // DC predictions of the new scan
+    int result = 0;
+    for (unsigned long long m = 0; m < stats->mcuCount && !result; m++) {
+        if (m != 0 && stats->restartInterval != 0 &&
+            m % stats->restartInterval == 0) {
+            result = readRestartMarker(reader);
+            for (int i = 0; i < CR_ID; i++) {
+                read[i] = 0;
+            }
+        }
+        if (m != 0 && m % interval == 0) {
+            result = result ||
+                     writeRestartMarker(writer, (m / interval - 1) %
+                                                RST_MARKERS);
+            for (int i = 0; i < CR_ID; i++) {
+                written[i] = 0;
+            }
+        }
+        for (unsigned int block = 0;
+             block < stats->totalColorCounts && !result; block++) {
+            // Blocks of an MCU are those of Y, then Cb, then Cr
+            int colorIndex = 0;
+            unsigned int rest = block;
+            while (rest >= stats->colorCounts[colorIndex]) {
+                rest -= stats->colorCounts[colorIndex];
+                colorIndex++;
+            }
+            result = copyBlock(reader, writer, stats, codes, colorIndex,
+                               &read[colorIndex], &written[colorIndex]);
+        }
+    }
+    free(codes);
+    if (result) {
+        puts("ERROR: could not transcode scan");
+        return 1;
+    }
+    return writeRestartMarker(writer, -1) || flushWriter(writer);
+}
+
+unsigned short defaultRestartInterval(jpegStats *stats) {
+    unsigned long long interval = (stats->mcuCount + TARGET_RESTART_COUNT - 1)
+                                  / TARGET_RESTART_COUNT;
+    if (interval < MIN_RESTART_INTERVAL) {
+        interval = MIN_RESTART_INTERVAL;
+    }
+    return interval > MAX_RESTART_INTERVAL ? MAX_RESTART_INTERVAL : interval;
+}
+
+/**
+ * Copies the length bytes of headers (from SOI to the end of SOS) to output,
+ * leaving out any DRI segment and adding one setting interval before SOS.
+ * Returns 0 on success and 1 otherwise
+ */
+static int copyHeaders(const unsigned char *headers, long length,
+                       FILE *output, unsigned short interval) {
+    if (fwrite(headers, 1, MARKER_LENGTH, output) != MARKER_LENGTH) {
+        return 1;
+    }
+    long offset = MARKER_LENGTH;
+    while (offset + 2*MARKER_LENGTH <= length) {
+        if (headers[offset] != 0xFF) {
+            puts("ERROR: invalid segment in headers");
+            return 1;
+        }
+        unsigned short marker = headers[offset] << 8 | headers[offset + 1];
+        long segmentLength = MARKER_LENGTH + (headers[offset + 2] << 8 |
+                                              headers[offset + 3]);
+        if (offset + segmentLength > length) {
+            puts("ERROR: invalid segment in headers");
+            return 1;
+        }
+        if (marker == JPEG_SOS) {
+            unsigned char dri[] = {DRI_MARKER >> 8, DRI_MARKER & 0xFF,
+                                   0, DRI_LENGTH, interval >> 8,
+                                   interval & 0xFF};
+            if (fwrite(dri, 1, sizeof(dri), output) != sizeof(dri)) {
+                return 1;
+            }
+        }
+        if (marker != DRI_MARKER &&
+            fwrite(&headers[offset], 1, segmentLength, output) !=
+            (size_t)segmentLength) {
+            return 1;
+        }
+        offset += segmentLength;
+    }
+    return offset != length;
+}
+
+int writeWithRestarts(FILE *file, FILE *output, jpegStats *stats,
+                      unsigned short interval) {
+    if (interval < MIN_RESTART_INTERVAL) {
+        printf("ERROR: restart interval must be at least %d\n",
+               MIN_RESTART_INTERVAL);
+        return 1;
+    }
+    long scanStart = ftell(file);
+    unsigned char *headers = malloc(scanStart);
+    bitReader *reader = malloc(sizeof(bitReader));
+    bitWriter *writer = malloc(sizeof(bitWriter));
+    int result = headers == NULL || reader == NULL || writer == NULL;
+    if (!result) {
+        rewind(file);
+        result = fread(headers, 1, scanStart, file) != (size_t)scanStart ||
+                 copyHeaders(headers, scanStart, output, interval);
+    }
+    if (!result) {
+        reader->file = file;
+        reader->length = 0;
+        reader->next = 0;
+        reader->bitsLeft = 0;
+        writer->file = output;
+        writer->length = 0;
+        writer->bits = 0;
+        writer->bitCount = 0;
+        unsigned char end[] = {JPEG_END >> 8, JPEG_END & 0xFF};
+        result = copyScan(reader, writer, stats, interval) ||
+                 fwrite(end, 1, MARKER_LENGTH, output) != MARKER_LENGTH;
+    }
+    free(headers);
+    free(reader);
+    free(writer);
+    fseek(file, scanStart, SEEK_SET);
+    return result;
+}
@@ -0,0 +1,33 @@
+#ifndef __CSTEG_RESTART__
+#define __CSTEG_RESTART__
+#include <stdio.h>
+#include "csteg.h"
+
+/*
+ * Lossless transcoding of a baseline scan to a new restart interval. Every
+ * coefficient is kept; only the DC differences of the first blocks after each
+ * restart marker change, as DC prediction starts over at every marker.
+ */
+
+#define MIN_RESTART_INTERVAL 2      // scans are read assuming at least 2
+#define MAX_RESTART_INTERVAL 65535  // DRI holds 16 bits
+#define TARGET_RESTART_COUNT 1024   // restart intervals given by default
+#define RESTART_BUFFER_SIZE 65536   // bytes read or written at once
+
+/*
+ * Returns the restart interval giving the scan described by stats about
+ * TARGET_RESTART_COUNT restart intervals
+ */
+unsigned short defaultRestartInterval(jpegStats*);
+
+/*
+ * Writes to output a copy of the JPG file (cursor at the start of its scan)
+ * whose DRI segment, added if it had none, sets the given restart interval
+ * and whose scan has a restart marker every interval MCUs. Returns 0 on
+ * success and 1 otherwise, in particular if a DC Huffman table has no code
+ * for a difference the new markers create.
+ */
+int writeWithRestarts(FILE *file, FILE *output, jpegStats*,
+                      unsigned short interval);
+
+#endif
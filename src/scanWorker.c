@@ -1,6 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <unistd.h>
 #include "scanWorker.h"
+#include "cache.h"
+#include "bits.h"
+#include "hash.h"
+#include "timer.h"
+#include "arena.h"
+#include "batch.h"
+#include "lanes.h"
+#include "progressive.h"
+#include "scatter.h"
 #ifdef TESTING
     #include <assert.h>
 #endif
@@ -18,38 +29,65 @@ typedef struct mcu {
                               // by mcu takes. in [1,F] 
 } mcu;
 
+#define SCAN_WINDOW_MARGIN 64   // bytes kept buffered ahead of the cursor
+#define SCAN_WINDOW_KEEP 32     // bytes kept buffered behind the cursor
+#define SCAN_BUFFER_GROWTH 4096 // bytes added to scanBuffer when it is full
+#define COPY_CHUNK_SIZE 65536   // bytes copied at once when finishing a scan
+
+/*
+ * Scans longer than this are only ever held in a window of SCAN_WINDOW_SIZE
+ * bytes at a time
+ */
+static unsigned long long streamingThreshold = DEFAULT_STREAMING_THRESHOLD;
+
+static int verifyHides = 0;  // check hidden bits before they are written
+
+static unsigned char channelMask = DEFAULT_CHANNELS;  // channels holding bits
+
+static int decodeThreads = 1;  // threads counting the slots of an image
+
+static const char *scatterKey = NULL;  // orders the slots if not NULL
+
 // TODO: use totalSize somewhere
 typedef struct scanWorker {
-    unsigned char* scanBuffer;  // Stores all data after SOS segment
-    unsigned long totalSize;  // Space alloced for scanBuffer;
+    unsigned char* scanBuffer;  // Stores all data after SOS segment, or a
+                                // window over it when streaming
+    unsigned long totalSize;  // Bytes of scan data held in scanBuffer;
                               // there should be totalSize bytes to write to jpg
-    unsigned int mcusRead;  // Number of MCUs read  by scanWorker
+    unsigned long bufferCapacity;  // Space alloced for scanBuffer
+    unsigned long long mcusRead;  // Number of MCUs read  by scanWorker
     
     unsigned long bytesRead; // Number of bytes from scanBuffer read
     unsigned char bitCursor; // number of bits read in scanBuffer[bytesRead]
-    unsigned char onSecondChrominance; // True if on Cr, False if on Cb 
+    unsigned char block;  // block of the MCU being read: Y blocks, then Cb,
+                          // then Cr
+    unsigned char colorIndex;  // color index (color ID - 1) of that block
     mcu* mcu;  // data pertaining to current MCU we are looking at
-} scanWorker;
+    struct mcu mcuData;  // what mcu points to once the first MCU is loaded
+    unsigned long restuffs;  // number of stuff-bytes added or removed
+    unsigned long loadedSize;   // totalSize when the scan was loaded
+    unsigned long changedFrom;  // bytes [changedFrom, changedTo) of
+    unsigned long changedTo;    // scanBuffer changed, none if changedTo is 0
 
-/**
- * Frees memory allocated for an mcu struct
- */ 
-void destroyMCU(mcu *x) {
-    free(x);
-}
+    // Only used when streaming, while the scan is not fully in scanBuffer
+    FILE *source;                    // file the rest of the scan comes from
+    long sourceStart;                // file offset of the start of the scan
+    unsigned long long sourceLeft;   // bytes of scan not read from source yet
+    unsigned long long windowStart;  // scan offset of scanBuffer[0]
+    FILE *sink;  // where bytes leaving the window are written, NULL if none
 
-/**
- * Creates an MCU struct, returning its address if mcu created
- * successfully and NULL otherwise. DOES NOT INITIALISE ANY VALUES
- * 
- * Assumes stats->colorCounts has length 3
- */
-mcu* initMCU(jpegStats *stats) {
-    mcu* x = malloc(sizeof(mcu));
-    if (x == NULL)
-        return NULL;
-    return x;
-}
+    // Only used when verifying a hide
+    slotIndex *written;  // scan positions of hidden bits not yet checked
+    const unsigned char *hidden;  // piece of the payload being hidden
+    unsigned long long hiddenStart;  // bits of the payload before hidden
+    const slotScatter *scatter;  // order of the slots if hidden is scattered
+    unsigned long long hiddenBits;   // bits of hidden, if scattered
+    unsigned long long bitsChecked;  // hidden bits checked so far
+    unsigned char verifyFailed;  // set once a hidden bit read back wrong
+
+    arena *memory;  // arena of the thread that created this struct, which it
+                    // and scanBuffer are allocated from
+} scanWorker;
 
 /**
  * Returns 1 if index corresponds to a position afer the scan of the image and
@@ -60,12 +98,110 @@ char isEndOfScan(scanWorker *sw, unsigned long index) {
     if (index >= sw->totalSize) {
         return 1;
     }
-    unsigned short* end = (unsigned short*)&sw->scanBuffer[index];
-    unsigned short realEnd = BYTE_TO_SHORT_VALUE(*end);
+    if (index + 1 >= sw->totalSize) {
+        return 0;
+    }
+    unsigned short realEnd = sw->scanBuffer[index] << 8 | 
+                             sw->scanBuffer[index + 1];
     return realEnd == JPEG_END;
 
 }
 
+/**
+ * Checks that the hidden bits recorded in sw->written before scan position
+ * end (8*byte + bit) read back as the bits of sw->hidden, keeping the later
+ * ones for another check. Scattered hides record every slot they pass, and
+ * slots holding no bit of hidden are not checked. Returns 0 if they all
+ * match and 1 otherwise
+ */
+int checkHiddenBits(scanWorker *sw, unsigned long long end) {
+    slotIndex *later = initSlotIndex();
+    if (later == NULL) {
+        return 1;
+    }
+    slotIterator slots;
+    startSlotIterator(&slots, sw->written);
+    unsigned long long position;
+    while (nextSlot(&slots, &position) == 0) {
+        if (position >= end) {
+            if (appendSlot(later, position)) {
+                destroySlotIndex(later);
+                return 1;
+            }
+            continue;
+        }
+        unsigned long long offset = position - 8*sw->windowStart;
+        unsigned long long i = sw->bitsChecked++;
+        if (sw->scatter != NULL) {
+            i = gatherBit(sw->scatter, i);  // bit held by slot i
+            if (i >= sw->hiddenBits) {
+                continue;
+            }
+        }
+        unsigned long long j = i - sw->hiddenStart;  // bit i within hidden
+        if (position < 8*sw->windowStart ||
+            ((sw->scanBuffer[offset >> 3] >> (7 - (offset & 7))) & 1) !=
+            ((sw->hidden[j >> 3] >> (7 - (j & 7))) & 1)) {
+            printf("ERROR: hidden bit %llu reads back wrong, nothing was "
+                   "written\n", i);
+            sw->verifyFailed = 1;
+            break;
+        }
+    }
+    destroySlotIndex(sw->written);
+    sw->written = sw->verifyFailed ? NULL : later;
+    if (sw->verifyFailed) {
+        destroySlotIndex(later);
+    }
+    return sw->verifyFailed;
+}
+
+/**
+ * Moves the window of a streaming sw forward once fewer than
+ * SCAN_WINDOW_MARGIN bytes after its cursor are buffered, writing the bytes
+ * that leave the window to sw->sink (if any) and refilling it from
+ * sw->source. All cursors into scanBuffer are adjusted accordingly.
+ * Returns 0 on success and 1 otherwise
+ */
+int slideScanWindow(scanWorker *sw) {
+    if (sw->bytesRead + SCAN_WINDOW_MARGIN < sw->totalSize ||
+        sw->bytesRead <= SCAN_WINDOW_KEEP) {
+        return 0;
+    }
+    unsigned long dropped = sw->bytesRead - SCAN_WINDOW_KEEP;
+    if (sw->written != NULL &&
+        checkHiddenBits(sw, 8*(sw->windowStart + dropped))) {
+        return 1;
+    }
+    if (sw->sink != NULL &&
+        fwrite(sw->scanBuffer, 1, dropped, sw->sink) != dropped) {
+        puts("ERROR: could not write scan data");
+        return 1;
+    }
+    memmove(sw->scanBuffer, &sw->scanBuffer[dropped], sw->totalSize - dropped);
+    sw->totalSize -= dropped;
+    sw->bytesRead -= dropped;
+    sw->windowStart += dropped;
+    if (sw->mcu != NULL) {
+        // Positions before the window belong to coeficients already done
+        sw->mcu->index = sw->mcu->index >= dropped ? sw->mcu->index - dropped :
+                         0;
+    }
+
+    unsigned long long wanted = sw->bufferCapacity - sw->totalSize;
+    if (wanted > sw->sourceLeft) {
+        wanted = sw->sourceLeft;
+    }
+    if (fread(&sw->scanBuffer[sw->totalSize], 1, wanted, sw->source) !=
+        wanted) {
+        puts("ERROR: could not read scan data");
+        return 1;
+    }
+    sw->totalSize += wanted;
+    sw->sourceLeft -= wanted;
+    return 0;
+}
+
 /**
  * Reads the next bit from sw's scanBuffer and returns it after propperly 
  * incrementing sw's byte and bit cursors accordingly, unless current byte is
@@ -74,6 +210,10 @@ char isEndOfScan(scanWorker *sw, unsigned long index) {
  * Skips past stuff-bytes, defined in function
  */
 unsigned char nextBit(scanWorker* sw) {
+    // Keep enough of the scan buffered when streaming
+    if (sw->sourceLeft != 0 && slideScanWindow(sw)) {
+        return END_OF_FILE_ENCOUNTERED;
+    }
     // Don't read if you are at end of scan
     if (isEndOfScan(sw, sw->bytesRead)) {
         return END_OF_FILE_ENCOUNTERED;
@@ -102,6 +242,70 @@ unsigned char nextBit(scanWorker* sw) {
     return data;
 }
 
+/**
+ * Returns a cursor at the same bit of sw's scan as its own
+ */
+static bitCursor cursorOf(const scanWorker *sw) {
+    bitCursor cursor = {sw->scanBuffer, sw->bytesRead, sw->bitCursor,
+                        sw->totalSize};
+    return cursor;
+}
+
+/**
+ * Returns the next n (at most 16) bits of sw's scan after its cursor, first
+ * bit read as most significant, without moving the cursor. Skips stuff-bytes
+ * like nextBit(). Bits past the end of scanBuffer read as 1
+ */
+unsigned int peekBits(scanWorker *sw, unsigned char n) {
+    bitCursor cursor = cursorOf(sw);
+    return peekCursor(&cursor, n);
+}
+
+/**
+ * Moves sw's cursor past its next n bits, as n calls to nextBit() would,
+ * a byte at a time. Returns 0 on success and 1 if the end of the scan is
+ * reached first
+ */
+int skipBits(scanWorker *sw, unsigned char n) {
+    // Jump straight to the end when no stuff-byte or marker is in the way
+    bitCursor cursor = cursorOf(sw);
+    if (jumpCursor(&cursor, n) == 0) {
+        sw->bytesRead = cursor.byte;
+        sw->bitCursor = cursor.bit;
+        return 0;
+    }
+    while (n != 0) {
+        if (sw->sourceLeft != 0 && slideScanWindow(sw)) {
+            return 1;
+        }
+        if (isEndOfScan(sw, sw->bytesRead)) {
+            return 1;
+        }
+        // Sliding moves the window, so the cursor is taken again each byte
+        cursor = cursorOf(sw);
+        n -= stepCursor(&cursor, n);
+        sw->bytesRead = cursor.byte;
+        sw->bitCursor = cursor.bit;
+    }
+    return 0;
+}
+
+/**
+ * Returns the lookup entry for the bits at sw's cursor when decoding with
+ * table, or NULL if the lookup cannot be used there (out of memory, or at
+ * the end of the scan, which nextBit() reports instead)
+ */
+const dhtLookupEntry* probeLookup(scanWorker *sw, dhtTrie *table,
+                                  unsigned char isAc) {
+    const dhtLookupEntry *lookup = getDhtLookup(table, isAc);
+    if (lookup == NULL ||
+        (sw->sourceLeft != 0 && slideScanWindow(sw)) ||
+        isEndOfScan(sw, sw->bytesRead)) {
+        return NULL;
+    }
+    return &lookup[peekBits(sw, DHT_LOOKUP_BITS)];
+}
+
 /**
  * Reads a coeficient of somce MCU and stores relevant data in the designated
  * locations. Sets *indexStorage and *bitStorage (later gurananteed) 
@@ -122,19 +326,28 @@ int readComponentElement(scanWorker *scanner, mcu *mcuData,
     #endif
 
     unsigned char coeficientsRead = 0;
-    // Read length part bit by bit
-    while (isEmpty(table)) {
-        char bit = nextBit(scanner);
-        if (bit == END_OF_FILE_ENCOUNTERED)
-            return 1;
-        table = traverseTrie(table, bit);
-        if (table == NULL) {
-            puts("ERROR: NULL TABLE");
+    unsigned char numBits; // length of coeficient in bits
+    const dhtLookupEntry *entry = probeLookup(scanner, table, isAc);
+    if (entry != NULL && entry->count != 0) {
+        // Code is short enough to be decoded in one step
+        numBits = entry->values[0];
+        if (skipBits(scanner, entry->codeEnds[0]))
             return 1;
+    } else {
+        // Read length part bit by bit
+        while (isEmpty(table)) {
+            char bit = nextBit(scanner);
+            if (bit == END_OF_FILE_ENCOUNTERED)
+                return 1;
+            table = traverseTrie(table, bit);
+            if (table == NULL) {
+                puts("ERROR: NULL TABLE");
+                return 1;
+            }
         }
+        numBits = getValue(table);
     }
-    
-    unsigned char numBits = getValue(table); // length of coeficient in bits
+
     mcuData->index = scanner->bytesRead; // Note: this not needed
     if (numBits == EOB) { 
         // No more coeficients to reads, realy only consequential for ACs
@@ -168,11 +381,9 @@ int readComponentElement(scanWorker *scanner, mcu *mcuData,
         #ifdef TESTING
             //puts("READING VALUE:");
         #endif
-        for (int i = 0; i < numBits - 1; i++) {
-            // Just skip through all but last bit of current coeficinet
-            if (nextBit(scanner) == END_OF_FILE_ENCOUNTERED)
-                return 1;
-        }
+        // Just skip through all but last bit of current coeficinet
+        if (numBits > 1 && skipBits(scanner, numBits - 1))
+            return 1;
         mcuData->index = scanner->bytesRead;
         mcuData->bit = scanner->bitCursor;
 
@@ -186,6 +397,42 @@ int readComponentElement(scanWorker *scanner, mcu *mcuData,
     return 0;
 }
 
+/**
+ * Reads past as many ACs of the current block as the lookup entries of
+ * acTable allow, several per probe, adding them to mcuData->acCurrentlyOn.
+ * If onlyPlain, stops before the first AC that could hold a bit (see
+ * mcuNotPropper()), an EOB or the last AC of the block, which are left for
+ * readComponentElement(). Otherwise stops after an EOB (setting mcuData->bit
+ * to EOB_ENCOUNTERED) or the last AC of the block. Leaves anything else,
+ * like codes too long for the lookup, to readComponentElement() as well.
+ * Returns 0 on success and 1 if the end of the scan was reached
+ */
+int skipCoefficients(scanWorker *scanner, mcu *mcuData, dhtTrie *acTable,
+                     unsigned char onlyPlain) {
+    const dhtLookupEntry *entry;
+    while ((entry = probeLookup(scanner, acTable, 1)) != NULL) {
+        unsigned char acsRead = mcuData->acCurrentlyOn;
+        unsigned char bits = 0;
+        unsigned char taken = takeLookupAcs(entry, onlyPlain, &acsRead, &bits,
+                                            NULL);
+        if (taken == 0) {
+            return 0;
+        }
+        if (entry->values[taken - 1] == EOB) {
+            mcuData->bit = EOB_ENCOUNTERED;
+            mcuData->bitLength = 0;
+        }
+        if (skipBits(scanner, bits)) {
+            return 1;
+        }
+        mcuData->acCurrentlyOn = acsRead;
+        if (acsRead == MAX_AC_COEFFICIENTS || taken < entry->count) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
 /**
  * Checks to see that stats->restartInterval MCUs have been read and, if so,
  * reads past the restart interval and any useless bits in between the
@@ -219,7 +466,7 @@ int skipPastRestartInterval(scanWorker *scanner, jpegStats *stats) {
                     scanner->scanBuffer[scanner->bytesRead + 2] );
             assert(scanner->scanBuffer[scanner->bytesRead] == 0xFF);
             unsigned char p2 = scanner->scanBuffer[scanner->bytesRead + 1];
-            assert(p2 >= 0xD0 && p2 <= 0xD7);
+            assert(p2 >= RST_MARKER_0 && p2 <= RST_MARKER_7);
         #endif
         scanner->bytesRead += 2;
     }
@@ -227,72 +474,121 @@ int skipPastRestartInterval(scanWorker *scanner, jpegStats *stats) {
 }
 
 /**
- * Using jpegStats and scanner, read current MCU, populating the two tables
- * of mcuData. Returns 0 upon success and 1 otherwise. mcuData is populated with
- * the current AC coeficient we are currently on, regardless of writeability
- * 
- * Increments mcus read by 1
- * 
- * Assumes restart interval >= 2
+ * Moves scanner past the next symbol of table and its value bits without
+ * recording where they are, storing the symbol in *value. A symbol whose
+ * code fits in the lookup takes a single jump of the cursor.
+ * Returns 0 upon success and 1 otherwise
  */
-int loadNextMCU(mcu* mcuData, scanWorker* scanner, jpegStats* stats) {
-    scanner->mcusRead++;  // increment number of mcus processed
-    if (skipPastRestartInterval(scanner, stats)) {
-        return 1;
+int skipSymbol(scanWorker *scanner, dhtTrie *table, unsigned char isAc,
+               unsigned char *value) {
+    const dhtLookupEntry *entry = probeLookup(scanner, table, isAc);
+    if (entry != NULL && entry->count != 0) {
+        *value = entry->values[0];
+        return skipBits(scanner, entry->ends[0]);
+    }
+    while (isEmpty(table)) {
+        char bit = nextBit(scanner);
+        if (bit == END_OF_FILE_ENCOUNTERED)
+            return 1;
+        table = traverseTrie(table, bit);
+        if (table == NULL) {
+            puts("ERROR: NULL TABLE");
+            return 1;
+        }
     }
-    scanner->onSecondChrominance = 0;
+    *value = getValue(table);
+    return skipBits(scanner, isAc ? GET_FIRST_4_BITS(*value) : *value);
+}
 
-    // Skip past Y-components
-    int colorId = Y_ID - 1;
-    dhtTrie *dcTable = stats->dcHuffmanTables[colorId];
-    dhtTrie *acTable = stats->acHuffmanTables[colorId];
-    mcu mcuBuffer; // stores useless data
-    for (int comp = 0; comp < stats->colorCounts[colorId]; comp++) {
-         mcuBuffer.acCurrentlyOn = 0;  // misuesed for first part for checking if DC 
-                                       // read 1 coeficinet
-        // Read DC and store into mcuData
-        if (readComponentElement(scanner, &mcuBuffer,dcTable, 0)) {
+/**
+ * Reads past the whole block of color index colorIndex that scanner points
+ * to, as for blocks of channels not in the channel mask. Only where the block
+ * ends matters, so no coeficient is recorded and each symbol (or several
+ * short ones at once) is a single jump of the cursor.
+ * Returns 0 upon success and 1 otherwise
+ */
+int skipBlock(scanWorker *scanner, jpegStats *stats, int colorIndex) {
+    dhtTrie *dcTable = stats->dcHuffmanTables[colorIndex];
+    dhtTrie *acTable = stats->acHuffmanTables[colorIndex];
+    unsigned char value;
+    if (skipSymbol(scanner, dcTable, 0, &value)) {
+        if (!isEndOfScan(scanner, scanner->bytesRead)) {
+            printf("ERROR1 reading DC of MCU: %llu colorId: %d block: %d\n",
+                scanner->mcusRead, colorIndex, scanner->block);
+        }
+        return 1;
+    }
+    mcu mcuBuffer; // only acCurrentlyOn is used
+    mcuBuffer.acCurrentlyOn = 0;
+    // Skim past ACs of block
+    while (mcuBuffer.acCurrentlyOn < MAX_AC_COEFFICIENTS) {
+        // Skip ACs until EOB observed or max number of ACs read, as many at
+        // once as the lookup allows
+        int result = skipCoefficients(scanner, &mcuBuffer, acTable, 0);
+        if (!result && mcuBuffer.acCurrentlyOn < MAX_AC_COEFFICIENTS) {
+            result = skipSymbol(scanner, acTable, 1, &value);
+            if (!result && value == EOB) {
+                break;
+            }
+            mcuBuffer.acCurrentlyOn += value == ZRL ? 16 :
+                                       GET_4_MSBs(value) + 1;
+        }
+        if (result || mcuBuffer.acCurrentlyOn > MAX_AC_COEFFICIENTS) {
             if (!isEndOfScan(scanner, scanner->bytesRead)) {
-                printf("ERROR1 reading DC of MCU: %d colorId: %d comp: %d\n",
-                    scanner->mcusRead, colorId, comp);
+                printf("ERROR2 reading AC of MCU: %llu colorId: %d block: %d | coeficients read: %d\n",
+                scanner->mcusRead, colorIndex, scanner->block,
+                mcuBuffer.acCurrentlyOn);
             }
             return 1;
         }
-        #ifdef TESTING
-            assert(mcuBuffer.acCurrentlyOn == 1);
-        #endif
-        mcuBuffer.acCurrentlyOn = 0; // corect mstake with acCurrentlyOn
-        // Skim past ACs of MCU[comp]
-        while (mcuBuffer.acCurrentlyOn < MAX_AC_COEFFICIENTS) {
-            // Read component elements until EOB observed or max number of
-            // ACs read
-            if (readComponentElement(scanner, &mcuBuffer, acTable, 1) ||  
-                mcuBuffer.acCurrentlyOn > MAX_AC_COEFFICIENTS) {
-                if (!isEndOfScan(scanner, scanner->bytesRead)) {
-                    printf("ERROR2 reading AC of MCU: %d colorId: %d comp: %d | coeficients read: %d\n",
-                    scanner->mcusRead, colorId, comp, mcuBuffer.acCurrentlyOn);
-                }
-                return 1;
-            }
-            if (mcuBuffer.bit == EOB_ENCOUNTERED) {
-                #ifdef TESTING
-                    assert(mcuBuffer.acCurrentlyOn == MAX_AC_COEFFICIENTS);
-                #endif
-                break;
-            }
+    }
+    return 0;
+}
+
+/**
+ * Returns the color index (color ID - 1) of the given block of an MCU, whose
+ * blocks are those of Y, then Cb, then Cr
+ */
+int blockColorIndex(jpegStats *stats, unsigned char block) {
+    int colorIndex = 0;
+    while (colorIndex < CR_ID - 1 && block >= stats->colorCounts[colorIndex]) {
+        block -= stats->colorCounts[colorIndex];
+        colorIndex++;
+    }
+    return colorIndex;
+}
+
+int loadNextMCU(mcu* mcuData, scanWorker* scanner, jpegStats* stats);
+
+/**
+ * Reads past the blocks of the current MCU, starting at scanner->block, whose
+ * channels are not in the channel mask, then reads the DC and first AC of the
+ * next one, storing the AC in mcuData. If no blocks of the MCU are left,
+ * moves on to the next MCU. Returns 0 upon success and 1 otherwise
+ */
+int enterNextBlock(mcu* mcuData, scanWorker* scanner, jpegStats* stats) {
+    int colorIndex = blockColorIndex(stats, scanner->block);
+    while (!(channelMask & CHANNEL_BIT(colorIndex))) {
+        if (skipBlock(scanner, stats, colorIndex)) {
+            return 1;
+        }
+        scanner->block++;
+        if (scanner->block == stats->totalColorCounts) {
+            return loadNextMCU(mcuData, scanner, stats);
         }
+        colorIndex = blockColorIndex(stats, scanner->block);
     }
+    scanner->colorIndex = colorIndex;
 
-    // Read past DC of CB and move onto First AC
-    // TODO: make this a process DC function
-    colorId = CB_ID - 1;
-    dcTable = stats->dcHuffmanTables[colorId];
-    acTable = stats->acHuffmanTables[colorId];
+    // Read past DC of block and move onto First AC
+    dhtTrie *dcTable = stats->dcHuffmanTables[colorIndex];
+    dhtTrie *acTable = stats->acHuffmanTables[colorIndex];
+    mcu mcuBuffer; // stores useless data
     mcuBuffer.acCurrentlyOn = 0;  // So that logic of assert works
     if (readComponentElement(scanner, &mcuBuffer, dcTable, 0)) {
         if (!isEndOfScan(scanner, scanner->bytesRead)) {
-            printf("ERROR3 reading DC of MCU: %d colorId: %d comp: %d\n",
-                scanner->mcusRead, colorId, stats->colorCounts[colorId]);
+            printf("ERROR3 reading DC of MCU: %llu colorId: %d block: %d\n",
+                scanner->mcusRead, colorIndex, scanner->block);
         }
         return 1;
     }
@@ -304,60 +600,93 @@ int loadNextMCU(mcu* mcuData, scanWorker* scanner, jpegStats* stats) {
     mcuData->bit = 0;
     mcuData->bitLength = 0;
     mcuData->index = 0;
-    // Process first AC data of MCU scanner points to and store in mcuData
+    // Process first AC data of block scanner points to and store in mcuData
     if (readComponentElement(scanner, mcuData, acTable, 1) ||
         mcuData->acCurrentlyOn > MAX_AC_COEFFICIENTS || // rest check sanity
         (mcuData->acCurrentlyOn == MAX_AC_COEFFICIENTS &&
         mcuData->bit != EOB_ENCOUNTERED) ||
         (mcuData->bit == ZRL_ENCOUNTERED && mcuData->acCurrentlyOn != 16)) {
         if (!isEndOfScan(scanner, scanner->bytesRead)) {
-            printf("ERROR4 reading AC of MCU: %d colorId: %d comp: %d | coeficients read: %d\n",
-                scanner->mcusRead, colorId, stats->colorCounts[colorId],
+            printf("ERROR4 reading AC of MCU: %llu colorId: %d block: %d | coeficients read: %d\n",
+                scanner->mcusRead, colorIndex, scanner->block,
                 mcuData->acCurrentlyOn);
             }
         return 1;
-    } 
+    }
 
     return 0;
 }
 
 /**
- * Frees memory allocated to a scanWorker struct
+ * Using jpegStats and scanner, read current MCU up to the first AC of its
+ * first block in the channel mask, storing that AC in mcuData. Returns 0 upon
+ * success and 1 otherwise. mcuData is populated with the current AC
+ * coeficient we are currently on, regardless of writeability
+ * 
+ * Increments mcus read by 1
+ * 
+ * Assumes restart interval >= 2
+ */
+int loadNextMCU(mcu* mcuData, scanWorker* scanner, jpegStats* stats) {
+    scanner->mcusRead++;  // increment number of mcus processed
+    if (skipPastRestartInterval(scanner, stats)) {
+        return 1;
+    }
+    scanner->block = 0;
+    return enterNextBlock(mcuData, scanner, stats);
+}
+
+/**
+ * Frees memory allocated to a scanWorker struct, giving its space back to its
+ * arena so the next scanWorker of the thread can reuse it
  */
 void destroyScanWorker(scanWorker *scanner) {
     if (scanner == NULL)
         return;
-    destroyMCU(scanner->mcu);
-    if (scanner->scanBuffer != NULL)
-        free(scanner->scanBuffer);
-    free(scanner);
+    destroySlotIndex(scanner->written);
+    if (scanner->source != NULL)
+        fseek(scanner->source, scanner->sourceStart, SEEK_SET);
+    // Latest allocation first, as arenaRelease() requires
+    arenaRelease(scanner->memory, scanner->scanBuffer);
+    arenaRelease(scanner->memory, scanner);
 }
 
 /**
- * Initialises a scanWorker for probessing a jpeg file using information form 
- * jpegStats to populate data and returns pointer to created scanWorker.
- * Returns NULL if initScanWorker failes
- * 
- * As part of initialization, scanWorker's mcu points to the first AC coeficient
- * of the first CB of the first MCU of the JPG referenced by file
- * 
- * scanner->totalSize is guaranteed to be the length of the part of file not yet
- * read after execution
- * 
- * 
- * After execution, file's cursor is where it was before function call
- * 
- * 
+ * Returns 1 if the last 2 bytes of file (fileLength bytes long) are an EOI
+ * marker and 0 otherwise, without moving file's cursor
  */
-scanWorker* initScanWorker(FILE* file, jpegStats* stats, long fileLength) {
-    #ifdef TESTING
-        assert(file != NULL && stats != NULL);
-    #endif
-    scanWorker* scanner = calloc(1, sizeof(scanWorker)); // calloc since most
-                                                         // values start at 0
+int endsWithEOI(FILE *file, long fileLength) {
+    long cursor = ftell(file);
+    unsigned char end[MARKER_LENGTH];
+    int result = fseek(file, fileLength - MARKER_LENGTH, SEEK_SET) == 0 &&
+                 fread(end, 1, MARKER_LENGTH, file) == MARKER_LENGTH &&
+                 (end[0] << 8 | end[1]) == JPEG_END;
+    fseek(file, cursor, SEEK_SET);
+    return result;
+}
+
+/**
+ * Creates a scanWorker holding the bytes of file from its cursor onwards
+ * (fileLength bytes long in total) without decoding any of it. Returns NULL
+ * on failiure.
+ *
+ * If window is non-zero and the scan is longer than window bytes, only the
+ * first window bytes are read and the rest is streamed in by nextBit().
+ *
+ * After execution, file's cursor is where it was before function call unless
+ * streaming, in which case it is restored by destroyScanWorker()
+ */
+scanWorker* loadScanBuffer(FILE* file, long fileLength,
+                           unsigned long window) {
+    arena *memory = threadArena();
+    scanWorker* scanner = memory == NULL ? NULL :
+        arenaCalloc(memory, sizeof(scanWorker)); // calloc since most
+                                                 // values start at 0
     if (scanner == NULL) {
+        puts("ERROR allocating scan worker");
         return NULL;
     }
+    scanner->memory = memory;
     #ifdef TESTING
         // Sanity check on calloc
         assert(scanner->scanBuffer == NULL);
@@ -365,41 +694,72 @@ scanWorker* initScanWorker(FILE* file, jpegStats* stats, long fileLength) {
         assert(scanner->bytesRead == 0);
         assert(scanner->bitCursor == 0);
         assert(scanner->mcu == NULL);
-        assert(scanner->onSecondChrominance == 0);
+        assert(scanner->block == 0);
     #endif
 
-    // Create byte buffer for image data after SOS and perform sanity checks
+    // Check that scan has EOI at end, as expected
     long bytesRead = ftell(file);
     long bytesUnread = fileLength - bytesRead;
-    scanner->scanBuffer = calloc(1, bytesUnread); // TODO: make 2x when working with FE bytes
-    size_t bufferSize = fread(scanner->scanBuffer, 1, bytesUnread, file);
+    if (bytesUnread < MARKER_LENGTH || !endsWithEOI(file, fileLength)) {
+        puts("ERROR: UNEXPECTED value for last 2 bytes");
+        destroyScanWorker(scanner);
+        return NULL;
+    }
+
+    // Create byte buffer for image data after SOS and perform sanity checks
+    unsigned long bufferSize = bytesUnread;
+    if (window != 0 && bytesUnread > window) {
+        bufferSize = window;
+        scanner->source = file;
+        scanner->sourceStart = bytesRead;
+        scanner->sourceLeft = bytesUnread - window;
+    }
+    scanner->scanBuffer = arenaAlloc(memory, bufferSize);
+    if (scanner->scanBuffer == NULL) {
+        printf("ERROR allocating space of size %lu\n", bufferSize);
+        destroyScanWorker(scanner);
+        return NULL;
+    }
+    scanner->bufferCapacity = bufferSize;
+    size_t bufferRead = fread(scanner->scanBuffer, 1, bufferSize, file);
     #ifdef TESTING
         printf("BYTES READ: %ld bytes\n", bytesRead);
         printf("BYTES UNREAD: %ld bytes\n", bytesUnread);
     #endif
     // Check that enough data was allocated
-    if (bufferSize != bytesUnread) {
-        printf("ERROR: Expected %ld bytes read, got %ld instead\n", 
-                bytesUnread, bufferSize);
+    if (bufferRead != bufferSize) {
+        printf("ERROR: Expected %lu bytes read, got %zu instead\n",
+                bufferSize, bufferRead);
+        scanner->source = NULL;
+        fseek(file, bytesRead, SEEK_SET);
         destroyScanWorker(scanner);
         return NULL;
     }
-    fseek(file, -bytesUnread, SEEK_CUR);  // set file cursor back for rewriting
+    if (scanner->source == NULL) {
+        fseek(file, bytesRead, SEEK_SET);  // set file cursor back for rewriting
+    }
     scanner->totalSize = bufferSize;
+    scanner->loadedSize = bufferSize;
+    return scanner;
+}
 
-    // Check that buffer has EOI at end, as expected
-    // Note that above makes sure that bufferSize is not larger than size of
-    // remaining bytes of file
-    if (!isEndOfScan(scanner, bufferSize-2)) {
-        puts("ERROR: UNEXPECTED value for last 2 bytes");
-        destroyScanWorker(scanner);
+/**
+ * Same as initScanWorker() but streams any scan longer than window bytes
+ * (see loadScanBuffer())
+ */
+static scanWorker* initScanWindow(FILE* file, jpegStats* stats,
+                                  long fileLength, unsigned long window) {
+    #ifdef TESTING
+        assert(file != NULL && stats != NULL);
+    #endif
+    scanWorker *scanner = loadScanBuffer(file, fileLength, window);
+    if (scanner == NULL) {
         return NULL;
     }
 
     // Process first MCU of jpg and store pointers to first AC
-    scanner->mcu = initMCU(stats);
-    if (scanner->mcu == NULL || loadNextMCU(scanner->mcu, scanner, stats)) {
-        destroyMCU(scanner->mcu);
+    scanner->mcu = &scanner->mcuData;
+    if (loadNextMCU(scanner->mcu, scanner, stats)) {
         destroyScanWorker(scanner);
         return NULL;
     }
@@ -411,14 +771,33 @@ scanWorker* initScanWorker(FILE* file, jpegStats* stats, long fileLength) {
     return scanner;
 }
 
+/**
+ * Initialises a scanWorker for probessing a jpeg file using information form 
+ * jpegStats to populate data and returns pointer to created scanWorker.
+ * Returns NULL if initScanWorker failes
+ * 
+ * As part of initialization, scanWorker's mcu points to the first AC coeficient
+ * of the first CB of the first MCU of the JPG referenced by file
+ * 
+ * scanner->totalSize is guaranteed to be the length of the part of file not yet
+ * read after execution, unless the scan is streamed (see isStreamedScan())
+ * 
+ * 
+ * After execution, file's cursor is where it was before function call
+ * 
+ * 
+ */
+scanWorker* initScanWorker(FILE* file, jpegStats* stats, long fileLength) {
+    return initScanWindow(file, stats, fileLength,
+                          isStreamedScan(file, fileLength) ?
+                          SCAN_WINDOW_SIZE : 0);
+}
+
 /**
  * Returns 1 if algorithm cannot work with AC currently referenced by mcu and
  * 0 otherwise
  */
 int mcuNotPropper(scanWorker *sw, mcu *mcu, jpegStats *stats) {
-    #ifdef TESTING
-        assert(sw->onSecondChrominance == 0 || sw->onSecondChrominance == 1);
-    #endif
     // 1. MCU DC value does not have an EOB/ZRL value and not in range [-1, 1]
     // and not [-3,-2, 2, 3]
     if (mcu->bit == EOB_ENCOUNTERED || mcu->bit == ZRL_ENCOUNTERED ||
@@ -436,21 +815,12 @@ int mcuNotPropper(scanWorker *sw, mcu *mcu, jpegStats *stats) {
    return 0;
 }
 
-/**
- * Given jpegStats scanWorker sw, returns CB_ID - 1 iff coefficient we plan to 
- * read or write from/to is Cb, else return CR_ID-1 if coeficient we plan
- * to do this to is Cr
- * 
- * Assumes in
- */
-#define GET_COLOR_INDEX(sw) (CB_ID - 1 + sw->onSecondChrominance)
-
 /**
  * Updates parameters of sw so that 
- *    sw->mcu points to last bit of (Color) AC value right after current one
+ *    sw->mcu points to last bit of AC value right after current one
  *        or indicates that next AC does not have a bit (is "EOB" or ZRL)
- *    sw->onSecondChrominance is updated if current Chrominance value fully
- *        read
+ *    sw->block moves on to the next block in the channel mask once the
+ *        current one is fully read, and on to the next MCU after the last
  *    sw->mcu->acCurrentlyOn is propperly incremented or set to 0 when 
  *        appropriate
  * 
@@ -459,55 +829,87 @@ int mcuNotPropper(scanWorker *sw, mcu *mcu, jpegStats *stats) {
  */
 int advanceMCUPointer(scanWorker *sw, jpegStats *stats) {
     if (sw->mcu->acCurrentlyOn == MAX_AC_COEFFICIENTS) {
-        // Move onto next MCU if at last chrominance
-        if (sw->onSecondChrominance) {
-            sw->onSecondChrominance = 0;
+        // Move onto next block, or next MCU if at last block
+        sw->block++;
+        if (sw->block == stats->totalColorCounts) {
             return loadNextMCU(sw->mcu, sw, stats);
-            
-        } else {
-            // Prepare to read first AC of second (CR) color component
-            sw->onSecondChrominance = 1;
-            // Get past DC of second color
-            int colorIndex = GET_COLOR_INDEX(sw);
-            dhtTrie *dcTable = stats->dcHuffmanTables[colorIndex];
-            readComponentElement(sw, sw->mcu, dcTable, 0);
-            // Clear data read by readComponentElement
-            sw->mcu->bit = 0;
-            sw->mcu->index = 0;
-            sw->mcu->acCurrentlyOn = 0;
-            sw->mcu->bitLength = 0;
-        }
-    }
-
-    // If not moveing to next MCU, read AC of this MCU using right data
-    int colorIndex = GET_COLOR_INDEX(sw);
-    dhtTrie *acTable = stats->acHuffmanTables[colorIndex];
+        }
+        return enterNextBlock(sw->mcu, sw, stats);
+    }
+
+    // If not moveing to next block, read AC of this block using right data,
+    // going straight past ACs that cannot hold bits
+    dhtTrie *acTable = stats->acHuffmanTables[sw->colorIndex];
+    skipCoefficients(sw, sw->mcu, acTable, 1);
     readComponentElement(sw, sw->mcu, acTable, 1);
     return 0;
 }
 
 /**
- * Code for increasing the size of the buffer if program just converted a byte
- * in sw->scanBuffer to 0xFF, the one referenced by mcu.
+ * Inserts a 00 stuff-byte right after sw->scanBuffer[index], which was just
+ * turned into 0xFF. Returns 0 on success and 1 otherwise
  */
-int growScanBuffer(scanWorker *sw, mcu *mcu) {
-    #ifdef TESTING
-        assert(sw->bytesRead < sw->totalSize);
-        assert(sw->scanBuffer[mcu->index] == 0xFF);
-        assert((sw->bytesRead == mcu->index && sw->bitCursor == 1+mcu->bit) || 
-               (sw->bitCursor == 0 && mcu->bit == 7 && 
-               sw->bytesRead > mcu->index));
-    #endif
+int insertStuffByte(scanWorker *sw, unsigned long index) {
     unsigned long oldSize = sw->totalSize;
+    if (oldSize == sw->bufferCapacity) {
+        unsigned char *grown = arenaRealloc(sw->memory, sw->scanBuffer,
+                                            oldSize, oldSize + SCAN_BUFFER_GROWTH);
+        if (grown == NULL) {
+            puts("ERROR REALLOCATING BUFFER OF SW");
+            return 1;
+        }
+        sw->scanBuffer = grown;
+        sw->bufferCapacity += SCAN_BUFFER_GROWTH;
+    }
     sw->totalSize += 1;
-    sw->scanBuffer = realloc(sw->scanBuffer, sw->totalSize);
-    if (sw->scanBuffer == NULL) {
-        puts("ERROR REALLOCATING BUFFER OF SW");
+    memmove(&sw->scanBuffer[index + 2], &sw->scanBuffer[index + 1], 
+           oldSize - (index+1));
+    sw->scanBuffer[index + 1] = 0;
+    sw->restuffs++;
+    return 0;
+}
+
+/**
+ * Removes the 00 stuff-byte right after sw->scanBuffer[index], which was
+ * just turned from 0xFF into another value. Returns 0 on success and 1
+ * otherwise
+ */
+int removeStuffByte(scanWorker *sw, unsigned long index) {
+    unsigned long oldSize = sw->totalSize;
+    memmove(&sw->scanBuffer[index + 1], &sw->scanBuffer[index + 2], 
+           oldSize - (index+2));
+    sw->totalSize -= 1;
+    sw->restuffs++;
+    return 0;
+}
+
+/**
+ * Records that bytes [from, to) of sw->scanBuffer were changed
+ */
+void noteChange(scanWorker *sw, unsigned long from, unsigned long to) {
+    if (sw->changedTo == 0 || from < sw->changedFrom) {
+        sw->changedFrom = from;
+    }
+    if (to > sw->changedTo) {
+        sw->changedTo = to;
+    }
+}
+
+/**
+ * Code for increasing the size of the buffer if program just converted a byte
+ * in sw->scanBuffer to 0xFF, the one referenced by mcu.
+ */
+int growScanBuffer(scanWorker *sw, mcu *mcu) {
+    #ifdef TESTING
+        assert(sw->bytesRead < sw->totalSize);
+        assert(sw->scanBuffer[mcu->index] == 0xFF);
+        assert((sw->bytesRead == mcu->index && sw->bitCursor == 1+mcu->bit) || 
+               (sw->bitCursor == 0 && mcu->bit == 7 && 
+               sw->bytesRead > mcu->index));
+    #endif
+    if (insertStuffByte(sw, mcu->index)) {
         return 1;
     }
-    memcpy(&sw->scanBuffer[mcu->index + 2], &sw->scanBuffer[mcu->index + 1], 
-           oldSize - (mcu->index+1));
-    sw->scanBuffer[mcu->index + 1] = 0;
 
     if (sw->bytesRead > mcu->index) {
         #ifdef TESTING
@@ -531,13 +933,7 @@ int shrinkScanBuffer(scanWorker *sw, mcu *mcu) {
                (sw->bitCursor == 0 && mcu->bit == 7 && 
                sw->bytesRead > mcu->index));
     #endif
-    unsigned long oldSize = sw->totalSize;
-    memcpy(&sw->scanBuffer[mcu->index + 1], &sw->scanBuffer[mcu->index + 2], 
-           oldSize - (mcu->index+2));
-    sw->totalSize -= 1;
-    sw->scanBuffer = realloc(sw->scanBuffer, sw->totalSize);
-    if (sw->scanBuffer == NULL) {
-        puts("ERROR REALLOCATING BUFFER OF SW");
+    if (removeStuffByte(sw, mcu->index)) {
         return 1;
     }
     // Make sw->bytesRead and bit cursor equal to the bit right after bit 
@@ -571,7 +967,9 @@ void performWrite(scanWorker *sw, mcu *mcu, unsigned char bit) {
     if ((sw->scanBuffer[index] & mask) >> shift != bit) {
         // Actually make a change
         sw->scanBuffer[index] = sw->scanBuffer[index] ^ mask;
+        noteChange(sw, index, index + 1);
         if (sw->scanBuffer[index] == 0xFF) {
+            noteChange(sw, index, index + 2);  // and the stuff-byte after it
             // Grow buffer
             #ifdef TESTING
                 assert(byteBeforeChange != 0xFF);
@@ -611,7 +1009,7 @@ unsigned char performRead(scanWorker *sw, mcu  *mcu) {
  * 
  * Returns 0 on success and 1 on failiure
  * 
- * Assumes sw's metadata (onSecondChrominance and mcu) always 
+ * Assumes sw's metadata (block and mcu) always 
  * reference the latest, unread AC coeficient after each line.
  * 
  */
@@ -620,8 +1018,7 @@ int processBit(scanWorker *sw, jpegStats *stats, unsigned char *bit) {
         printf("BIT VALUE %d\n", *bit);
         assert(*bit == 0 || *bit == 1 || *bit == READ_MESSAGE_CODE_PROCESSOR);
     #endif
-    // Use fact that only use Y,Cr,Cb with only 1 Cr and Cb entry per MCU
-    // Find a decent chrominance value to work with
+    // Find a decent AC value of a channel in the mask to work with
     while (mcuNotPropper(sw, sw->mcu, stats)) {
         if (advanceMCUPointer(sw, stats)) {
             return 1;
@@ -653,20 +1050,118 @@ int processBit(scanWorker *sw, jpegStats *stats, unsigned char *bit) {
  * actual, quantized data).
  */
 long getMaxMessageSize(FILE *file, jpegStats *stats, long fileLength) {
+    return buildSlotIndex(file, stats, fileLength, NULL, NULL);
+}
+
+/**
+ * Sizes checkpoints for the restart intervals of the image described by
+ * stats, leaving it empty if the image has none.
+ * Returns 0 on success and 1 otherwise
+ */
+int initCheckpoints(slotCheckpoints *checkpoints, jpegStats *stats) {
+    checkpoints->count = 0;
+    checkpoints->slots = NULL;
+    if (stats->restartInterval == 0) {
+        return 0;
+    }
+    unsigned long long intervals = (stats->mcuCount +
+                                    stats->restartInterval - 1) /
+                                   stats->restartInterval;
+    checkpoints->stride = (intervals + MAX_CHECKPOINTS - 1) / MAX_CHECKPOINTS;
+    if (checkpoints->stride == 0) {
+        return 0;
+    }
+    checkpoints->count = (intervals + checkpoints->stride - 1) /
+                         checkpoints->stride;
+    checkpoints->slots = calloc(checkpoints->count,
+                                sizeof(unsigned long long));
+    return checkpoints->slots == NULL;
+}
+
+/**
+ * Records counter as the number of slots before every checkpointed restart
+ * interval up to and including interval that has not been recorded yet
+ */
+void recordCheckpoints(slotCheckpoints *checkpoints, unsigned int *recorded,
+                       unsigned long long interval,
+                       unsigned long long counter) {
+    while (*recorded < checkpoints->count &&
+           (unsigned long long)*recorded * checkpoints->stride <= interval) {
+        checkpoints->slots[(*recorded)++] = counter;
+    }
+}
+
+int countSlotsInterleaved(FILE *file, jpegStats *stats, long fileLength,
+                          slotCheckpoints *checkpoints,
+                          unsigned long long *counter);
+
+/**
+ * Finds the slots of the scans of the progressive image file, from its
+ * cursor onwards (see indexProgressiveSlots()), storing their number in
+ * *slots and appending their positions to index unless it is NULL.
+ * Returns 0 on success and 1 otherwise
+ */
+static int countProgressiveSlots(FILE *file, jpegStats *stats,
+                                 long fileLength, slotIndex *index,
+                                 unsigned long long *slots) {
+    scanWorker *sw = loadScanBuffer(file, fileLength, 0);
+    int result = sw == NULL ||
+                 indexProgressiveSlots(sw->scanBuffer, sw->totalSize, stats,
+                                       channelMask, index, slots);
+    destroyScanWorker(sw);
+    return result;
+}
+
+/**
+ * Same as getMaxMessageSize(), but also appends the position of every usable
+ * AC coeficient to index and stores the number of usable coeficients before
+ * restart intervals in checkpoints, unless they are NULL.
+ */
+long buildSlotIndex(FILE *file, jpegStats *stats, long fileLength,
+                    slotIndex *index, slotCheckpoints *checkpoints) {
     #ifdef TESTING
         puts("Reading message from JPEG");
     #endif
+    unsigned long long interleaved;  // slots counted in lanes
+    if (stats->progressive) {
+        // Restart intervals of progressive scans make no checkpoints
+        if (checkpoints != NULL) {
+            checkpoints->count = 0;
+            checkpoints->slots = NULL;
+        }
+        return countProgressiveSlots(file, stats, fileLength, index,
+                                     &interleaved) ? -1 :
+               (long)interleaved / 8 - 1;
+    }
+    if (index == NULL &&
+        !countSlotsInterleaved(file, stats, fileLength, checkpoints,
+                               &interleaved)) {
+        return (long)interleaved / 8 - 1;
+    }
     scanWorker *sw = initScanWorker(file, stats, fileLength);
     if (sw == NULL) {
         return -1;
     }
+    unsigned int recorded = 0;  // checkpoints filled in so far
+    if (checkpoints != NULL && initCheckpoints(checkpoints, stats)) {
+        destroyScanWorker(sw);
+        return -1;
+    }
 
     // Get number of bits that are readable
     long counter = 0;
     while (sw->bytesRead < sw->totalSize) {
+        // Find next usable coeficient so its position is known before reading
+        int result = 0;
+        while (!result && mcuNotPropper(sw, sw->mcu, stats)) {
+            result = advanceMCUPointer(sw, stats);
+        }
+        unsigned long long position = 8*(sw->windowStart + sw->mcu->index) +
+                                      sw->mcu->bit;
+        unsigned long long mcusRead = sw->mcusRead;  // MCU of coeficient
         // Read bit and append to buffer
         unsigned char bitRead = READ_MESSAGE_CODE_PROCESSOR;
-        if (processBit(sw, stats, &bitRead)) {
+        if (result || processBit(sw, stats, &bitRead)) {
             if (isEndOfScan(sw, sw->bytesRead)) {
                 break;
             } else {
@@ -674,130 +1169,1443 @@ long getMaxMessageSize(FILE *file, jpegStats *stats, long fileLength) {
                 return -1;
             }
         }
+        if (index != NULL && appendSlot(index, position)) {
+            destroyScanWorker(sw);
+            return -1;
+        }
+        if (checkpoints != NULL && checkpoints->count != 0) {
+            recordCheckpoints(checkpoints, &recorded,
+                              mcusRead / stats->restartInterval, counter);
+        }
         counter++;
         #ifdef TESTING
             assert(IS_BIT(bitRead));
         #endif
     }
+    if (checkpoints != NULL) {
+        // Intervals after the last usable coeficient start at the very end
+        recordCheckpoints(checkpoints, &recorded, ~0ULL, counter);
+    }
     #ifdef TESTING
-        printf("FINAL ON MCUS READ: %d\n", sw->mcusRead);
-        printf("TOTAL MCUS IN FILE: %d\n", stats->mcuCount);
+        printf("FINAL ON MCUS READ: %llu\n", sw->mcusRead);
+        printf("TOTAL MCUS IN FILE: %llu\n", stats->mcuCount);
     #endif
     destroyScanWorker(sw);
     return counter / 8 - 1;
 }
 
 /**
- * Reads hidden message in SOS of jpeg file file with data stored in stats and
- * of size fileLength bytes. Returns the message on success and returns NULL if
- * a failiure is detected.
+ * Returns the most slots the scan of file, from its cursor to fileLength, can
+ * have: each takes at least 3 of its bits, a Huffman code and 2 value bits
+ */
+static unsigned long long maxScanSlots(FILE *file, long fileLength) {
+    long scanLength = fileLength - ftell(file);
+    return scanLength > 0 ? 8ULL*scanLength / 3 : 0;
+}
+
+/**
+ * Byte source for readPayload() that decodes the scan of sw
+ */
+typedef struct decodingSource {
+    scanWorker *sw;
+    jpegStats *stats;
+} decodingSource;
+
+/**
+ * Reads the next hidden byte of a decodingSource into *byte.
+ * Returns 0 on success and 1 otherwise
+ */
+int nextDecodedByte(void *source, unsigned char *byte) {
+    decodingSource *decoding = source;
+    unsigned char dataBuffer = 0;
+    for (int i = 0; i < 8; i++) {
+        if (decoding->sw->bytesRead >= decoding->sw->totalSize) {
+            return 1;
+        }
+        // Read bit and append to buffer
+        unsigned char bitRead = READ_MESSAGE_CODE_PROCESSOR;
+        if (processBit(decoding->sw, decoding->stats, &bitRead) &&
+            !IS_BIT(bitRead)) {
+            return 1;
+        }
+        #ifdef TESTING
+            assert(IS_BIT(bitRead));
+        #endif
+        dataBuffer = dataBuffer | (bitRead << (7 - i));
+    }
+    #if TESTING
+        printf("DATA READ FROM JPEG FILE: %c\n", dataBuffer);
+    #endif
+    *byte = dataBuffer;
+    return 0;
+}
+
+static unsigned char* readScattered(FILE *file, jpegStats *stats,
+                                    long fileLength, slotIndex *index,
+                                    payloadHeader *header, size_t *length);
+static int sniffScattered(FILE *file, jpegStats *stats, long fileLength,
+                          payloadHeader *header);
+static int writeScattered(FILE *file, jpegStats *stats, long fileLength,
+                          slotIndex *index,
+                          int (*write)(void*, const unsigned char*, size_t),
+                          void *sink, payloadHeader *header,
+                          unsigned long long *length);
+static unsigned char* readProgressive(FILE *file, jpegStats *stats,
+                                      long fileLength, payloadHeader *header,
+                                      size_t *length);
+static int sniffProgressive(FILE *file, jpegStats *stats, long fileLength,
+                            payloadHeader *header);
+static int writeProgressive(FILE *file, jpegStats *stats, long fileLength,
+                            int (*write)(void*, const unsigned char*, size_t),
+                            void *sink, payloadHeader *header,
+                            unsigned long long *length);
+
+/**
+ * Reads hidden payload in SOS of jpeg file file with data stored in stats and
+ * of size fileLength bytes, storing its header in *header and its length in
+ * *length. Returns the payload on success and returns NULL if a failiure is
+ * detected.
  *
  * Assumes that file cursor points to first bit of actual SOS data and that a
  * message was hidden in file
  */
-char* scannerReadMessage(FILE *file, jpegStats *stats, long fileLength) {
+unsigned char* scannerReadMessage(FILE *file, jpegStats *stats,
+                                  long fileLength, payloadHeader *header,
+                                  size_t *length) {
     #ifdef TESTING
         puts("Reading message from JPEG");
     #endif
+    if (scatterKey != NULL) {
+        return readScattered(file, stats, fileLength, NULL, header, length);
+    }
+    if (stats->progressive) {
+        return readProgressive(file, stats, fileLength, header, length);
+    }
+    unsigned long long capacity = maxScanSlots(file, fileLength) / 8;
     scanWorker *sw = initScanWorker(file, stats, fileLength);
     if (sw == NULL) {
         return NULL;
     }
+    decodingSource source = {sw, stats};
+    unsigned char *mssg = readPayload(nextDecodedByte, &source, capacity,
+                                      header, length);
+    #ifdef TESTING
+        printf("FINAL ON MCUS READ: %llu\n", sw->mcusRead);
+        printf("TOTAL MCUS IN FILE: %llu\n", stats->mcuCount);
+    #endif
+    destroyScanWorker(sw);
+    return mssg;
+}
 
-    // Get message
-    size_t bufferSize = 16;
-    size_t counter = 0;
-    char *mssg = malloc(bufferSize);
-    if (mssg == NULL) {
-        destroyScanWorker(sw);
-        return NULL;
+int scannerWriteMessage(FILE *file, jpegStats *stats, long fileLength,
+                        int (*write)(void*, const unsigned char*, size_t),
+                        void *sink, payloadHeader *header,
+                        unsigned long long *length) {
+    if (scatterKey != NULL) {
+        return writeScattered(file, stats, fileLength, NULL, write, sink,
+                              header, length);
     }
-    // Read bytes of hidden message bit by bit
-    while (sw->bytesRead < sw->totalSize) {
-        char dataBuffer = 0;
-        for (int i = 0; i < 8; i++) {
-            // Read bit and append to buffer
-            unsigned char bitRead = READ_MESSAGE_CODE_PROCESSOR;
-            processBit(sw, stats, &bitRead);
-            #ifdef TESTING
-                assert(IS_BIT(bitRead));
-            #endif
-            dataBuffer = dataBuffer | (bitRead << (7 - i));
+    if (stats->progressive) {
+        return writeProgressive(file, stats, fileLength, write, sink, header,
+                                length);
+    }
+    unsigned long long capacity = maxScanSlots(file, fileLength) / 8;
+    scanWorker *sw = initScanWorker(file, stats, fileLength);
+    if (sw == NULL) {
+        return 1;
+    }
+    decodingSource source = {sw, stats};
+    int result = writePayload(nextDecodedByte, &source, capacity, header,
+                              write, sink, length);
+    destroyScanWorker(sw);
+    return result;
+}
+
+int scannerSniffPayload(FILE *file, jpegStats *stats, long fileLength,
+                        payloadHeader *header) {
+    if (scatterKey != NULL) {
+        return sniffScattered(file, stats, fileLength, header);
+    }
+    if (stats->progressive) {
+        return sniffProgressive(file, stats, fileLength, header);
+    }
+    // Only the start of the scan is needed, however long it is
+    scanWorker *sw = initScanWindow(file, stats, fileLength,
+                                    SNIFF_WINDOW_SIZE);
+    if (sw == NULL) {
+        memset(header, 0, sizeof(payloadHeader));
+        return 1;
+    }
+    decodingSource source = {sw, stats};
+    int result = sniffPayloadHeader(nextDecodedByte, &source, header);
+    #ifdef TESTING
+        printf("SNIFFED %llu MCUS OF %llu\n", sw->mcusRead, stats->mcuCount);
+    #endif
+    destroyScanWorker(sw);
+    return result;
+}
+
+/**
+ * Moves sw to the first MCU of restart interval interval, whose restart
+ * marker starts at sw->scanBuffer[marker]. Returns 0 on success and 1
+ * otherwise
+ */
+int enterRestartInterval(scanWorker *sw, jpegStats *stats,
+                         unsigned long long interval, unsigned long marker) {
+    // Let loadNextMCU() step over the marker as if it had just been reached
+    sw->bytesRead = marker;
+    sw->bitCursor = 0;
+    sw->mcusRead = interval*stats->restartInterval - 1;
+    return loadNextMCU(sw->mcu, sw, stats);
+}
+
+/**
+ * Moves sw forward to the first MCU of restart interval interval, which comes
+ * after the interval sw is in, by counting restart markers instead of
+ * decoding the scan up to it. Returns 0 on success and 1 otherwise
+ */
+int seekRestartInterval(scanWorker *sw, jpegStats *stats,
+                        unsigned long long interval) {
+    unsigned long long markers = interval -
+                                 sw->mcusRead / stats->restartInterval;
+    unsigned long index = sw->bytesRead;
+    while (markers != 0) {
+        // Both bytes of a marker must be buffered to recognise it
+        if (index + 1 >= sw->totalSize) {
+            if (sw->sourceLeft == 0) {
+                return 1;
+            }
+            sw->bytesRead = index;
+            if (slideScanWindow(sw)) {
+                return 1;
+            }
+            index = sw->bytesRead;
+            continue;
         }
-        #if TESTING
-            printf("DATA READ FROM JPEG FILE: %c\n", dataBuffer);
-        #endif
-        mssg[counter] = dataBuffer;
-        if (dataBuffer == 0) {
+        unsigned char *found = memchr(&sw->scanBuffer[index], 0xFF,
+                                      sw->totalSize - 1 - index);
+        if (found == NULL) {
+            index = sw->totalSize - 1;
+            continue;
+        }
+        index = found - sw->scanBuffer;
+        unsigned char marker = sw->scanBuffer[index + 1];
+        if (marker == (JPEG_END & 0xFF)) {
+            return 1;
+        }
+        // Anything but a restart marker is a stuff-byte or fill byte
+        if (marker >= RST_MARKER_0 && marker <= RST_MARKER_7 &&
+            --markers == 0) {
             break;
         }
-        // Increment counter and double bufferSize if need be
-        counter++;
-        if (counter == bufferSize) {
-            bufferSize = 2*bufferSize;
-            mssg = realloc(mssg, bufferSize);
-            if (mssg == NULL) {
-                destroyScanWorker(sw);
-                return NULL;
+        index++;
+    }
+
+    return enterRestartInterval(sw, stats, interval, index);
+}
+
+/**
+ * Counts the usable coeficients of sw from its current one up to the end of
+ * MCU lastMCU or the end of the scan, storing their number in *slots.
+ * Returns 0 on success and 1 otherwise
+ */
+int countSlots(scanWorker *sw, jpegStats *stats, unsigned long long lastMCU,
+               unsigned long long *slots) {
+    *slots = 0;
+    while (sw->bytesRead < sw->totalSize) {
+        int result = 0;
+        while (!result && mcuNotPropper(sw, sw->mcu, stats)) {
+            result = advanceMCUPointer(sw, stats);
+        }
+        if (!result && sw->mcusRead > lastMCU) {
+            break;  // coeficient belongs to a later MCU
+        }
+        unsigned char bitRead = READ_MESSAGE_CODE_PROCESSOR;
+        if (result || processBit(sw, stats, &bitRead)) {
+            return !isEndOfScan(sw, sw->bytesRead);
+        }
+        (*slots)++;
+    }
+    return 0;
+}
+
+/**
+ * Restart intervals of a scan whose slots are counted by runBatch() jobs
+ */
+typedef struct intervalJobs {
+    const unsigned char *scan;
+    const unsigned long *starts;  // byte each interval begins at
+    size_t intervals;             // intervals to count
+    size_t jobCount;
+    jpegStats *stats;
+    unsigned long long *slots;    // slots of each interval
+} intervalJobs;
+
+/**
+ * runBatch() job: counts the slots of the i-th of jobCount equal runs of
+ * intervals, LANE_COUNT intervals at a time
+ */
+static int intervalJob(size_t i, void *context) {
+    intervalJobs *jobs = context;
+    return countIntervalSlots(jobs->scan, jobs->starts,
+                              i*jobs->intervals / jobs->jobCount,
+                              (i + 1)*jobs->intervals / jobs->jobCount,
+                              jobs->stats, channelMask, jobs->slots);
+}
+
+/**
+ * Stores in starts the byte of sw's scan at which each of its first count
+ * restart intervals begins. Returns 0 on success and 1 if markers are missing
+ */
+int findIntervalStarts(scanWorker *sw, unsigned long *starts, size_t count) {
+    starts[0] = 0;
+    unsigned long index = 0;
+    for (size_t i = 1; i < count; i++) {
+        unsigned char marker = 0;
+        while (marker < RST_MARKER_0 || marker > RST_MARKER_7) {
+            unsigned char *found = index + 1 >= sw->totalSize ? NULL :
+                                   memchr(&sw->scanBuffer[index], 0xFF,
+                                          sw->totalSize - 1 - index);
+            if (found == NULL) {
+                return 1;
+            }
+            index = found - sw->scanBuffer + 1;
+            marker = sw->scanBuffer[index];
+            // Anything but a restart marker is a stuff-byte or fill byte
+            if (marker == (JPEG_END & 0xFF)) {
+                return 1;
             }
         }
+        starts[i] = index + 1;
     }
-    #ifdef TESTING
-        printf("FINAL ON MCUS READ: %d\n", sw->mcusRead);
-        printf("TOTAL MCUS IN FILE: %d\n", stats->mcuCount);
-    #endif
+    return 0;
+}
+
+/**
+ * Counts the slots of the scan at file's cursor like buildSlotIndex() does
+ * without an index, storing their number in *counter and filling
+ * checkpoints (unless NULL), but decodes every restart interval but the last
+ * in lanes (see countIntervalSlots()), spread over decodeThreads threads. The
+ * last one is decoded as usual, as how the scan ends decides whether its
+ * last slot counts. File's cursor is left unchanged.
+ * Returns 0 on success and 1 if this cannot be done, in which case the scan
+ * should be decoded as usual
+ */
+int countSlotsInterleaved(FILE *file, jpegStats *stats, long fileLength,
+                          slotCheckpoints *checkpoints,
+                          unsigned long long *counter) {
+    // Lanes need the whole scan and loadNextMCU() assumes intervals of 2+
+    if (stats->restartInterval < 2 || isStreamedScan(file, fileLength)) {
+        return 1;
+    }
+    size_t intervals = (stats->mcuCount + stats->restartInterval - 1) /
+                       stats->restartInterval;
+    if (intervals < 2) {
+        return 1;
+    }
+    scanWorker *sw = loadScanBuffer(file, fileLength, 0);
+    if (sw == NULL) {
+        return 1;
+    }
+    unsigned long *starts = malloc(intervals * sizeof(unsigned long));
+    unsigned long long *slots = malloc((intervals - 1) *
+                                       sizeof(unsigned long long));
+    intervalJobs jobs = {sw->scanBuffer, starts, intervals - 1, 1, stats,
+                         slots};
+    int result = starts == NULL || slots == NULL ||
+                 findIntervalStarts(sw, starts, intervals);
+    if (!result && decodeThreads > 1) {
+        // A few jobs per thread evens out intervals of different sizes
+        jobs.jobCount = 4 * decodeThreads;
+        if (jobs.jobCount > jobs.intervals / LANE_COUNT) {
+            jobs.jobCount = jobs.intervals / LANE_COUNT + 1;
+        }
+        result = runBatch(jobs.jobCount, decodeThreads, intervalJob, &jobs);
+    } else if (!result) {
+        result = intervalJob(0, &jobs);
+    }
+    unsigned long long tail = 0;  // slots counted in the last interval
+    if (!result) {
+        sw->mcu = &sw->mcuData;
+        result = enterRestartInterval(sw, stats, intervals - 1,
+                                      starts[intervals - 1] - MARKER_LENGTH) ||
+                 countSlots(sw, stats, ~0ULL, &tail);
+    }
+    if (!result && checkpoints != NULL) {
+        result = initCheckpoints(checkpoints, stats);
+    }
+    if (!result) {
+        *counter = 0;
+        unsigned int recorded = 0;
+        for (size_t i = 0; i < intervals - 1; i++) {
+            if (checkpoints != NULL) {
+                recordCheckpoints(checkpoints, &recorded, i, *counter);
+            }
+            *counter += slots[i];
+        }
+        if (checkpoints != NULL) {
+            recordCheckpoints(checkpoints, &recorded, ~0ULL, *counter);
+        }
+        *counter += tail;
+    }
+    free(starts);
+    free(slots);
     destroyScanWorker(sw);
-    return mssg;
+    return result;
 }
 
 /**
- * Writes the content of sw into file jpg at the current cursor, assumed to be
- * the position immediately following SOS segment
- * 
- * Returns 0 iff successful and 1 otherwise
+ * Counts every usable coeficient of the scan of file, from its cursor
+ * onwards, into *slots: in lanes if it has restart markers, by decoding it
+ * otherwise. Returns 0 on success and 1 otherwise
  */
-int modifyFile(FILE* jpg, scanWorker *sw) {
-    size_t bytesWritten = fwrite(sw->scanBuffer, 1, sw->totalSize, jpg);
-    return bytesWritten == sw->totalSize;
+static int countAllSlots(FILE *file, jpegStats *stats, long fileLength,
+                         unsigned long long *slots) {
+    if (stats->progressive) {
+        return countProgressiveSlots(file, stats, fileLength, NULL, slots);
+    }
+    if (!countSlotsInterleaved(file, stats, fileLength, NULL, slots)) {
+        return 0;
+    }
+    scanWorker *sw = initScanWorker(file, stats, fileLength);
+    int result = sw == NULL || countSlots(sw, stats, ~0ULL, slots);
+    destroyScanWorker(sw);
+    return result;
 }
 
 /**
- * Hides a message inside the LSBs of propper AC coeficients of file of size
- * fileLength bytes and data stored in stats
- * 
- * Assuems file points to first byte of scan data and that stats contains data
- * extracted from file
+ * Returns the 97.5th percentile of Student's t-distribution with the given
+ * degrees of freedom (at least 1), which scales a 95% confidence interval
  */
-int scannerHideMessage(FILE *file, jpegStats *stats, char *message, 
-                       long fileLength) {
-    #ifdef TESTING
-        printf("\nHideing message [%s] in JPEG\n", message);
-    #endif
+double tQuantile(unsigned int freedom) {
+    static const double quantiles[] = {12.706, 4.303, 3.182, 2.776, 2.571,
+                                       2.447, 2.365, 2.306, 2.262, 2.228};
+    if (freedom <= 10) {
+        return quantiles[freedom - 1];
+    }
+    return freedom < 30 ? 2.045 : 1.96;  // close enough to the exact values
+}
+
+int estimateSlots(FILE *file, jpegStats *stats, long fileLength,
+                  unsigned int samples, slotEstimate *estimate) {
+    memset(estimate, 0, sizeof(slotEstimate));
+    if (stats->progressive) {
+        // Only the AC first scans are decoded, so count them exactly
+        return countProgressiveSlots(file, stats, fileLength, NULL,
+                                     &estimate->slots);
+    }
     scanWorker *sw = initScanWorker(file, stats, fileLength);
     if (sw == NULL) {
         return 1;
     }
+    unsigned long long interval = stats->restartInterval;
+    if (interval == 0) {
+        // Without restart markers decoding cannot start mid-scan
+        int result = countSlots(sw, stats, ~0ULL, &estimate->slots);
+        destroyScanWorker(sw);
+        return result;
+    }
+    estimate->intervals = (stats->mcuCount + interval - 1) / interval;
+    if (samples < 2) {
+        samples = 2;  // the spread of densities needs two of them
+    }
+    if (samples > estimate->intervals) {
+        samples = estimate->intervals;
+    }
 
-    // Hide message
-    size_t mssgSize = strlen(message)+1;
-    for (size_t i = 0; i < mssgSize; i++) {
-        for(unsigned char j = 0; j < 8; j++) {
-            unsigned char shift = 7 - j;
-            unsigned char bit = (message[i] & (1 << shift)) >> shift;
-            #ifdef TESTING
-                assert(bit == 0 || bit == 1);
-            #endif
-            if (processBit(sw, stats, &bit)) {
-                destroyScanWorker(sw);
-                return 1;
-            }
+    // Sample intervals at the middle of samples equal parts of the scan
+    double sum = 0, squares = 0;
+    int result = 0;
+    for (unsigned int i = 0; !result && i < samples; i++) {
+        unsigned long long target = (2ULL*i + 1) * estimate->intervals /
+                                    (2ULL*samples);
+        // Counting the previous interval may have stopped at this one
+        if (sw->mcusRead / interval < target) {
+            result = seekRestartInterval(sw, stats, target);
         }
+        unsigned long long first = target*interval;
+        unsigned long long last = first + interval - 1;
+        if (last >= stats->mcuCount) {
+            last = stats->mcuCount - 1;
+        }
+        unsigned long long slots;
+        result = result || countSlots(sw, stats, last, &slots);
+        double density = (double)slots / (last - first + 1);
+        sum += density;
+        squares += density*density;
+        estimate->sampled++;
     }
-    int result = modifyFile(file, sw);
-    #ifdef TESTING
-        printf("FINAL ON MCUS READ: %d\n", sw->mcusRead);
-        printf("TOTAL MCUS IN FILE: %d\n", stats->mcuCount);
-    #endif
     destroyScanWorker(sw);
-    return result;
+    if (result) {
+        return 1;
+    }
+
+    // Treat the evenly spaced intervals as a random sample of them all
+    double mean = sum / samples;
+    // A single sample has no spread, so it gets no margin
+    double variance = 0;
+    double t = 0;
+    if (samples > 1) {
+        variance = (squares - samples*mean*mean) / (samples - 1);
+        t = tQuantile(samples - 1);
+    }
+    double unsampled = 1 - (double)samples / estimate->intervals;
+    double margin = t * sqrt((variance > 0 ? variance : 0) * unsampled /
+                             samples);
+    estimate->slots = llround(mean * stats->mcuCount);
+    estimate->margin = llround(margin * stats->mcuCount);
+    return 0;
+}
+
+/**
+ * Reads bytes [offset, offset + length) of the data of the payload hidden in
+ * the scan of file, clamped to the length of the payload, like
+ * scannerReadMessage(). Uses the payload's checkpoints to start decoding at
+ * the restart interval holding byte offset. Plain messages are read whole
+ * first since their length is only known at their end.
+ */
+unsigned char* scannerReadRange(FILE *file, jpegStats *stats, long fileLength,
+                                unsigned long long offset,
+                                unsigned long long length,
+                                payloadHeader *header, size_t *rangeLength) {
+    if (stats->progressive || scatterKey != NULL) {
+        // Progressive and scattered payloads have no checkpoints to start
+        // decoding from
+        size_t mssgLength;
+        unsigned char *mssg = scannerReadMessage(file, stats, fileLength,
+                                                 header, &mssgLength);
+        return cutRange(mssg, mssgLength, offset, length, rangeLength);
+    }
+    unsigned long long slots = maxScanSlots(file, fileLength);
+    scanWorker *sw = initScanWorker(file, stats, fileLength);
+    if (sw == NULL) {
+        return NULL;
+    }
+    decodingSource source = {sw, stats};
+    slotCheckpoints checkpoints = {0};
+    if (readPayloadHeader(nextDecodedByte, &source, slots / 8, header,
+                          &checkpoints)) {
+        destroyScanWorker(sw);
+        destroyCheckpoints(&checkpoints);
+        if (header->version != 0) {
+            return NULL;  // header is damaged
+        }
+        size_t mssgLength;
+        unsigned char *mssg = scannerReadMessage(file, stats, fileLength,
+                                                 header, &mssgLength);
+        return cutRange(mssg, mssgLength, offset, length, rangeLength);
+    }
+    // Checkpoints come from the image too, so they must fit its scan
+    unsigned long long intervals = stats->restartInterval == 0 ? 0 :
+        (stats->mcuCount + stats->restartInterval - 1) /
+        stats->restartInterval;
+    if (checkCheckpoints(&checkpoints, intervals, slots)) {
+        destroyScanWorker(sw);
+        destroyCheckpoints(&checkpoints);
+        return NULL;
+    }
+    if (offset > header->length) {
+        offset = header->length;
+    }
+    if (length > header->length - offset) {
+        length = header->length - offset;
+    }
+
+    // Jump to the last checkpointed interval starting before the first bit
+    unsigned long long slotsRead = 8ULL*framingLength(header->flags,
+                                                      &checkpoints);
+    unsigned long long target = slotsRead + 8*offset;
+    unsigned int i = 0;
+    while (i + 1 < checkpoints.count && checkpoints.slots[i + 1] <= target) {
+        i++;
+    }
+    int result = 0;
+    if (checkpoints.count != 0 && checkpoints.slots[i] > slotsRead) {
+        result = seekRestartInterval(sw, stats,
+                                     (unsigned long long)i*checkpoints.stride);
+        slotsRead = checkpoints.slots[i];
+    }
+    destroyCheckpoints(&checkpoints);
+    for (; !result && slotsRead < target; slotsRead++) {
+        unsigned char bit = READ_MESSAGE_CODE_PROCESSOR;
+        result = processBit(sw, stats, &bit) && !IS_BIT(bit);
+    }
+
+    unsigned char *range = result ? NULL : malloc(length + 1);
+    for (unsigned long long j = 0; range != NULL && j < length; j++) {
+        if (nextDecodedByte(&source, &range[j])) {
+            free(range);
+            range = NULL;
+        }
+    }
+    // Only a range covering the whole payload can be checked
+    if (range != NULL && (header->flags & PAYLOAD_CHECKSUM) &&
+        length == header->length &&
+        verifyChecksum(header, crc32c(0, range, length))) {
+        free(range);
+        range = NULL;
+    }
+    if (range != NULL) {
+        range[length] = 0;
+        *rangeLength = length;
+    }
+    destroyScanWorker(sw);
+    return range;
+}
+
+/**
+ * Writes the bytes of sw that changed into file jpg, whose current cursor is
+ * assumed to be the position immediately following SOS segment. Only the
+ * changed range is written unless stuff-bytes changed the length of the scan,
+ * which moves every later byte.
+ * 
+ * Returns 0 iff successful and 1 otherwise
+ */
+int modifyFile(FILE* jpg, scanWorker *sw) {
+    if (sw->changedTo == 0) {
+        timerCounter("bytes written", 0);
+        return 0;
+    }
+    unsigned long end = sw->totalSize == sw->loadedSize ? sw->changedTo :
+                        sw->totalSize;
+    unsigned long length = end - sw->changedFrom;
+    timerCounter("bytes written", length);
+    if (fseek(jpg, sw->changedFrom, SEEK_CUR) ||
+        fwrite(&sw->scanBuffer[sw->changedFrom], 1, length, jpg) != length ||
+        fflush(jpg)) {
+        return 1;
+    }
+    // Scan may have shrunk after removing stuff-bytes, so drop stale tail
+    return sw->totalSize < sw->loadedSize &&
+           ftruncate(fileno(jpg), ftell(jpg)) != 0;
+}
+
+/**
+ * Writes what is left of the scan of sw to sw->sink: the bytes still in its
+ * window followed by the part of the scan never read into it, which is copied
+ * unchanged.
+ *
+ * Returns 0 iff successful and 1 otherwise
+ */
+int finishSink(scanWorker *sw) {
+    if (fwrite(sw->scanBuffer, 1, sw->totalSize, sw->sink) != sw->totalSize) {
+        return 1;
+    }
+    unsigned char *chunk = malloc(COPY_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return 1;
+    }
+    while (sw->sourceLeft != 0) {
+        size_t length = sw->sourceLeft < COPY_CHUNK_SIZE ? sw->sourceLeft :
+                        COPY_CHUNK_SIZE;
+        if (fread(chunk, 1, length, sw->source) != length ||
+            fwrite(chunk, 1, length, sw->sink) != length) {
+            free(chunk);
+            return 1;
+        }
+        sw->sourceLeft -= length;
+    }
+    free(chunk);
+    return fflush(sw->sink) != 0;
+}
+
+static hideSession* startSession(FILE *file, FILE *output, jpegStats *stats,
+                                 long fileLength, scanWorker *sw,
+                                 slotIndex *index);
+static int hideWhole(hideSession *hs, const unsigned char *data,
+                     size_t length);
+
+/**
+ * Hides the length bytes of data inside the LSBs of propper AC coeficients of
+ * file of size fileLength bytes and data stored in stats. The modified scan
+ * replaces the original one in file if output is NULL, and is written to
+ * output otherwise.
+ * 
+ * Assuems file points to first byte of scan data and that stats contains data
+ * extracted from file
+ */
+int hideInScan(FILE *file, FILE *output, jpegStats *stats,
+               const unsigned char *data, size_t length, long fileLength) {
+    #ifdef TESTING
+        printf("\nHideing %zu bytes in JPEG\n", length);
+    #endif
+    return hideWhole(scannerHideBegin(file, output, stats, fileLength), data,
+                     length);
+}
+
+int scannerHideMessage(FILE *file, jpegStats *stats,
+                       const unsigned char *data, size_t length,
+                       long fileLength) {
+    return hideInScan(file, NULL, stats, data, length, fileLength);
+}
+
+int scannerHideStreamed(FILE *file, FILE *output, jpegStats *stats,
+                        const unsigned char *data, size_t length,
+                        long fileLength) {
+    return hideInScan(file, output, stats, data, length, fileLength);
+}
+
+void setStreamingThreshold(unsigned long long threshold) {
+    streamingThreshold = threshold;
+}
+
+void setChannelMask(unsigned char mask) {
+    channelMask = mask;
+}
+
+unsigned char getChannelMask() {
+    return channelMask;
+}
+
+void setHideVerification(int verify) {
+    verifyHides = verify;
+}
+
+void setScatterKey(const char *key) {
+    scatterKey = key;
+}
+
+const char* getScatterKey() {
+    return scatterKey;
+}
+
+void setDecodeThreads(int threads) {
+    decodeThreads = threads > 0 ? threads : 1;
+}
+
+int isStreamedScan(FILE *file, long fileLength) {
+    return fileLength - ftell(file) > streamingThreshold &&
+           fileLength - ftell(file) > SCAN_WINDOW_SIZE;
+}
+
+/**
+ * Returns the bit at position (8*byte + bit) of sw->scanBuffer
+ */
+unsigned char readSlotBit(scanWorker *sw, unsigned long long position) {
+    unsigned char shift = 7 - (position & 7);
+    return (sw->scanBuffer[position >> 3] >> shift) & 1;
+}
+
+/**
+ * Byte source for readPayload() that reads the slots of an index from the
+ * undecoded scan of sw
+ */
+typedef struct indexedSource {
+    scanWorker *sw;
+    slotIterator slots;
+} indexedSource;
+
+/**
+ * Reads the next hidden byte of an indexedSource into *byte.
+ * Returns 0 on success and 1 otherwise
+ */
+int nextIndexedByte(void *source, unsigned char *byte) {
+    indexedSource *indexed = source;
+    unsigned char dataBuffer = 0;
+    for (int i = 0; i < 8; i++) {
+        unsigned long long position;
+        if (nextSlot(&indexed->slots, &position) ||
+            position >= 8*indexed->sw->totalSize) {
+            return 1;
+        }
+        dataBuffer = dataBuffer |
+                     (readSlotBit(indexed->sw, position) << (7 - i));
+    }
+    *byte = dataBuffer;
+    return 0;
+}
+
+static scanWorker* loadProgressive(FILE *file, jpegStats *stats,
+                                   long fileLength, slotIndex **index);
+
+/**
+ * Byte source for readPayload() that gathers a payload scattered over the
+ * slots of a scan (see setScatterKey()). Slots can only be read in scan
+ * order, so each call of gatherScattered() is one pass over them: the first
+ * gathers as many bytes as the framing of a payload can take, and the
+ * second the rest of the payload, whose length that framing gives.
+ */
+typedef struct scatteredSource {
+    FILE *file;
+    jpegStats *stats;
+    long fileLength;
+    scanWorker *sw;      // whole scan, if its slots are indexed
+    slotIndex *index;    // slots of sw, NULL to decode file on every pass
+    slotIndex *ownIndex;  // index, if the source made it, NULL otherwise
+    slotScatter scatter;
+    unsigned long long capacity;  // bytes the slots can hold
+    unsigned char *gathered;      // bytes of the payload gathered so far
+    unsigned long long gatheredLength;  // bytes in gathered
+    unsigned long long gatheredRead;    // bytes of gathered read so far
+} scatteredSource;
+
+/**
+ * Points source at the scan of file, which starts at its cursor, taking its
+ * slots from index unless it is NULL. Progressive scans are indexed here,
+ * and the slots of other ones are only counted, which is all the order of
+ * the slots needs. Returns 0 on success and 1 otherwise
+ */
+static int startScatteredSource(scatteredSource *source, FILE *file,
+                                jpegStats *stats, long fileLength,
+                                slotIndex *index) {
+    memset(source, 0, sizeof(scatteredSource));
+    source->file = file;
+    source->stats = stats;
+    source->fileLength = fileLength;
+    source->index = index;
+    unsigned long long slots;
+    if (index != NULL) {
+        source->sw = loadScanBuffer(file, fileLength, 0);
+    } else if (stats->progressive) {
+        source->sw = loadProgressive(file, stats, fileLength,
+                                     &source->ownIndex);
+        source->index = source->ownIndex;
+    } else if (countAllSlots(file, stats, fileLength, &slots)) {
+        return 1;
+    }
+    if (source->index != NULL) {
+        if (source->sw == NULL) {
+            return 1;
+        }
+        slots = source->index->slotCount;
+    }
+    initScatter(&source->scatter, scatterKey, slots);
+    source->capacity = slots / 8;
+    return 0;
+}
+
+static void endScatteredSource(scatteredSource *source) {
+    free(source->gathered);
+    destroySlotIndex(source->ownIndex);
+    destroyScanWorker(source->sw);
+}
+
+/**
+ * Appends the next count bytes of the payload to source->gathered in one
+ * pass over the slots, in scan order, which stops at the last slot holding
+ * one of their bits. Returns 0 on success and 1 otherwise
+ */
+static int gatherScattered(scatteredSource *source, unsigned long long count) {
+    unsigned long long first = 8*source->gatheredLength;  // first bit wanted
+    unsigned char *gathered = realloc(source->gathered,
+                                      source->gatheredLength + count);
+    if (gathered == NULL) {
+        puts("ERROR allocating gathered payload");
+        return 1;
+    }
+    source->gathered = gathered;
+    memset(gathered + source->gatheredLength, 0, count);
+    scanWorker *sw = source->sw;
+    slotIterator slots;
+    if (source->index != NULL) {
+        startSlotIterator(&slots, source->index);
+    } else {
+        sw = initScanWorker(source->file, source->stats, source->fileLength);
+    }
+    int result = sw == NULL;
+    unsigned long long left = 8*count;  // bits wanted not gathered yet
+    for (unsigned long long slot = 0; !result && left != 0; slot++) {
+        unsigned char bitRead = READ_MESSAGE_CODE_PROCESSOR;
+        if (source->index != NULL) {
+            unsigned long long position;
+            result = nextSlot(&slots, &position) ||
+                     position >= 8*sw->totalSize;
+            bitRead = result ? 0 : readSlotBit(sw, position);
+        } else {
+            result = sw->bytesRead >= sw->totalSize ||
+                     (processBit(sw, source->stats, &bitRead) &&
+                      !IS_BIT(bitRead));
+        }
+        // Bits before first wrap around past those wanted
+        unsigned long long bit = gatherBit(&source->scatter, slot) - first;
+        if (!result && bit < 8*count) {
+            gathered[source->gatheredLength + (bit >> 3)] |=
+                bitRead << (7 - (bit & 7));
+            left--;
+        }
+    }
+    if (source->index == NULL) {
+        destroyScanWorker(sw);
+    }
+    if (!result) {
+        source->gatheredLength += count;
+    }
+    return result;
+}
+
+/**
+ * Reads the next hidden byte of a scatteredSource into *byte, gathering
+ * more of the payload first if all gathered bytes were read.
+ * Returns 0 on success and 1 otherwise
+ */
+int nextScatteredByte(void *source, unsigned char *byte) {
+    scatteredSource *scattered = source;
+    if (scattered->gatheredRead == scattered->gatheredLength) {
+        // What is gathered so far holds the framing if there is any
+        unsigned long long wanted = MAX_FRAMING_LENGTH;
+        if (scattered->gatheredLength != 0) {
+            wanted = hiddenLength(scattered->gathered,
+                                  scattered->gatheredLength);
+            wanted = wanted == 0 ? scattered->capacity : wanted;
+        }
+        if (wanted > scattered->capacity) {
+            wanted = scattered->capacity;
+        }
+        if (wanted <= scattered->gatheredLength ||
+            gatherScattered(scattered, wanted - scattered->gatheredLength)) {
+            return 1;
+        }
+    }
+    *byte = scattered->gathered[scattered->gatheredRead++];
+    return 0;
+}
+
+/**
+ * Same as scannerReadMessage() for payloads scattered with a scatter key,
+ * taking the slots from index unless it is NULL
+ */
+static unsigned char* readScattered(FILE *file, jpegStats *stats,
+                                    long fileLength, slotIndex *index,
+                                    payloadHeader *header, size_t *length) {
+    scatteredSource source;
+    unsigned char *mssg =
+        startScatteredSource(&source, file, stats, fileLength, index) ? NULL :
+        readPayload(nextScatteredByte, &source, source.capacity, header,
+                    length);
+    endScatteredSource(&source);
+    return mssg;
+}
+
+/**
+ * Same as scannerSniffPayload() for payloads scattered with a scatter key,
+ * which only takes the first pass over the slots
+ */
+static int sniffScattered(FILE *file, jpegStats *stats, long fileLength,
+                          payloadHeader *header) {
+    scatteredSource source;
+    int result = startScatteredSource(&source, file, stats, fileLength, NULL);
+    if (result) {
+        memset(header, 0, sizeof(payloadHeader));
+    } else {
+        result = sniffPayloadHeader(nextScatteredByte, &source, header);
+    }
+    endScatteredSource(&source);
+    return result;
+}
+
+/**
+ * Same as scannerWriteMessage() for payloads scattered with a scatter key,
+ * taking the slots from index unless it is NULL
+ */
+static int writeScattered(FILE *file, jpegStats *stats, long fileLength,
+                          slotIndex *index,
+                          int (*write)(void*, const unsigned char*, size_t),
+                          void *sink, payloadHeader *header,
+                          unsigned long long *length) {
+    scatteredSource source;
+    int result =
+        startScatteredSource(&source, file, stats, fileLength, index) ||
+        writePayload(nextScatteredByte, &source, source.capacity, header,
+                     write, sink, length);
+    endScatteredSource(&source);
+    return result;
+}
+
+/**
+ * Reads hidden payload like scannerReadMessage(), but takes the positions of
+ * usable coeficients from index instead of decoding the scan.
+ */
+unsigned char* scannerReadIndexed(FILE *file, long fileLength,
+                                  slotIndex *index, payloadHeader *header,
+                                  size_t *length) {
+    if (scatterKey != NULL) {
+        return readScattered(file, NULL, fileLength, index, header, length);
+    }
+    scanWorker *sw = loadScanBuffer(file, fileLength, 0);
+    if (sw == NULL) {
+        return NULL;
+    }
+    indexedSource source;
+    source.sw = sw;
+    startSlotIterator(&source.slots, index);
+    unsigned char *mssg = readPayload(nextIndexedByte, &source,
+                                      index->slotCount / 8, header, length);
+    destroyScanWorker(sw);
+    return mssg;
+}
+
+int scannerWriteIndexed(FILE *file, long fileLength, slotIndex *index,
+                        int (*write)(void*, const unsigned char*, size_t),
+                        void *sink, payloadHeader *header,
+                        unsigned long long *length) {
+    if (scatterKey != NULL) {
+        return writeScattered(file, NULL, fileLength, index, write, sink,
+                              header, length);
+    }
+    indexedSource source;
+    source.sw = loadScanBuffer(file, fileLength, 0);
+    if (source.sw == NULL) {
+        return 1;
+    }
+    startSlotIterator(&source.slots, index);
+    int result = writePayload(nextIndexedByte, &source, index->slotCount / 8,
+                              header, write, sink, length);
+    destroyScanWorker(source.sw);
+    return result;
+}
+
+/**
+ * Hides data like scannerHideMessage(), but takes the positions of usable
+ * coeficients from index instead of decoding the scan. Afterwards index holds
+ * the positions of the same coeficients in the modified scan, though its key
+ * still refers to the content before the change.
+ */
+int scannerHideIndexed(FILE *file, const unsigned char *data, size_t length,
+                       long fileLength, slotIndex *index) {
+    return hideWhole(startSession(file, NULL, NULL, fileLength,
+                                  loadScanBuffer(file, fileLength, 0), index),
+                     data, length);
+}
+
+/**
+ * Loads the whole of the scans of the progressive image file, from its
+ * cursor onwards, and stores the positions of their slots in *index.
+ * Returns the scanWorker holding them, or NULL on failiure
+ */
+static scanWorker* loadProgressive(FILE *file, jpegStats *stats,
+                                   long fileLength, slotIndex **index) {
+    scanWorker *sw = loadScanBuffer(file, fileLength, 0);
+    *index = sw == NULL ? NULL : initSlotIndex();
+    unsigned long long slots;
+    if (*index == NULL ||
+        indexProgressiveSlots(sw->scanBuffer, sw->totalSize, stats,
+                              channelMask, *index, &slots)) {
+        destroySlotIndex(*index);
+        *index = NULL;
+        destroyScanWorker(sw);
+        return NULL;
+    }
+    return sw;
+}
+
+/**
+ * Same as scannerReadMessage() for progressive images, whose slots are all
+ * found first and then read like those of an index
+ */
+static unsigned char* readProgressive(FILE *file, jpegStats *stats,
+                                      long fileLength, payloadHeader *header,
+                                      size_t *length) {
+    indexedSource source;
+    slotIndex *index;
+    source.sw = loadProgressive(file, stats, fileLength, &index);
+    if (source.sw == NULL) {
+        return NULL;
+    }
+    startSlotIterator(&source.slots, index);
+    unsigned char *mssg = readPayload(nextIndexedByte, &source,
+                                      index->slotCount / 8, header, length);
+    destroySlotIndex(index);
+    destroyScanWorker(source.sw);
+    return mssg;
+}
+
+/**
+ * Same as scannerSniffPayload() for progressive images
+ */
+static int sniffProgressive(FILE *file, jpegStats *stats, long fileLength,
+                            payloadHeader *header) {
+    indexedSource source;
+    slotIndex *index;
+    source.sw = loadProgressive(file, stats, fileLength, &index);
+    if (source.sw == NULL) {
+        memset(header, 0, sizeof(payloadHeader));
+        return 1;
+    }
+    startSlotIterator(&source.slots, index);
+    int result = sniffPayloadHeader(nextIndexedByte, &source, header);
+    destroySlotIndex(index);
+    destroyScanWorker(source.sw);
+    return result;
+}
+
+/**
+ * Same as scannerWriteMessage() for progressive images
+ */
+static int writeProgressive(FILE *file, jpegStats *stats, long fileLength,
+                            int (*write)(void*, const unsigned char*, size_t),
+                            void *sink, payloadHeader *header,
+                            unsigned long long *length) {
+    indexedSource source;
+    slotIndex *index;
+    source.sw = loadProgressive(file, stats, fileLength, &index);
+    if (source.sw == NULL) {
+        return 1;
+    }
+    startSlotIterator(&source.slots, index);
+    int result = writePayload(nextIndexedByte, &source, index->slotCount / 8,
+                              header, write, sink, length);
+    destroySlotIndex(index);
+    destroyScanWorker(source.sw);
+    return result;
+}
+
+/**
+ * Hide of a payload fed to it in pieces. The bits of baseline scans go in the
+ * coeficients sw decodes as they arrive, its cursor staying where the last
+ * piece left it. Those of progressive images, or of an index given to the
+ * session, go at the positions of index, which are moved by the stuff-bytes
+ * added or removed before them as they are used. With a scatter key, pieces
+ * are kept until the session is finished, as any slot may hold a bit of the
+ * last one.
+ */
+struct hideSession {
+    scanWorker *sw;
+    FILE *file;
+    FILE *output;  // where the modified scan goes, NULL to rewrite file
+    jpegStats *stats;
+    long fileLength;
+    unsigned long long bitsHidden;  // bits of the payload hidden so far
+    unsigned char failed;  // set once a piece could not be hidden
+
+    // Only used when hiding at the positions of an index
+    slotIndex *index;      // slots of the scan as it was loaded
+    slotIndex *ownIndex;   // index, if the session made it, NULL otherwise
+    slotIterator slots;    // next slot of index
+    slotIndex *moved;      // slots of index used so far, after restuffing
+    long long shift;         // bytes moved by restuffing before lastByte
+    long long pendingShift;  // bytes moved by restuffing in lastByte
+    unsigned long long lastByte;  // byte of the last slot taken from index
+
+    // Only used with a scatter key
+    unsigned long long slotCount;  // slots of the scan, if not indexed
+    unsigned char *fed;            // pieces fed so far, back to back
+    size_t fedLength;              // bytes of fed
+};
+
+/**
+ * Returns a session hiding in the scan loaded in sw, or NULL (after freeing
+ * sw) on failiure. Bits go at the positions of index unless it is NULL, in
+ * which case the scan is decoded with stats as they arrive
+ */
+static hideSession* startSession(FILE *file, FILE *output, jpegStats *stats,
+                                 long fileLength, scanWorker *sw,
+                                 slotIndex *index) {
+    if (sw == NULL) {
+        return NULL;
+    }
+    hideSession *hs = calloc(1, sizeof(hideSession));
+    if (hs == NULL) {
+        puts("ERROR allocating hide session");
+        destroyScanWorker(sw);
+        return NULL;
+    }
+    hs->sw = sw;
+    hs->file = file;
+    hs->output = output;
+    hs->stats = stats;
+    hs->fileLength = fileLength;
+    hs->index = index;
+    sw->sink = output;
+    if (index != NULL) {
+        startSlotIterator(&hs->slots, index);
+        hs->moved = initSlotIndex();
+    }
+    if (verifyHides) {
+        sw->written = initSlotIndex();
+    }
+    if ((index != NULL && hs->moved == NULL) ||
+        (verifyHides && sw->written == NULL)) {
+        destroyHideSession(hs);
+        return NULL;
+    }
+    return hs;
+}
+
+hideSession* scannerHideBegin(FILE *file, FILE *output, jpegStats *stats,
+                              long fileLength) {
+    if (!stats->progressive) {
+        // The order of scattered slots needs their number before any is used
+        unsigned long long slots = 0;
+        if (scatterKey != NULL &&
+            countAllSlots(file, stats, fileLength, &slots)) {
+            return NULL;
+        }
+        hideSession *hs = startSession(file, output, stats, fileLength,
+                                       initScanWorker(file, stats,
+                                                      fileLength), NULL);
+        if (hs != NULL) {
+            hs->slotCount = slots;
+        }
+        return hs;
+    }
+    // Progressive scans are indexed first, then hidden in like an index
+    slotIndex *index;
+    scanWorker *sw = loadProgressive(file, stats, fileLength, &index);
+    hideSession *hs = startSession(file, output, stats, fileLength, sw,
+                                   index);
+    if (hs == NULL) {
+        destroySlotIndex(index);
+        return NULL;
+    }
+    hs->ownIndex = index;
+    return hs;
+}
+
+/**
+ * Takes the next slot of hs->index, appending where restuffing moved it to
+ * hs->moved and storing that in *position. Stuff-bytes added or removed
+ * after a byte move every later byte; the change is only applied once the
+ * next slot is in a later byte. Returns 0 on success and 1 if index has no
+ * slots left or the slot cannot be appended
+ */
+static int moveNextSlot(hideSession *hs, unsigned long long *position) {
+    unsigned long long original;
+    if (nextSlot(&hs->slots, &original)) {
+        return 1;
+    }
+    unsigned long long byte = original >> 3;
+    if (byte != hs->lastByte) {
+        hs->shift += hs->pendingShift;
+        hs->pendingShift = 0;
+        hs->lastByte = byte;
+    }
+    *position = 8ULL*(byte + hs->shift) + (original & 7);
+    return appendSlot(hs->moved, *position);
+}
+
+/**
+ * Sets the bit at position (8*byte + bit) of the scan of hs to bit, adding
+ * or removing the stuff-byte after it if its byte turns into or stops being
+ * 0xFF. Returns 0 on success and 1 otherwise
+ */
+static int writeSlotBit(hideSession *hs, unsigned long long position,
+                        unsigned char bit) {
+    scanWorker *sw = hs->sw;
+    unsigned long current = position >> 3;
+    unsigned char mask = 1 << (7 - (position & 7));
+    unsigned char before = sw->scanBuffer[current];
+    if (((before & mask) != 0) == bit) {
+        return 0;
+    }
+    sw->scanBuffer[current] = before ^ mask;
+    noteChange(sw, current, current + 1);
+    if (sw->scanBuffer[current] == 0xFF) {
+        noteChange(sw, current, current + 2);
+        if (insertStuffByte(sw, current)) {
+            return 1;
+        }
+        hs->pendingShift++;
+    } else if (before == 0xFF) {
+        if (removeStuffByte(sw, current)) {
+            return 1;
+        }
+        hs->pendingShift--;
+    }
+    return 0;
+}
+
+/**
+ * Hides bit in the next slot of hs, or only passes the slot if bit is
+ * READ_MESSAGE_CODE_PROCESSOR, recording its position when verifying.
+ * Returns 0 on success and 1 otherwise
+ */
+static int hideNextBit(hideSession *hs, unsigned char bit) {
+    scanWorker *sw = hs->sw;
+    unsigned long long position;
+    int result = 0;
+    if (hs->index != NULL) {
+        result = moveNextSlot(hs, &position);
+        if (result) {
+            puts("ERROR: message does not fit in indexed coeficients");
+        }
+    } else {
+        // Restuffing only moves later bytes, so the position of the
+        // coeficient found here is where its bit ends up
+        while (!result && mcuNotPropper(sw, sw->mcu, hs->stats)) {
+            result = advanceMCUPointer(sw, hs->stats);
+        }
+        if (result) {
+            puts("ERROR: message does not fit in the image");
+        }
+        position = 8*(sw->windowStart + sw->mcu->index) + sw->mcu->bit;
+    }
+    if (result || sw->verifyFailed ||
+        (sw->written != NULL && appendSlot(sw->written, position))) {
+        return 1;
+    }
+    if (hs->index == NULL) {
+        return processBit(sw, hs->stats, &bit);
+    }
+    return bit != READ_MESSAGE_CODE_PROCESSOR &&
+           writeSlotBit(hs, position, bit);
+}
+
+/**
+ * Checks the bits hidden from the piece of the payload hs is hiding that were
+ * not checked yet, failing hs unless they all read back
+ */
+static void checkPiece(hideSession *hs) {
+    scanWorker *sw = hs->sw;
+    if (!hs->failed && sw->written != NULL) {
+        phaseTimer timer;
+        timerBegin(&timer, "verify", NULL);
+        hs->failed = sw->verifyFailed || checkHiddenBits(sw, ~0ULL);
+        timerEnd(&timer);
+    }
+    sw->hidden = NULL;
+}
+
+int scannerHideFeed(hideSession *hs, const unsigned char *data,
+                    size_t length) {
+    if (hs->failed) {
+        return 1;
+    }
+    if (scatterKey != NULL) {
+        unsigned char *fed = realloc(hs->fed, hs->fedLength + length);
+        if (fed == NULL) {
+            puts("ERROR allocating scattered payload");
+            hs->failed = 1;
+            return 1;
+        }
+        memcpy(fed + hs->fedLength, data, length);
+        hs->fed = fed;
+        hs->fedLength += length;
+        return 0;
+    }
+    scanWorker *sw = hs->sw;
+    sw->hidden = data;
+    sw->hiddenStart = hs->bitsHidden;
+    for (size_t i = 0; i < 8*length; i++) {
+        unsigned char bit = (data[i >> 3] >> (7 - (i & 7))) & 1;
+        #ifdef TESTING
+            assert(bit == 0 || bit == 1);
+        #endif
+        if (hideNextBit(hs, bit)) {
+            hs->failed = 1;
+            break;
+        }
+        hs->bitsHidden++;
+    }
+
+    // data is only around until this returns, so its bits are checked now.
+    // Later bits are only ever hidden after these, which never moves them.
+    checkPiece(hs);
+    return hs->failed;
+}
+
+static int hideScattered(hideSession *hs, const unsigned char *data,
+                         size_t length);
+
+int scannerHideFinish(hideSession *hs) {
+    scanWorker *sw = hs->sw;
+    int result = hs->failed;
+    if (!result && hs->fed != NULL) {
+        result = hideScattered(hs, hs->fed, hs->fedLength);
+    }
+    unsigned long long position;
+    // Slots past the payload move by the restuffing before them too
+    while (!result && hs->index != NULL &&
+           hs->moved->slotCount < hs->index->slotCount) {
+        result = moveNextSlot(hs, &position);
+    }
+    timerCounter("restuffs", sw->restuffs);
+
+    // Nothing reaches the file unless every piece was hidden
+    if (!result) {
+        phaseTimer timer;
+        timerBegin(&timer, "write", NULL);
+        result = hs->output ? finishSink(sw) : modifyFile(hs->file, sw);
+        timerEnd(&timer);
+    }
+    #ifdef TESTING
+        printf("FINAL ON MCUS READ: %llu\n", sw->mcusRead);
+    #endif
+
+    // Hand the moved positions over to an index given to the session
+    if (!result && hs->index != NULL && hs->ownIndex == NULL) {
+        slotIndex *index = hs->index;
+        free(index->slots);
+        index->slots = hs->moved->slots;
+        index->slotsLength = hs->moved->slotsLength;
+        index->slotsCapacity = hs->moved->slotsCapacity;
+        index->lastSlot = hs->moved->lastSlot;
+        index->fileLength += (long long)sw->totalSize -
+                             (hs->fileLength - (long long)index->scanOffset);
+        hs->moved->slots = NULL;
+    }
+    destroyHideSession(hs);
+    return result;
+}
+
+void destroyHideSession(hideSession *hs) {
+    if (hs == NULL) {
+        return;
+    }
+    destroySlotIndex(hs->moved);
+    destroySlotIndex(hs->ownIndex);
+    destroyScanWorker(hs->sw);
+    free(hs->fed);
+    free(hs);
+}
+
+/**
+ * Hides all length bytes of data in hs in the order scatterKey gives the
+ * slots. The slots are still taken in scan order, so restuffing and
+ * verification work as for any hide: each gets the payload bit gatherBit()
+ * maps it to, or is passed if that is past the payload, up to the slot of
+ * the last bit. Returns 0 on success and 1 otherwise
+ */
+static int hideScattered(hideSession *hs, const unsigned char *data,
+                         size_t length) {
+    scanWorker *sw = hs->sw;
+    unsigned long long bits = 8ULL*length;
+    unsigned long long slots = hs->index != NULL ? hs->index->slotCount :
+                               hs->slotCount;
+    if (bits > slots) {
+        puts("ERROR: message does not fit in the image");
+        hs->failed = 1;
+        return 1;
+    }
+    slotScatter scatter;
+    initScatter(&scatter, scatterKey, slots);
+    sw->hidden = data;
+    sw->hiddenStart = 0;
+    sw->scatter = &scatter;
+    sw->hiddenBits = bits;
+    for (unsigned long long slot = 0; hs->bitsHidden < bits; slot++) {
+        unsigned long long bit = gatherBit(&scatter, slot);
+        unsigned char value = bit < bits ?
+                              (data[bit >> 3] >> (7 - (bit & 7))) & 1 :
+                              READ_MESSAGE_CODE_PROCESSOR;
+        if (hideNextBit(hs, value)) {
+            hs->failed = 1;
+            break;
+        }
+        hs->bitsHidden += bit < bits;
+    }
+    checkPiece(hs);
+    sw->scatter = NULL;
+    return hs->failed;
+}
+
+/**
+ * Hides all length bytes of data with hs and finishes it. Payloads are
+ * scattered over the slots if a scatter key is set, without copying them as
+ * scannerHideFeed() would. Returns 0 on success and 1 otherwise
+ */
+static int hideWhole(hideSession *hs, const unsigned char *data,
+                     size_t length) {
+    if (hs == NULL) {
+        return 1;
+    }
+    phaseTimer timer;
+    timerBegin(&timer, "embed", NULL);
+    int result = scatterKey != NULL ? hideScattered(hs, data, length) :
+                                      scannerHideFeed(hs, data, length);
+    timerEnd(&timer);
+    if (result) {
+        destroyHideSession(hs);
+        return 1;
+    }
+    return scannerHideFinish(hs);
 }
@@ -2,6 +2,8 @@
 #define __SCANNER_WORKER__
 #include <stdio.h>
 #include "csteg.h"
+#include "cache.h"
+#include "payload.h"
 
 #define EOB_ENCOUNTERED 123
 #define ZRL_ENCOUNTERED 124
@@ -11,9 +13,189 @@
 
 #define IS_BIT(bit) (bit == 0 || bit == 1)
 
-int scannerHideMessage(FILE*, jpegStats*, char*, long);
+#define SCAN_WINDOW_SIZE (1UL << 20)  // bytes of a streamed scan held at once
+#define SNIFF_WINDOW_SIZE (64UL << 10)  // bytes of a scan read when sniffing
+#define DEFAULT_STREAMING_THRESHOLD (256ULL << 20)
 
-char* scannerReadMessage(FILE*, jpegStats*, long);
+// Channels whose AC coeficients may hold hidden bits, by color index
+#define CHANNEL_BIT(colorIndex) (1 << (colorIndex))
+#define CHANNEL_Y CHANNEL_BIT(Y_ID - 1)
+#define CHANNEL_CB CHANNEL_BIT(CB_ID - 1)
+#define CHANNEL_CR CHANNEL_BIT(CR_ID - 1)
+#define DEFAULT_CHANNELS (CHANNEL_CB | CHANNEL_CR)
+
+#define DEFAULT_ESTIMATE_SAMPLES 64  // restart intervals decoded by estimates
+
+/*
+ * Capacity of a scan extrapolated from some of its restart intervals
+ */
+typedef struct slotEstimate {
+    unsigned long long slots;      // estimated number of usable coeficients
+    unsigned long long margin;     // half width of 95% confidence interval
+    unsigned int sampled;          // restart intervals decoded
+    unsigned long long intervals;  // restart intervals in the scan, 0 if none
+} slotEstimate;
+
+/*
+ * Hides the length bytes of data in the scan of file, which starts at its
+ * cursor, rewriting the scan in place. Returns 0 on success and 1 otherwise
+ */
+int scannerHideMessage(FILE*, jpegStats*, const unsigned char *data,
+                       size_t length, long fileLength);
+
+/*
+ * Same as scannerHideMessage(), but writes the modified scan to output
+ * (positioned right after a copy of the image's headers) instead of
+ * rewriting file, so it also works while the scan is streamed
+ */
+int scannerHideStreamed(FILE *file, FILE *output, jpegStats*,
+                        const unsigned char *data, size_t length,
+                        long fileLength);
+
+/*
+ * Hide of a payload fed to it in pieces of any size, for payloads that are
+ * not all in memory at once
+ */
+typedef struct hideSession hideSession;
+
+/*
+ * Starts hiding a payload in the scan of file, which starts at its cursor,
+ * without knowing how long the payload is. The modified scan replaces the
+ * original one in file once the hide is finished if output is NULL, and is
+ * written to output (see scannerHideStreamed()) otherwise. A session must
+ * be fed and finished by the thread that began it, which works on no other
+ * scan meanwhile. Returns NULL on failiure
+ */
+hideSession* scannerHideBegin(FILE *file, FILE *output, jpegStats*,
+                              long fileLength);
+
+/*
+ * Hides the next length bytes of the payload of session right away, so data
+ * need not be kept afterwards. Returns 0 on success and 1 if they do not fit
+ * or cannot be hidden, after which the session can only be destroyed
+ */
+int scannerHideFeed(hideSession*, const unsigned char *data, size_t length);
+
+/*
+ * Writes the modified scan (nothing is written unless every piece was
+ * hidden) and frees session. Returns 0 on success and 1 otherwise
+ */
+int scannerHideFinish(hideSession*);
+
+/*
+ * Frees session without finishing its hide, leaving file unchanged (output
+ * may hold part of the modified scan)
+ */
+void destroyHideSession(hideSession*);
+
+/*
+ * Scans longer than threshold bytes are decoded through a window of
+ * SCAN_WINDOW_SIZE bytes from then on instead of being loaded whole
+ */
+void setStreamingThreshold(unsigned long long threshold);
+
+/*
+ * Sets the channels (CHANNEL_ bits) whose AC coeficients hold hidden bits.
+ * Images must be read with the mask they were written with.
+ */
+void setChannelMask(unsigned char mask);
+
+unsigned char getChannelMask();
+
+/*
+ * If verify is non-zero, hides check that every hidden bit reads back from
+ * the modified scan before any of it is written, and fail otherwise
+ */
+void setHideVerification(int verify);
+
+/*
+ * If key is not NULL, payload bits are spread over all slots of an image in
+ * the pseudorandom order key gives them (see scatter.h) instead of filling
+ * its first slots, and must be read with the key they were written with.
+ * The order needs the number of slots, so they are counted first. Hides
+ * then take the slots in scan order up to the one holding the last payload
+ * bit, once the whole payload is known (sessions keep the pieces fed to
+ * them until they are finished). Reads take one such pass for the framing
+ * of a payload and one for the rest of it.
+ */
+void setScatterKey(const char *key);
+
+const char* getScatterKey();
+
+/*
+ * Sets the number of threads counting the slots of a single image with
+ * restart markers, 1 by default. Each also decodes several of its restart
+ * intervals at once (see lanes.h)
+ */
+void setDecodeThreads(int threads);
+
+/*
+ * Returns 1 if the scan starting at file's cursor (fileLength bytes long in
+ * total) is decoded through a window and 0 otherwise
+ */
+int isStreamedScan(FILE*, long fileLength);
+
+/*
+ * Returns the payload hidden in the scan of file (see readPayload())
+ */
+unsigned char* scannerReadMessage(FILE*, jpegStats*, long fileLength,
+                                  payloadHeader*, size_t *length);
+
+/*
+ * Same as scannerReadMessage(), but hands the payload data to write(sink,
+ * data, count) while the scan is decoded instead of keeping it, storing its
+ * length in *length (see writePayload()). Returns 0 on success and 1
+ * otherwise
+ */
+int scannerWriteMessage(FILE*, jpegStats*, long fileLength,
+                        int (*write)(void*, const unsigned char*, size_t),
+                        void *sink, payloadHeader*,
+                        unsigned long long *length);
+
+/*
+ * Reads only the header of a framed payload hidden in the scan of file into
+ * *header, decoding no more of the scan than that and stopping as soon as
+ * the magic does not match (see sniffPayloadHeader()). Returns 0 if the scan
+ * holds a framed payload and 1 otherwise
+ */
+int scannerSniffPayload(FILE*, jpegStats*, long fileLength, payloadHeader*);
 
 long getMaxMessageSize(FILE*, jpegStats*, long);
+
+long buildSlotIndex(FILE*, jpegStats*, long, slotIndex*, slotCheckpoints*);
+
+/*
+ * Estimates the number of usable coeficients in the scan of file by decoding
+ * only samples evenly spaced restart intervals (at least 2) and extrapolating
+ * their density per MCU to the whole scan. Scans without restart markers are
+ * counted exactly. Returns 0 on success and 1 otherwise
+ */
+int estimateSlots(FILE*, jpegStats*, long fileLength, unsigned int samples,
+                  slotEstimate*);
+
+/*
+ * Returns length bytes of the data of the payload hidden in the scan of file,
+ * starting at byte offset of the data, storing how many there are in
+ * *rangeLength. Only decodes the scan from the restart interval holding byte
+ * offset if the payload has checkpoints
+ */
+unsigned char* scannerReadRange(FILE*, jpegStats*, long fileLength,
+                                unsigned long long offset,
+                                unsigned long long length, payloadHeader*,
+                                size_t *rangeLength);
+
+int scannerHideIndexed(FILE*, const unsigned char *data, size_t length,
+                       long fileLength, slotIndex*);
+
+unsigned char* scannerReadIndexed(FILE*, long fileLength, slotIndex*,
+                                  payloadHeader*, size_t *length);
+
+/*
+ * Same as scannerWriteMessage(), but takes the positions of usable
+ * coeficients from index like scannerReadIndexed()
+ */
+int scannerWriteIndexed(FILE*, long fileLength, slotIndex*,
+                        int (*write)(void*, const unsigned char*, size_t),
+                        void *sink, payloadHeader*,
+                        unsigned long long *length);
 #endif
@@ -0,0 +1,83 @@
+#include <string.h>
+#include "scatter.h"
+#include "hash.h"
+
+/**
+ * Returns the round function of the Feistel network: half, mixed with
+ * roundKey, cut to mask
+ */
+static unsigned long long roundValue(unsigned long long half,
+                                     unsigned long long roundKey,
+                                     unsigned long long mask) {
+    // Finalizer of SplitMix64, every input bit reaches every output bit
+    unsigned long long x = half ^ roundKey;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) & mask;
+}
+
+void initScatter(slotScatter *scatter, const char *key,
+                 unsigned long long slots) {
+    scatter->slots = slots;
+    unsigned char bits = 2;  // blocks of at least 2 bits, 1 per half
+    while (bits < 64 && (1ULL << bits) < slots) {
+        bits += 2;
+    }
+    scatter->halfBits = bits / 2;
+    for (unsigned char round = 0; round < SCATTER_ROUNDS; round++) {
+        scatter->roundKeys[round] = fnv1a64(key, strlen(key),
+                                            fnv1a64(&round, 1,
+                                                    FNV_OFFSET_BASIS));
+    }
+}
+
+/**
+ * Applies the Feistel network of scatter to value once
+ */
+static unsigned long long feistel(const slotScatter *scatter,
+                                  unsigned long long value) {
+    unsigned long long mask = (1ULL << scatter->halfBits) - 1;
+    unsigned long long left = value >> scatter->halfBits;
+    unsigned long long right = value & mask;
+    for (int round = 0; round < SCATTER_ROUNDS; round++) {
+        unsigned long long next = left ^
+            roundValue(right, scatter->roundKeys[round], mask);
+        left = right;
+        right = next;
+    }
+    return left << scatter->halfBits | right;
+}
+
+/**
+ * Undoes feistel()
+ */
+static unsigned long long unfeistel(const slotScatter *scatter,
+                                    unsigned long long value) {
+    unsigned long long mask = (1ULL << scatter->halfBits) - 1;
+    unsigned long long left = value >> scatter->halfBits;
+    unsigned long long right = value & mask;
+    for (int round = SCATTER_ROUNDS - 1; round >= 0; round--) {
+        unsigned long long previous = right ^
+            roundValue(left, scatter->roundKeys[round], mask);
+        right = left;
+        left = previous;
+    }
+    return left << scatter->halfBits | right;
+}
+
+unsigned long long scatterBit(const slotScatter *scatter,
+                              unsigned long long bit) {
+    // The domain is less than 4 times the slots, so few steps land past them
+    do {
+        bit = feistel(scatter, bit);
+    } while (bit >= scatter->slots);
+    return bit;
+}
+
+unsigned long long gatherBit(const slotScatter *scatter,
+                             unsigned long long slot) {
+    do {
+        slot = unfeistel(scatter, slot);
+    } while (slot >= scatter->slots);
+    return slot;
+}
@@ -0,0 +1,40 @@
+#ifndef __CSTEG_SCATTER__
+#define __CSTEG_SCATTER__
+
+/*
+ * Keyed pseudorandom order of the slots (usable coeficients) of a scan, so
+ * the changes made by a hide are spread over the whole image instead of
+ * filling its first slots. Payload bit i goes in slot scatterBit(i).
+ *
+ * The order is a balanced Feistel network over the smallest domain of an
+ * even number of bits holding every slot, applied again while it lands past
+ * the last slot (cycle walking). Mapping a bit to its slot, or a slot to its
+ * bit, takes a few hash rounds and no memory, so no table of slots is ever
+ * shuffled.
+ */
+
+#define SCATTER_ROUNDS 6  // Feistel rounds of the permutation
+
+typedef struct slotScatter {
+    unsigned long long slots;  // number of slots permuted
+    unsigned char halfBits;    // bits of each half of a Feistel block
+    unsigned long long roundKeys[SCATTER_ROUNDS];
+} slotScatter;
+
+/*
+ * Sets up scatter to permute slots slots in the order given by key
+ */
+void initScatter(slotScatter *scatter, const char *key,
+                 unsigned long long slots);
+
+/*
+ * Returns the slot holding payload bit bit, both less than scatter->slots
+ */
+unsigned long long scatterBit(const slotScatter*, unsigned long long bit);
+
+/*
+ * Returns the payload bit held by slot slot, the inverse of scatterBit()
+ */
+unsigned long long gatherBit(const slotScatter*, unsigned long long slot);
+
+#endif
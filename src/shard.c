@@ -0,0 +1,380 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "shard.h"
+#include "batch.h"
+#include "csteg.h"
+#include "ioring.h"
+#include "payload.h"
+#include "scanWorker.h"
+#include "timer.h"
+
+/**
+ * State shared by the jobs of one hideShards() or extractShards() call
+ */
+typedef struct shardJobs {
+    char **images;
+    filePrefetch *prefetch;         // images read ahead of the jobs
+    long *capacities;               // payload bytes each image can hold
+    slotCheckpoints *checkpoints;   // checkpoints of each image when hiding
+    int *carriers;                  // image holding each part when hiding
+    const unsigned char *payload;   // whole payload when hiding
+    unsigned long long *offsets;    // where the part of each image starts
+    unsigned long long *lengths;    // bytes in the part of each image
+    unsigned short total;           // number of parts
+    unsigned char **parts;          // data read from each image
+    payloadHeader *headers;         // headers read from each image
+} shardJobs;
+
+static unsigned char shardFlags = 0;  // PAYLOAD_ flags of every part
+
+void setShardFlags(unsigned char flags) {
+    shardFlags = flags;
+}
+
+/**
+ * Opens the JPG at path and parses its headers, storing the open file in
+ * *imgFile. Returns NULL on failiure
+ */
+static jpegStats* openImage(char *path, const char *mode, FILE **imgFile) {
+    *imgFile = fopen(path, mode);
+    if (*imgFile == NULL) {
+        printf("ERROR: cannot open %s\n", path);
+        return NULL;
+    }
+    return getJpegStats(path, *imgFile);  // closes *imgFile on failiure
+}
+
+/**
+ * Same as openImage() for image i of jobs, read ahead by jobs->prefetch,
+ * also storing its size in *fileSize
+ */
+static jpegStats* openPrefetchedImage(shardJobs *jobs, size_t i,
+                                      FILE **imgFile, long *fileSize) {
+    *imgFile = openPrefetched(jobs->prefetch, i, fileSize);
+    if (*imgFile == NULL) {
+        printf("ERROR: cannot open %s\n", jobs->images[i]);
+        return NULL;
+    }
+    return getJpegStats(jobs->images[i], *imgFile);  // closes on failiure
+}
+
+/**
+ * Runs job over the count images of jobs while they are read ahead of it.
+ * Returns the number of jobs that failed, or 1 if reading cannot start
+ */
+static size_t runPrefetched(shardJobs *jobs, int count, int threadCount,
+                            int (*job)(size_t, void*)) {
+    jobs->prefetch = prefetchFiles(jobs->images, count, 0);
+    if (jobs->prefetch == NULL) {
+        puts("ERROR: cannot start reading files");
+        return 1;
+    }
+    size_t failures = runBatch(count, threadCount, job, jobs);
+    destroyPrefetch(jobs->prefetch);
+    jobs->prefetch = NULL;
+    return failures;
+}
+
+/**
+ * runBatch() job: finds how many payload bytes image i can hold
+ */
+static int capacityJob(size_t i, void *context) {
+    shardJobs *jobs = context;
+    jobs->capacities[i] = -1;
+    phaseTimer timer;
+    timerBegin(&timer, "capacity", jobs->images[i]);
+    FILE *imgFile;
+    long fileSize;
+    jpegStats *stats = openPrefetchedImage(jobs, i, &imgFile, &fileSize);
+    if (stats == NULL) {
+        timerEnd(&timer);
+        return 1;
+    }
+    // Scattered parts cannot be read from a checkpoint
+    slotCheckpoints *checkpoints = getScatterKey() == NULL ?
+                                   &jobs->checkpoints[i] : NULL;
+    long maxMessageSize = buildSlotIndex(imgFile, stats, fileSize, NULL,
+                                         checkpoints);
+    if (maxMessageSize >= 0) {
+        // Parts carry a header instead of the terminating 0 byte
+        fitCheckpoints(&jobs->checkpoints[i], maxMessageSize + 1);
+        long capacity = maxMessageSize + 1 -
+                        (long)framingLength(shardFlags, &jobs->checkpoints[i]);
+        jobs->capacities[i] = capacity > 0 ? capacity : 0;
+    }
+    fclose(imgFile);
+    destroyJpegStats(stats);
+    timerEnd(&timer);
+    return jobs->capacities[i] < 0;
+}
+
+/**
+ * runBatch() job: hides part i of the payload in the image chosen for it
+ */
+static int hideJob(size_t i, void *context) {
+    shardJobs *jobs = context;
+    int image = jobs->carriers[i];
+    size_t length;
+    unsigned char *data = framePayload(i, jobs->total, shardFlags,
+                                       &jobs->checkpoints[image],
+                                       &jobs->payload[jobs->offsets[i]],
+                                       jobs->lengths[i], &length);
+    if (data == NULL) {
+        return 1;
+    }
+
+    FILE *imgFile;
+    jpegStats *stats = openImage(jobs->images[image], "r+b", &imgFile);
+    int result = 1;
+    if (stats != NULL) {
+        result = hideBytes(jobs->images[image], imgFile, stats, data, length,
+                           getFileSize(jobs->images[image]));
+        fclose(imgFile);
+        destroyJpegStats(stats);
+    }
+    if (result == 0) {
+        printf("HID PART %zu OF %d (%llu bytes) IN %s\n", i + 1, jobs->total,
+               jobs->lengths[i], jobs->images[image]);
+    }
+    free(data);
+    return result;
+}
+
+/**
+ * runBatch() job: reads the payload part hidden in image i. Images holding no
+ * part are left with a NULL part, as -W does not use every image given
+ */
+static int readJob(size_t i, void *context) {
+    shardJobs *jobs = context;
+    phaseTimer timer;
+    timerBegin(&timer, "extract", jobs->images[i]);
+    FILE *imgFile;
+    long fileSize;
+    jpegStats *stats = openPrefetchedImage(jobs, i, &imgFile, &fileSize);
+    if (stats == NULL) {
+        timerEnd(&timer);
+        return 1;
+    }
+    size_t length;
+    jobs->parts[i] = scannerReadMessage(imgFile, stats, fileSize,
+                                        &jobs->headers[i], &length);
+    fclose(imgFile);
+    destroyJpegStats(stats);
+    timerEnd(&timer);
+    if (jobs->parts[i] == NULL || jobs->headers[i].version == 0) {
+        printf("NOTE: %s holds no payload part\n", jobs->images[i]);
+        free(jobs->parts[i]);
+        jobs->parts[i] = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Reads all of the file at path into allocated memory, storing its length in
+ * *length. Returns NULL on failiure
+ */
+static unsigned char* loadPayload(char *path, unsigned long long *length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("ERROR reading file %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    unsigned char *payload = malloc(size > 0 ? size : 1);
+    if (payload == NULL || size < 0 ||
+        fread(payload, 1, size, file) != (size_t)size) {
+        printf("ERROR reading file %s\n", path);
+        free(payload);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *length = size;
+    return payload;
+}
+
+/**
+ * Cuts the payload of jobs (payloadLength bytes) into parts for the images
+ * in the order they were given, each part filling the capacity of its image
+ * and images with no room skipped, storing in jobs the images that get one.
+ * Returns 0 on success and 1 if the images cannot hold the whole payload
+ */
+static int planShards(shardJobs *jobs, int imageCount,
+                      unsigned long long payloadLength) {
+    unsigned long long placed = 0;
+    unsigned long long totalCapacity = 0;
+    for (int i = 0; i < imageCount; i++) {
+        unsigned long long capacity = jobs->capacities[i];
+        unsigned long long left = payloadLength - placed;
+        totalCapacity += capacity;
+        // Skip images with no room; an empty payload still needs one part
+        if ((left == 0 && jobs->total != 0) || (left != 0 && capacity == 0)) {
+            continue;
+        }
+        jobs->carriers[jobs->total] = i;
+        jobs->offsets[jobs->total] = placed;
+        jobs->lengths[jobs->total] = left < capacity ? left : capacity;
+        placed += jobs->lengths[jobs->total];
+        jobs->total++;
+    }
+    if (placed != payloadLength) {
+        printf("ERROR: payload of %llu bytes does not fit in the %llu bytes "
+               "the %d images can hold\n", payloadLength, totalCapacity,
+               imageCount);
+        return 1;
+    }
+    return 0;
+}
+
+int hideShards(char *payloadPath, char **images, int imageCount,
+               int threadCount) {
+    if (imageCount > MAX_SHARDS) {
+        printf("ERROR: at most %d images can share a payload\n", MAX_SHARDS);
+        return 1;
+    }
+    phaseTimer timer;
+    timerBegin(&timer, "load", payloadPath);
+    unsigned long long payloadLength;
+    unsigned char *payload = loadPayload(payloadPath, &payloadLength);
+    timerEnd(&timer);
+    if (payload == NULL) {
+        return 1;
+    }
+
+    // Capacities are found for every image, parts only go to some of them
+    shardJobs jobs = {0};
+    jobs.images = images;
+    jobs.payload = payload;
+    jobs.capacities = malloc(imageCount * sizeof(long));
+    jobs.checkpoints = calloc(imageCount, sizeof(slotCheckpoints));
+    jobs.carriers = malloc(imageCount * sizeof(int));
+    jobs.offsets = malloc(imageCount * sizeof(unsigned long long));
+    jobs.lengths = malloc(imageCount * sizeof(unsigned long long));
+    int result = jobs.capacities == NULL || jobs.checkpoints == NULL ||
+                 jobs.carriers == NULL || jobs.offsets == NULL ||
+                 jobs.lengths == NULL ||
+                 runPrefetched(&jobs, imageCount, threadCount, capacityJob) ||
+                 planShards(&jobs, imageCount, payloadLength) ||
+                 runBatch(jobs.total, threadCount, hideJob, &jobs) != 0;
+
+    for (int i = 0; jobs.checkpoints != NULL && i < imageCount; i++) {
+        destroyCheckpoints(&jobs.checkpoints[i]);
+    }
+    free(jobs.capacities);
+    free(jobs.checkpoints);
+    free(jobs.carriers);
+    free(jobs.offsets);
+    free(jobs.lengths);
+    free(payload);
+    return result;
+}
+
+/**
+ * Checks that the parts read into jobs from the imageCount images are one
+ * whole payload, storing in order[s] (MAX_SHARDS entries) the image holding
+ * part s and the number of parts in jobs->total.
+ * Returns 0 on success and 1 otherwise
+ */
+static int orderShards(shardJobs *jobs, int imageCount, int *order) {
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        order[i] = -1;
+    }
+    jobs->total = 0;
+    for (int i = 0; i < imageCount; i++) {
+        payloadHeader *header = &jobs->headers[i];
+        if (jobs->parts[i] == NULL) {
+            continue;
+        }
+        if (jobs->total == 0) {
+            jobs->total = header->total;
+        }
+        if (header->total != jobs->total ||
+            header->sequence >= header->total) {
+            printf("ERROR: %s holds part %d of %d, which is not part of a "
+                   "payload in %d parts\n", jobs->images[i],
+                   header->sequence + 1, header->total, jobs->total);
+            return 1;
+        }
+        if (order[header->sequence] != -1) {
+            printf("ERROR: %s repeats part %d\n", jobs->images[i],
+                   header->sequence + 1);
+            return 1;
+        }
+        order[header->sequence] = i;
+    }
+    if (jobs->total == 0) {
+        puts("ERROR: none of the images hold a payload part");
+        return 1;
+    }
+    for (int s = 0; s < jobs->total; s++) {
+        if (order[s] == -1) {
+            printf("ERROR: part %d of %d is missing\n", s + 1, jobs->total);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes the parts in jobs to outputPath in the given order, all at once.
+ * Returns 0 on success and 1 otherwise
+ */
+static int writeShards(char *outputPath, shardJobs *jobs, const int *order) {
+    phaseTimer timer;
+    timerBegin(&timer, "output", outputPath);
+    int out = open(outputPath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ioRequest *writes = malloc(jobs->total * sizeof(ioRequest));
+    ioRing *ring = ioRingInit(IO_RING_DEPTH);
+    if (out < 0 || writes == NULL || ring == NULL) {
+        printf("ERROR: cannot write %s\n", outputPath);
+        if (out >= 0) {
+            close(out);
+        }
+        free(writes);
+        destroyIoRing(ring);
+        timerEnd(&timer);
+        return 1;
+    }
+    long long offset = 0;
+    for (int i = 0; i < jobs->total; i++) {
+        int image = order[i];
+        ioRequest write = {out, IO_WRITE, jobs->parts[image],
+                           jobs->headers[image].length, offset, 0, 0, NULL};
+        writes[i] = write;
+        offset += jobs->headers[image].length;
+    }
+    int result = ioRingRun(ring, writes, jobs->total) != 0;
+    result = close(out) != 0 || result;
+    free(writes);
+    destroyIoRing(ring);
+    timerEnd(&timer);
+    if (result == 0) {
+        printf("EXTRACTED %d PARTS INTO %s\n", jobs->total, outputPath);
+    }
+    return result;
+}
+
+int extractShards(char *outputPath, char **images, int imageCount,
+                  int threadCount) {
+    shardJobs jobs = {0};
+    jobs.images = images;
+    jobs.parts = calloc(imageCount, sizeof(unsigned char*));
+    jobs.headers = calloc(imageCount, sizeof(payloadHeader));
+    int *order = malloc(MAX_SHARDS * sizeof(int));  // image of each part
+    int result = jobs.parts == NULL || jobs.headers == NULL || order == NULL ||
+                 runPrefetched(&jobs, imageCount, threadCount, readJob) ||
+                 orderShards(&jobs, imageCount, order) ||
+                 writeShards(outputPath, &jobs, order);
+
+    for (int i = 0; jobs.parts != NULL && i < imageCount; i++) {
+        free(jobs.parts[i]);
+    }
+    free(jobs.parts);
+    free(jobs.headers);
+    free(order);
+    return result;
+}
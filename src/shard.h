@@ -0,0 +1,37 @@
+#ifndef __CSTEG_SHARD__
+#define __CSTEG_SHARD__
+
+/*
+ * Moving one payload through many carrier images. The payload is cut into
+ * consecutive parts sized to the capacity of each image, in the order the
+ * images are given, and every part is hidden with a header holding its
+ * sequence number and the total number of parts.
+ */
+
+#define MAX_SHARDS 65535  // sequence numbers are 16-bit
+
+/*
+ * Sets the PAYLOAD_ flags (such as PAYLOAD_CHECKSUM) of the parts written by
+ * hideShards()
+ */
+void setShardFlags(unsigned char flags);
+
+/*
+ * Splits the file at payloadPath over the imageCount JPGs in images, using
+ * threadCount threads to find their capacities and to hide the parts. Images
+ * left over once the payload is placed are not modified.
+ * Returns 0 on success and 1 otherwise
+ */
+int hideShards(char *payloadPath, char **images, int imageCount,
+               int threadCount);
+
+/*
+ * Reads the parts of a payload from the imageCount JPGs in images (in any
+ * order, images holding no part are skipped) using threadCount threads and
+ * writes the reassembled payload to outputPath. Returns 0 on success and 1
+ * if any part is missing or the parts belong to different payloads
+ */
+int extractShards(char *outputPath, char **images, int imageCount,
+                  int threadCount);
+
+#endif
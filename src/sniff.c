@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include "sniff.h"
+#include "batch.h"
+#include "csteg.h"
+#include "ioring.h"
+#include "payload.h"
+#include "scanWorker.h"
+#include "timer.h"
+
+// Bytes read ahead of each file: its headers and the start of its scan
+#define SNIFF_READ_SIZE (SNIFF_WINDOW_SIZE + (32UL << 10))
+
+/**
+ * Files being sniffed by a call to sniffPath()
+ */
+typedef struct sniffJobs {
+    char **files;
+    filePrefetch *prefetch;
+} sniffJobs;
+
+/**
+ * Reads the payload header hidden in file index of jobs into *header.
+ * Returns 0 if the file could be decoded, whether or not it holds a payload
+ * (header->version is 0 if not), and 1 otherwise
+ */
+static int sniffFile(sniffJobs *jobs, size_t index, payloadHeader *header) {
+    char *path = jobs->files[index];
+    header->version = 0;
+    long fileSize;
+    FILE *imgFile = openPrefetched(jobs->prefetch, index, &fileSize);
+    if (imgFile == NULL) {
+        printf("ERROR: cannot open %s\n", path);
+        return 1;
+    }
+    jpegStats *stats = getJpegStats(path, imgFile);  // closes file on failiure
+    if (stats == NULL) {
+        return 1;
+    }
+    scannerSniffPayload(imgFile, stats, fileSize, header);
+    fclose(imgFile);
+    destroyJpegStats(stats);
+    return 0;
+}
+
+/**
+ * runBatch() job: sniffs one file and prints its line if it holds a payload
+ */
+static int sniffJob(size_t index, void *context) {
+    sniffJobs *jobs = context;
+    payloadHeader header;
+    phaseTimer timer;
+    timerBegin(&timer, "sniff", jobs->files[index]);
+    int result = sniffFile(jobs, index, &header);
+    timerEnd(&timer);
+    if (header.version == 0) {
+        return result;
+    }
+
+    char line[SNIFF_LINE_SIZE];
+    snprintf(line, sizeof(line), "%s\t%llu bytes\tpart %d of %d%s%s",
+             jobs->files[index], header.length, header.sequence + 1,
+             header.total,
+             header.flags & PAYLOAD_CHECKSUM ? "\tcrc32c" : "",
+             header.flags & PAYLOAD_CHECKPOINTS ? "\tcheckpoints" : "");
+    flockfile(stdout);  // keep lines from different threads whole
+    fputs(line, stdout);
+    fputc('\n', stdout);
+    funlockfile(stdout);
+    return result;
+}
+
+int sniffPath(char *path, int threadCount) {
+    sniffJobs jobs;
+    size_t fileCount;
+    if (collectJpegFiles(path, &jobs.files, &fileCount)) {
+        return 1;
+    }
+    jobs.prefetch = prefetchFiles(jobs.files, fileCount, SNIFF_READ_SIZE);
+    if (jobs.prefetch == NULL) {
+        puts("ERROR: cannot start reading files");
+        destroyFileList(jobs.files, fileCount);
+        return 1;
+    }
+    size_t failures = runBatch(fileCount, threadCount, sniffJob, &jobs);
+    destroyPrefetch(jobs.prefetch);
+    destroyFileList(jobs.files, fileCount);
+    return failures != 0;
+}
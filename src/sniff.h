@@ -0,0 +1,14 @@
+#ifndef __CSTEG_SNIFF__
+#define __CSTEG_SNIFF__
+
+#define SNIFF_LINE_SIZE 4096  // max length of one line of sniff output
+
+/*
+ * Prints the path and payload header of every JPEG file found under path (a
+ * file or directory) that holds a framed payload, using threadCount threads.
+ * Only the first MCUs of each scan are decoded. Returns 0 if every file could
+ * be sniffed
+ */
+int sniffPath(char *path, int threadCount);
+
+#endif
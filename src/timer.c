@@ -0,0 +1,195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+
+#define NANOS_PER_SECOND 1000000000ULL
+#define NANOS_PER_MICRO 1000ULL
+#define INITIAL_EVENT_CAPACITY 64
+
+/**
+ * A single recorded phase or counter sample
+ */
+typedef struct traceEvent {
+    const char *name;
+    char *detail;  // owned copy of phaseTimer's detail, may be NULL
+    int threadId;
+    char isCounter;  // 1 if value holds a counter sample, 0 if a phase
+    unsigned long long start;  // ns since first event
+    unsigned long long wall;   // ns, phases only
+    unsigned long long cpu;    // ns, phases only
+    long long value;           // counters only
+} traceEvent;
+
+static int enabled = 0;
+static unsigned long long epoch = 0;  // monotonic time of timerEnable()
+static traceEvent *events = NULL;
+static size_t eventCount = 0;
+static size_t eventCapacity = 0;
+static pthread_mutex_t eventLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nextThreadId = 1;
+static _Thread_local int threadId = 0;  // 0 until thread records something
+
+/**
+ * Returns the current value of clock in nanoseconds
+ */
+static unsigned long long readClock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (unsigned long long)now.tv_sec * NANOS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * Returns a small, stable id for the calling thread
+ */
+static int getThreadId() {
+    if (threadId == 0) {
+        threadId = __atomic_fetch_add(&nextThreadId, 1, __ATOMIC_RELAXED);
+    }
+    return threadId;
+}
+
+void timerEnable() {
+    if (!enabled) {
+        epoch = readClock(CLOCK_MONOTONIC);
+        enabled = 1;
+    }
+}
+
+int timerEnabled() {
+    return enabled;
+}
+
+/**
+ * Appends event to the list of recorded events, dropping it if no memory
+ * could be obtained
+ */
+static void recordEvent(traceEvent *event) {
+    pthread_mutex_lock(&eventLock);
+    if (eventCount == eventCapacity) {
+        size_t newCapacity = eventCapacity ? 2*eventCapacity :
+                             INITIAL_EVENT_CAPACITY;
+        traceEvent *grown = realloc(events, newCapacity * sizeof(traceEvent));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&eventLock);
+            free(event->detail);
+            return;
+        }
+        events = grown;
+        eventCapacity = newCapacity;
+    }
+    events[eventCount++] = *event;
+    pthread_mutex_unlock(&eventLock);
+}
+
+void timerBegin(phaseTimer *timer, const char *name, const char *detail) {
+    timer->name = name;
+    timer->detail = detail;
+    if (!enabled) {
+        return;
+    }
+    timer->cpuStart = readClock(CLOCK_THREAD_CPUTIME_ID);
+    timer->wallStart = readClock(CLOCK_MONOTONIC);
+}
+
+void timerEnd(phaseTimer *timer) {
+    if (!enabled) {
+        return;
+    }
+    unsigned long long wallEnd = readClock(CLOCK_MONOTONIC);
+    unsigned long long cpuEnd = readClock(CLOCK_THREAD_CPUTIME_ID);
+
+    traceEvent event = {0};
+    event.name = timer->name;
+    event.detail = timer->detail ? strdup(timer->detail) : NULL;
+    event.threadId = getThreadId();
+    event.start = timer->wallStart - epoch;
+    event.wall = wallEnd - timer->wallStart;
+    event.cpu = cpuEnd - timer->cpuStart;
+    recordEvent(&event);
+}
+
+void timerCounter(const char *name, long long value) {
+    if (!enabled) {
+        return;
+    }
+    traceEvent event = {0};
+    event.name = name;
+    event.threadId = getThreadId();
+    event.isCounter = 1;
+    event.start = readClock(CLOCK_MONOTONIC) - epoch;
+    event.value = value;
+    recordEvent(&event);
+}
+
+/**
+ * Writes s to out as the contents of a JSON string, escaping as needed
+ */
+static void writeJsonString(FILE *out, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+}
+
+int timerWriteTrace(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        printf("ERROR opening trace file %s\n", path);
+        return 1;
+    }
+
+    pthread_mutex_lock(&eventLock);
+    fputs("{\"traceEvents\":[\n", out);
+    for (size_t i = 0; i < eventCount; i++) {
+        traceEvent *e = &events[i];
+        fputs("{\"name\":\"", out);
+        writeJsonString(out, e->name);
+        if (e->isCounter) {
+            fprintf(out, "\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"value\":%lld}}",
+                    e->threadId, (double)e->start / NANOS_PER_MICRO, e->value);
+        } else {
+            fprintf(out, "\",\"cat\":\"csteg\",\"ph\":\"X\",\"pid\":1,"
+                    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"cpu_us\":%.3f",
+                    e->threadId, (double)e->start / NANOS_PER_MICRO,
+                    (double)e->wall / NANOS_PER_MICRO,
+                    (double)e->cpu / NANOS_PER_MICRO);
+            if (e->detail != NULL) {
+                fputs(",\"detail\":\"", out);
+                writeJsonString(out, e->detail);
+                fputc('"', out);
+            }
+            fputs("}}", out);
+        }
+        fputs(i + 1 < eventCount ? ",\n" : "\n", out);
+    }
+    fputs("],\"displayTimeUnit\":\"ms\"}\n", out);
+    pthread_mutex_unlock(&eventLock);
+
+    return fclose(out) != 0;
+}
+
+void timerPrintSummary() {
+    pthread_mutex_lock(&eventLock);
+    for (size_t i = 0; i < eventCount; i++) {
+        traceEvent *e = &events[i];
+        if (e->isCounter) {
+            printf("COUNTER %-12s %lld\n", e->name, e->value);
+        } else {
+            printf("PHASE   %-12s wall: %10.3f ms  cpu: %10.3f ms\n", e->name,
+                   (double)e->wall / 1e6, (double)e->cpu / 1e6);
+        }
+    }
+    pthread_mutex_unlock(&eventLock);
+}
@@ -0,0 +1,53 @@
+#ifndef __PHASE_TIMER__
+#define __PHASE_TIMER__
+
+/*
+ * Low-overhead phase timers. Each phase records its wall-clock duration
+ * (monotonic clock) and the CPU time consumed by the calling thread. Recorded
+ * phases can be exported as a Chrome trace-event JSON file (chrome://tracing,
+ * Perfetto). Timers are no-ops until timerEnable() is called.
+ */
+typedef struct phaseTimer {
+    const char *name;          // name of phase, must outlive the timer
+    const char *detail;        // optional extra info (e.g. file path) or NULL
+    unsigned long long wallStart;  // monotonic time at timerBegin (ns)
+    unsigned long long cpuStart;   // thread CPU time at timerBegin (ns)
+} phaseTimer;
+
+/*
+ * Turns recording on for the rest of the process
+ */
+void timerEnable();
+
+/*
+ * Returns 1 if timers are recording and 0 otherwise
+ */
+int timerEnabled();
+
+/*
+ * Starts timing phase name for the calling thread. detail may be NULL
+ */
+void timerBegin(phaseTimer*, const char *name, const char *detail);
+
+/*
+ * Stops timer and records its phase
+ */
+void timerEnd(phaseTimer*);
+
+/*
+ * Records a named counter value at the current time
+ */
+void timerCounter(const char *name, long long value);
+
+/*
+ * Writes all recorded phases to the file path as Chrome trace-event JSON.
+ * Returns 0 on success and 1 otherwise
+ */
+int timerWriteTrace(const char *path);
+
+/*
+ * Prints a one line wall/cpu summary of every recorded phase to stdout
+ */
+void timerPrintSummary();
+
+#endif
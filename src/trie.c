@@ -1,7 +1,11 @@
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "trie.h"
 #include "csteg.h"
 #include "fifo.h"
+#include "hash.h"
+#include "arena.h"
 #ifdef TESTING
     #include <assert.h>
 #endif
@@ -15,21 +19,296 @@
 struct dhtTrie { 
     unsigned char value;           // value obtained by going down DHT trie strucutre if isEmpty is false
     unsigned char isEmpty;         // if 0 this is a leaf node.
+    unsigned char isShared;        // if 1 this is the root of a cached table
     struct dhtTrie *one;           // node obtained by going through one branch
     struct dhtTrie *zero;          // node obtained by going through zero branch
+    arena *nodes;                  // arena all nodes of the table come from,
+                                   // only set on the root
+    dhtLookupEntry *lookups[2];    // DC and AC lookup entries of a root,
+                                   // NULL until first used
+};
+
+#define TRIE_ARENA_BLOCK_SIZE 16384  // fits the nodes of most tables
+
+/*
+ * Process-wide cache of tables built so far, keyed by the raw bytes (16 code
+ * counts followed by the symbols) of their DHT entry. Tables in the cache
+ * live until the process ends and are shared by every image and thread.
+ */
+typedef struct dhtCacheEntry {
+    unsigned long long hash;  // fnv1a64 of bytes
+    size_t length;
+    unsigned char *bytes;
+    dhtTrie *trie;
+} dhtCacheEntry;
+
+static dhtCacheEntry dhtCache[DHT_CACHE_SIZE];
+static int dhtCacheCount = 0;
+static pthread_rwlock_t dhtCacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The four example tables of ITU T.81 Annex K (K.3 to K.6), which most
+ * encoders use as they are. Their tries are laid out at compile time, node by
+ * node in breadth first order, with the same shape buildDhtTrie() gives them
+ * (checked when TESTING), so images using them need no building, hashing or
+ * locking at all.
+ */
+#define LEAF(v) {v, 0, 1, NULL, NULL, NULL}
+#define EMPTY {0, 1, 1, NULL, NULL, NULL}
+#define NODE(zero, one) {0, 1, 1, &TABLE[one], &TABLE[zero], NULL}
+
+#define TABLE annexKLumaDc
+static dhtTrie annexKLumaDc[] = {
+    NODE(1, 2), NODE(3, 4), NODE(5, 6), LEAF(0x00), NODE(7, 8), NODE(9, 10),
+    NODE(11, 12), LEAF(0x01), LEAF(0x02), LEAF(0x03), LEAF(0x04), LEAF(0x05),
+    NODE(13, 14), LEAF(0x06), NODE(15, 16), LEAF(0x07), NODE(17, 18),
+    LEAF(0x08), NODE(19, 20), LEAF(0x09), NODE(21, 22), LEAF(0x0a),
+    NODE(23, 24), LEAF(0x0b), EMPTY,
+};
+#undef TABLE
+
+#define TABLE annexKChromaDc
+static dhtTrie annexKChromaDc[] = {
+    NODE(1, 2), NODE(3, 4), NODE(5, 6), LEAF(0x00), LEAF(0x01), LEAF(0x02),
+    NODE(7, 8), LEAF(0x03), NODE(9, 10), LEAF(0x04), NODE(11, 12), LEAF(0x05),
+    NODE(13, 14), LEAF(0x06), NODE(15, 16), LEAF(0x07), NODE(17, 18),
+    LEAF(0x08), NODE(19, 20), LEAF(0x09), NODE(21, 22), LEAF(0x0a),
+    NODE(23, 24), LEAF(0x0b), EMPTY,
+};
+#undef TABLE
+
+#define TABLE annexKLumaAc
+static dhtTrie annexKLumaAc[] = {
+    NODE(1, 2), NODE(3, 4), NODE(5, 6), LEAF(0x01), LEAF(0x02), NODE(7, 8),
+    NODE(9, 10), LEAF(0x03), NODE(11, 12), NODE(13, 14), NODE(15, 16),
+    LEAF(0x00), LEAF(0x04), LEAF(0x11), NODE(17, 18), NODE(19, 20),
+    NODE(21, 22), LEAF(0x05), LEAF(0x12), LEAF(0x21), NODE(23, 24),
+    NODE(25, 26), NODE(27, 28), LEAF(0x31), LEAF(0x41), NODE(29, 30),
+    NODE(31, 32), NODE(33, 34), NODE(35, 36), LEAF(0x06), LEAF(0x13),
+    LEAF(0x51), LEAF(0x61), NODE(37, 38), NODE(39, 40), NODE(41, 42),
+    NODE(43, 44), LEAF(0x07), LEAF(0x22), LEAF(0x71), NODE(45, 46),
+    NODE(47, 48), NODE(49, 50), NODE(51, 52), NODE(53, 54), LEAF(0x14),
+    LEAF(0x32), LEAF(0x81), LEAF(0x91), LEAF(0xa1), NODE(55, 56), NODE(57, 58),
+    NODE(59, 60), NODE(61, 62), NODE(63, 64), LEAF(0x08), LEAF(0x23),
+    LEAF(0x42), LEAF(0xb1), LEAF(0xc1), NODE(65, 66), NODE(67, 68),
+    NODE(69, 70), NODE(71, 72), NODE(73, 74), LEAF(0x15), LEAF(0x52),
+    LEAF(0xd1), LEAF(0xf0), NODE(75, 76), NODE(77, 78), NODE(79, 80),
+    NODE(81, 82), NODE(83, 84), NODE(85, 86), LEAF(0x24), LEAF(0x33),
+    LEAF(0x62), LEAF(0x72), NODE(87, 88), NODE(89, 90), NODE(91, 92),
+    NODE(93, 94), NODE(95, 96), NODE(97, 98), NODE(99, 100), NODE(101, 102),
+    NODE(103, 104), NODE(105, 106), NODE(107, 108), NODE(109, 110),
+    NODE(111, 112), NODE(113, 114), NODE(115, 116), NODE(117, 118),
+    NODE(119, 120), NODE(121, 122), NODE(123, 124), NODE(125, 126),
+    NODE(127, 128), NODE(129, 130), NODE(131, 132), NODE(133, 134),
+    NODE(135, 136), NODE(137, 138), NODE(139, 140), NODE(141, 142),
+    NODE(143, 144), NODE(145, 146), NODE(147, 148), NODE(149, 150),
+    NODE(151, 152), NODE(153, 154), NODE(155, 156), NODE(157, 158),
+    NODE(159, 160), NODE(161, 162), NODE(163, 164), NODE(165, 166),
+    NODE(167, 168), NODE(169, 170), NODE(171, 172), NODE(173, 174),
+    NODE(175, 176), NODE(177, 178), NODE(179, 180), NODE(181, 182),
+    NODE(183, 184), NODE(185, 186), NODE(187, 188), NODE(189, 190),
+    NODE(191, 192), NODE(193, 194), NODE(195, 196), NODE(197, 198), LEAF(0x82),
+    NODE(199, 200), NODE(201, 202), NODE(203, 204), NODE(205, 206),
+    NODE(207, 208), NODE(209, 210), NODE(211, 212), NODE(213, 214),
+    NODE(215, 216), NODE(217, 218), NODE(219, 220), NODE(221, 222),
+    NODE(223, 224), NODE(225, 226), NODE(227, 228), NODE(229, 230),
+    NODE(231, 232), NODE(233, 234), NODE(235, 236), NODE(237, 238),
+    NODE(239, 240), NODE(241, 242), NODE(243, 244), NODE(245, 246),
+    NODE(247, 248), NODE(249, 250), NODE(251, 252), NODE(253, 254),
+    NODE(255, 256), NODE(257, 258), NODE(259, 260), NODE(261, 262),
+    NODE(263, 264), NODE(265, 266), NODE(267, 268), NODE(269, 270),
+    NODE(271, 272), NODE(273, 274), NODE(275, 276), NODE(277, 278),
+    NODE(279, 280), NODE(281, 282), NODE(283, 284), NODE(285, 286),
+    NODE(287, 288), NODE(289, 290), NODE(291, 292), NODE(293, 294),
+    NODE(295, 296), NODE(297, 298), NODE(299, 300), NODE(301, 302),
+    NODE(303, 304), NODE(305, 306), NODE(307, 308), NODE(309, 310),
+    NODE(311, 312), NODE(313, 314), NODE(315, 316), NODE(317, 318),
+    NODE(319, 320), NODE(321, 322), NODE(323, 324), LEAF(0x09), LEAF(0x0a),
+    LEAF(0x16), LEAF(0x17), LEAF(0x18), LEAF(0x19), LEAF(0x1a), LEAF(0x25),
+    LEAF(0x26), LEAF(0x27), LEAF(0x28), LEAF(0x29), LEAF(0x2a), LEAF(0x34),
+    LEAF(0x35), LEAF(0x36), LEAF(0x37), LEAF(0x38), LEAF(0x39), LEAF(0x3a),
+    LEAF(0x43), LEAF(0x44), LEAF(0x45), LEAF(0x46), LEAF(0x47), LEAF(0x48),
+    LEAF(0x49), LEAF(0x4a), LEAF(0x53), LEAF(0x54), LEAF(0x55), LEAF(0x56),
+    LEAF(0x57), LEAF(0x58), LEAF(0x59), LEAF(0x5a), LEAF(0x63), LEAF(0x64),
+    LEAF(0x65), LEAF(0x66), LEAF(0x67), LEAF(0x68), LEAF(0x69), LEAF(0x6a),
+    LEAF(0x73), LEAF(0x74), LEAF(0x75), LEAF(0x76), LEAF(0x77), LEAF(0x78),
+    LEAF(0x79), LEAF(0x7a), LEAF(0x83), LEAF(0x84), LEAF(0x85), LEAF(0x86),
+    LEAF(0x87), LEAF(0x88), LEAF(0x89), LEAF(0x8a), LEAF(0x92), LEAF(0x93),
+    LEAF(0x94), LEAF(0x95), LEAF(0x96), LEAF(0x97), LEAF(0x98), LEAF(0x99),
+    LEAF(0x9a), LEAF(0xa2), LEAF(0xa3), LEAF(0xa4), LEAF(0xa5), LEAF(0xa6),
+    LEAF(0xa7), LEAF(0xa8), LEAF(0xa9), LEAF(0xaa), LEAF(0xb2), LEAF(0xb3),
+    LEAF(0xb4), LEAF(0xb5), LEAF(0xb6), LEAF(0xb7), LEAF(0xb8), LEAF(0xb9),
+    LEAF(0xba), LEAF(0xc2), LEAF(0xc3), LEAF(0xc4), LEAF(0xc5), LEAF(0xc6),
+    LEAF(0xc7), LEAF(0xc8), LEAF(0xc9), LEAF(0xca), LEAF(0xd2), LEAF(0xd3),
+    LEAF(0xd4), LEAF(0xd5), LEAF(0xd6), LEAF(0xd7), LEAF(0xd8), LEAF(0xd9),
+    LEAF(0xda), LEAF(0xe1), LEAF(0xe2), LEAF(0xe3), LEAF(0xe4), LEAF(0xe5),
+    LEAF(0xe6), LEAF(0xe7), LEAF(0xe8), LEAF(0xe9), LEAF(0xea), LEAF(0xf1),
+    LEAF(0xf2), LEAF(0xf3), LEAF(0xf4), LEAF(0xf5), LEAF(0xf6), LEAF(0xf7),
+    LEAF(0xf8), LEAF(0xf9), LEAF(0xfa), EMPTY,
+};
+#undef TABLE
+
+#define TABLE annexKChromaAc
+static dhtTrie annexKChromaAc[] = {
+    NODE(1, 2), NODE(3, 4), NODE(5, 6), LEAF(0x00), LEAF(0x01), NODE(7, 8),
+    NODE(9, 10), LEAF(0x02), NODE(11, 12), NODE(13, 14), NODE(15, 16),
+    LEAF(0x03), LEAF(0x11), NODE(17, 18), NODE(19, 20), NODE(21, 22),
+    NODE(23, 24), LEAF(0x04), LEAF(0x05), LEAF(0x21), LEAF(0x31), NODE(25, 26),
+    NODE(27, 28), NODE(29, 30), NODE(31, 32), LEAF(0x06), LEAF(0x12),
+    LEAF(0x41), LEAF(0x51), NODE(33, 34), NODE(35, 36), NODE(37, 38),
+    NODE(39, 40), LEAF(0x07), LEAF(0x61), LEAF(0x71), NODE(41, 42),
+    NODE(43, 44), NODE(45, 46), NODE(47, 48), NODE(49, 50), LEAF(0x13),
+    LEAF(0x22), LEAF(0x32), LEAF(0x81), NODE(51, 52), NODE(53, 54),
+    NODE(55, 56), NODE(57, 58), NODE(59, 60), NODE(61, 62), LEAF(0x08),
+    LEAF(0x14), LEAF(0x42), LEAF(0x91), LEAF(0xa1), LEAF(0xb1), LEAF(0xc1),
+    NODE(63, 64), NODE(65, 66), NODE(67, 68), NODE(69, 70), NODE(71, 72),
+    LEAF(0x09), LEAF(0x23), LEAF(0x33), LEAF(0x52), LEAF(0xf0), NODE(73, 74),
+    NODE(75, 76), NODE(77, 78), NODE(79, 80), NODE(81, 82), LEAF(0x15),
+    LEAF(0x62), LEAF(0x72), LEAF(0xd1), NODE(83, 84), NODE(85, 86),
+    NODE(87, 88), NODE(89, 90), NODE(91, 92), NODE(93, 94), LEAF(0x0a),
+    LEAF(0x16), LEAF(0x24), LEAF(0x34), NODE(95, 96), NODE(97, 98),
+    NODE(99, 100), NODE(101, 102), NODE(103, 104), NODE(105, 106),
+    NODE(107, 108), NODE(109, 110), NODE(111, 112), NODE(113, 114),
+    NODE(115, 116), NODE(117, 118), NODE(119, 120), NODE(121, 122),
+    NODE(123, 124), NODE(125, 126), NODE(127, 128), NODE(129, 130),
+    NODE(131, 132), NODE(133, 134), NODE(135, 136), NODE(137, 138),
+    NODE(139, 140), NODE(141, 142), LEAF(0xe1), NODE(143, 144), NODE(145, 146),
+    NODE(147, 148), NODE(149, 150), NODE(151, 152), NODE(153, 154),
+    NODE(155, 156), NODE(157, 158), NODE(159, 160), NODE(161, 162),
+    NODE(163, 164), NODE(165, 166), NODE(167, 168), NODE(169, 170),
+    NODE(171, 172), NODE(173, 174), NODE(175, 176), NODE(177, 178),
+    NODE(179, 180), NODE(181, 182), NODE(183, 184), NODE(185, 186),
+    NODE(187, 188), NODE(189, 190), NODE(191, 192), NODE(193, 194),
+    NODE(195, 196), NODE(197, 198), NODE(199, 200), NODE(201, 202),
+    NODE(203, 204), LEAF(0x25), LEAF(0xf1), NODE(205, 206), NODE(207, 208),
+    NODE(209, 210), NODE(211, 212), NODE(213, 214), NODE(215, 216),
+    NODE(217, 218), NODE(219, 220), NODE(221, 222), NODE(223, 224),
+    NODE(225, 226), NODE(227, 228), NODE(229, 230), NODE(231, 232),
+    NODE(233, 234), NODE(235, 236), NODE(237, 238), NODE(239, 240),
+    NODE(241, 242), NODE(243, 244), NODE(245, 246), NODE(247, 248),
+    NODE(249, 250), NODE(251, 252), NODE(253, 254), NODE(255, 256),
+    NODE(257, 258), NODE(259, 260), NODE(261, 262), NODE(263, 264),
+    NODE(265, 266), NODE(267, 268), NODE(269, 270), NODE(271, 272),
+    NODE(273, 274), NODE(275, 276), NODE(277, 278), NODE(279, 280),
+    NODE(281, 282), NODE(283, 284), NODE(285, 286), NODE(287, 288),
+    NODE(289, 290), NODE(291, 292), NODE(293, 294), NODE(295, 296),
+    NODE(297, 298), NODE(299, 300), NODE(301, 302), NODE(303, 304),
+    NODE(305, 306), NODE(307, 308), NODE(309, 310), NODE(311, 312),
+    NODE(313, 314), NODE(315, 316), NODE(317, 318), NODE(319, 320),
+    NODE(321, 322), NODE(323, 324), LEAF(0x17), LEAF(0x18), LEAF(0x19),
+    LEAF(0x1a), LEAF(0x26), LEAF(0x27), LEAF(0x28), LEAF(0x29), LEAF(0x2a),
+    LEAF(0x35), LEAF(0x36), LEAF(0x37), LEAF(0x38), LEAF(0x39), LEAF(0x3a),
+    LEAF(0x43), LEAF(0x44), LEAF(0x45), LEAF(0x46), LEAF(0x47), LEAF(0x48),
+    LEAF(0x49), LEAF(0x4a), LEAF(0x53), LEAF(0x54), LEAF(0x55), LEAF(0x56),
+    LEAF(0x57), LEAF(0x58), LEAF(0x59), LEAF(0x5a), LEAF(0x63), LEAF(0x64),
+    LEAF(0x65), LEAF(0x66), LEAF(0x67), LEAF(0x68), LEAF(0x69), LEAF(0x6a),
+    LEAF(0x73), LEAF(0x74), LEAF(0x75), LEAF(0x76), LEAF(0x77), LEAF(0x78),
+    LEAF(0x79), LEAF(0x7a), LEAF(0x82), LEAF(0x83), LEAF(0x84), LEAF(0x85),
+    LEAF(0x86), LEAF(0x87), LEAF(0x88), LEAF(0x89), LEAF(0x8a), LEAF(0x92),
+    LEAF(0x93), LEAF(0x94), LEAF(0x95), LEAF(0x96), LEAF(0x97), LEAF(0x98),
+    LEAF(0x99), LEAF(0x9a), LEAF(0xa2), LEAF(0xa3), LEAF(0xa4), LEAF(0xa5),
+    LEAF(0xa6), LEAF(0xa7), LEAF(0xa8), LEAF(0xa9), LEAF(0xaa), LEAF(0xb2),
+    LEAF(0xb3), LEAF(0xb4), LEAF(0xb5), LEAF(0xb6), LEAF(0xb7), LEAF(0xb8),
+    LEAF(0xb9), LEAF(0xba), LEAF(0xc2), LEAF(0xc3), LEAF(0xc4), LEAF(0xc5),
+    LEAF(0xc6), LEAF(0xc7), LEAF(0xc8), LEAF(0xc9), LEAF(0xca), LEAF(0xd2),
+    LEAF(0xd3), LEAF(0xd4), LEAF(0xd5), LEAF(0xd6), LEAF(0xd7), LEAF(0xd8),
+    LEAF(0xd9), LEAF(0xda), LEAF(0xe2), LEAF(0xe3), LEAF(0xe4), LEAF(0xe5),
+    LEAF(0xe6), LEAF(0xe7), LEAF(0xe8), LEAF(0xe9), LEAF(0xea), LEAF(0xf2),
+    LEAF(0xf3), LEAF(0xf4), LEAF(0xf5), LEAF(0xf6), LEAF(0xf7), LEAF(0xf8),
+    LEAF(0xf9), LEAF(0xfa), EMPTY,
+};
+#undef TABLE
+
+static const unsigned char annexKLumaDcBytes[] = {
+    0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b,
+};
+
+static const unsigned char annexKChromaDcBytes[] = {
+    0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b,
+};
+
+static const unsigned char annexKLumaAcBytes[] = {
+    0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04,
+    0x00, 0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32,
+    0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a,
+    0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55,
+    0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85,
+    0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2,
+    0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8,
+    0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const unsigned char annexKChromaAcBytes[] = {
+    0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04,
+    0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21,
+    0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81,
+    0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17,
+    0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38,
+    0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54,
+    0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83,
+    0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96,
+    0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9,
+    0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6,
+    0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+    0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+#undef LEAF
+#undef EMPTY
+#undef NODE
+
+typedef struct staticDhtTrie {
+    const unsigned char *bytes;  // DHT entry: code counts, then symbols
+    size_t length;
+    dhtTrie *trie;
+} staticDhtTrie;
+
+static const staticDhtTrie annexKTables[] = {
+    {annexKLumaDcBytes, sizeof(annexKLumaDcBytes), annexKLumaDc},
+    {annexKChromaDcBytes, sizeof(annexKChromaDcBytes), annexKChromaDc},
+    {annexKLumaAcBytes, sizeof(annexKLumaAcBytes), annexKLumaAc},
+    {annexKChromaAcBytes, sizeof(annexKChromaAcBytes), annexKChromaAc},
 };
 
 /**
- * Frees memory allocated in heap to dhtTrie struct
+ * Returns the Annex K table whose DHT entry is bytes (of given length), or
+ * NULL if it is not one of them
+ */
+dhtTrie* findStaticDhtTrie(const unsigned char *bytes, size_t length) {
+    for (size_t i = 0; i < sizeof(annexKTables) / sizeof(*annexKTables); i++) {
+        if (annexKTables[i].length == length &&
+            memcmp(annexKTables[i].bytes, bytes, length) == 0) {
+            return annexKTables[i].trie;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Frees memory allocated in heap to the table rooted at t, unless it is owned
+ * by the table cache. All of its nodes go at once with their arena
  */
 void destroyDhtTrie(dhtTrie *t) {
-    if(t == NULL) {
+    if(t == NULL || t->isShared) {
         return;
     }
 
-    destroyDhtTrie(t->one);
-    destroyDhtTrie(t->zero);
-    free(t);
+    free(t->lookups[0]);
+    free(t->lookups[1]);
+    destroyArena(t->nodes);
 }
 
 /*TODO: try to do this and add to create fuction*/
@@ -39,9 +318,8 @@ void pruneDhtTrie(dhtTrie* root) {
     }
 
     if (!root->isEmpty) {
-        destroyDhtTrie(root->zero);
+        // Unreachable nodes are freed with the arena of the table
         root->zero = NULL;
-        destroyDhtTrie(root->one);
         root->one = NULL;
     } else {
         pruneDhtTrie(root->zero);
@@ -62,43 +340,46 @@ void destroyDhts(dhts* d) {
 }
 
 /**
- * Creates a dhtTrie structure, returning its pointer
+ * Creates a dhtTrie structure in nodes, returning its pointer, or NULL on
+ * failiure
  */ 
-dhtTrie* initNode() {
-    dhtTrie *root = (dhtTrie*)malloc(sizeof(dhtTrie));
+dhtTrie* initNode(arena *nodes) {
+    dhtTrie *root = (dhtTrie*)arenaAlloc(nodes, sizeof(dhtTrie));
+    if (root == NULL) {
+        return NULL;
+    }
     root->isEmpty = 1;
+    root->isShared = 0;
     root->zero = NULL;
     root->one = NULL;
+    root->nodes = NULL;
+    root->lookups[0] = NULL;
+    root->lookups[1] = NULL;
     return root;
 }
 
 /**
- * Constructs a single Huffman table from jpegFile corresponding to the data 
- * jpegFile's curssor is pointing to. Every byte read from jpegFile corresponds
- * to an increase of *bytesProcessed
- * 
- * Assumes that jpegFile cursor is positioned right at the first of the 16 bytes
- * indicated the number of symbols per bit length
+ * Constructs a single Huffman table from the raw bytes of its DHT entry:
+ * elementsPerDepth ([i] == number of values encoded with i+1 bits) followed by
+ * the values themselves, in data
  */
-dhtTrie* createDhtTrie(FILE* jpegFile, unsigned short *bytesProcessed) {
-    unsigned char elementsPerDepth[16]; // [i] == number of values 
-                                        // encoded with i+1 bits.
-    fread(elementsPerDepth, 1, 16, jpegFile);
-    *bytesProcessed += 16;
-    // Initialize array of values/symbols
-    size_t dataLength = 0;
-    for (int i = 0; i < 16; i++) {
-        dataLength += elementsPerDepth[i];
-    }
-    char* data = malloc(dataLength);
-    fread(data, 1, dataLength, jpegFile);
-    *bytesProcessed += dataLength;
-
+dhtTrie* buildDhtTrie(const unsigned char *elementsPerDepth,
+                      const unsigned char *data) {
     int indexOfData = 0; // number of elements of data read so far
+    int codeCount = 0;   // number of elements of data in the whole table
+    for (int i = 0; i < DHT_COUNTS_LENGTH; i++) {
+        codeCount += elementsPerDepth[i];
+    }
     // Use remaining data to construct trie structure
-    dhtTrie *root = initNode();
-    root->zero = initNode();
-    root->one = initNode();
+    arena *nodes = arenaInit(TRIE_ARENA_BLOCK_SIZE);
+    dhtTrie *root = nodes == NULL ? NULL : initNode(nodes);
+    if (root == NULL ||
+        (root->zero = initNode(nodes)) == NULL ||
+        (root->one = initNode(nodes)) == NULL) {
+        destroyArena(nodes);
+        return NULL;
+    }
+    root->nodes = nodes;
     // init queue of nodes to place new elements into or expand out
     fifo *nodeQueue = fifoInit();
     fifoAppend(nodeQueue, (void*)root->zero);
@@ -114,12 +395,15 @@ dhtTrie* createDhtTrie(FILE* jpegFile, unsigned short *bytesProcessed) {
     for(unsigned char bucket = 0; bucket < 16; bucket++) {
         dhtTrie* tempNode;
         // Place list of values into appropriate nodes
-        for(char i = 0; i < elementsPerDepth[bucket]; i++) {
+        for(int i = 0; i < elementsPerDepth[bucket]; i++) {
             if (fifoRemove(nodeQueue, (void**)&tempNode) != 0) { // failed
-                // TODO: Add more stuff here, like freeing stuff
+                // Empty the queue so it can be freed
+                void* dumpBuffer = NULL;
+                while (getFifoLength(nodeQueue) > 0) {
+                    fifoRemove(nodeQueue, &dumpBuffer);
+                }
                 destroyDhtTrie(root);
                 destroyFifo(nodeQueue);
-                free(data);
                 return NULL;
             }
 
@@ -128,13 +412,24 @@ dhtTrie* createDhtTrie(FILE* jpegFile, unsigned short *bytesProcessed) {
             indexOfData++;
         }
 
+        // Nodes deeper than the longest code would only be pruned again
+        if (indexOfData == codeCount) {
+            break;
+        }
          // Expand nodes at current depth that don't have a value
         int nodesToExpand = getFifoLength(nodeQueue);
         for(int i = 0; i < nodesToExpand; i++) {
             fifoRemove(nodeQueue, (void**)&tempNode);
-            tempNode->zero = initNode();
+            tempNode->zero = initNode(nodes);
+            tempNode->one = initNode(nodes);
+            if (tempNode->zero == NULL || tempNode->one == NULL) {
+                // Make the next removal fail and clean up as above
+                while (getFifoLength(nodeQueue) > 0) {
+                    fifoRemove(nodeQueue, (void**)&tempNode);
+                }
+                break;
+            }
             fifoAppend(nodeQueue, (void*)tempNode->zero);
-            tempNode->one = initNode();
             fifoAppend(nodeQueue, (void*)tempNode->one);
         }
     }
@@ -145,14 +440,118 @@ dhtTrie* createDhtTrie(FILE* jpegFile, unsigned short *bytesProcessed) {
         fifoRemove(nodeQueue, &dumpBuffer);
     }
     destroyFifo(nodeQueue);
-
-    free(data);
     
     // Remove unneeded nodes from tree
     pruneDhtTrie(root); // Get rid of unneeded nodes
     return root;
 }
 
+/**
+ * Returns the cached table whose DHT entry is bytes (of given length and
+ * hash), or NULL if there is none. Assumes caller holds dhtCacheLock
+ */
+dhtTrie* findCachedDhtTrie(const unsigned char *bytes, size_t length,
+                           unsigned long long hash) {
+    for (int i = 0; i < dhtCacheCount; i++) {
+        if (dhtCache[i].hash == hash && dhtCache[i].length == length &&
+            memcmp(dhtCache[i].bytes, bytes, length) == 0) {
+            return dhtCache[i].trie;
+        }
+    }
+    return NULL;
+}
+
+#ifdef TESTING
+/**
+ * Returns 1 if tries a and b hold the same codes and 0 otherwise
+ */
+static int sameDhtTrie(dhtTrie *a, dhtTrie *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+    return a->isEmpty == b->isEmpty &&
+           (a->isEmpty || a->value == b->value) &&
+           sameDhtTrie(a->zero, b->zero) && sameDhtTrie(a->one, b->one);
+}
+#endif
+
+/**
+ * Returns the table for the DHT entry bytes (of given length), taking it
+ * from the table cache or building it and adding it to the cache.
+ */
+dhtTrie* getDhtTrie(const unsigned char *bytes, size_t length) {
+    dhtTrie *annexK = findStaticDhtTrie(bytes, length);
+    if (annexK != NULL) {
+        #ifdef TESTING
+            dhtTrie *built = buildDhtTrie(bytes, &bytes[DHT_COUNTS_LENGTH]);
+            assert(sameDhtTrie(annexK, built));
+            destroyDhtTrie(built);
+        #endif
+        return annexK;
+    }
+
+    unsigned long long hash = fnv1a64(bytes, length, FNV_OFFSET_BASIS);
+    pthread_rwlock_rdlock(&dhtCacheLock);
+    dhtTrie *trie = findCachedDhtTrie(bytes, length, hash);
+    pthread_rwlock_unlock(&dhtCacheLock);
+    if (trie != NULL) {
+        return trie;
+    }
+
+    // Build outside of the lock so other threads are not held up
+    trie = buildDhtTrie(bytes, &bytes[DHT_COUNTS_LENGTH]);
+    if (trie == NULL) {
+        return NULL;
+    }
+    pthread_rwlock_wrlock(&dhtCacheLock);
+    dhtTrie *cached = findCachedDhtTrie(bytes, length, hash);
+    if (cached != NULL) {
+        // Another thread added the same table first
+        pthread_rwlock_unlock(&dhtCacheLock);
+        destroyDhtTrie(trie);
+        return cached;
+    }
+    unsigned char *copy = NULL;
+    if (dhtCacheCount < DHT_CACHE_SIZE && (copy = malloc(length)) != NULL) {
+        memcpy(copy, bytes, length);
+        dhtCacheEntry entry = {hash, length, copy, trie};
+        dhtCache[dhtCacheCount++] = entry;
+        trie->isShared = 1;
+    }
+    // Else cache is full, so caller owns table like before
+    pthread_rwlock_unlock(&dhtCacheLock);
+    return trie;
+}
+
+/**
+ * Reads a single Huffman table from jpegFile corresponding to the data 
+ * jpegFile's curssor is pointing to. Every byte read from jpegFile corresponds
+ * to an increase of *bytesProcessed
+ * 
+ * Assumes that jpegFile cursor is positioned right at the first of the 16 bytes
+ * indicated the number of symbols per bit length
+ */
+dhtTrie* createDhtTrie(FILE* jpegFile, unsigned short *bytesProcessed) {
+    // Code counts followed by at most 255 values per code length
+    unsigned char bytes[DHT_COUNTS_LENGTH + DHT_COUNTS_LENGTH * 255];
+    if (fread(bytes, 1, DHT_COUNTS_LENGTH, jpegFile) != DHT_COUNTS_LENGTH) {
+        return NULL;
+    }
+    *bytesProcessed += DHT_COUNTS_LENGTH;
+    // Initialize array of values/symbols
+    size_t dataLength = 0;
+    for (int i = 0; i < DHT_COUNTS_LENGTH; i++) {
+        dataLength += bytes[i];
+    }
+    if (fread(&bytes[DHT_COUNTS_LENGTH], 1, dataLength, jpegFile) !=
+        dataLength) {
+        return NULL;
+    }
+    *bytesProcessed += dataLength;
+
+    return getDhtTrie(bytes, DHT_COUNTS_LENGTH + dataLength);
+}
+
 /**
  * Returns length of DHT segment, or 0 if jpegFile cursor is not located right
  * in front of the start of a DHT segment when this function is called
@@ -211,7 +610,6 @@ int buildDhts(FILE *jpegFile, dhts *tables) {
     // Make sure this is a DHT segment and get length of segment
     unsigned short segmentLength = getLengthOfDHTSegment(jpegFile);
     if (segmentLength == 0) {
-        destroyDhts(tables);
         return 1;
     }
 
@@ -219,7 +617,6 @@ int buildDhts(FILE *jpegFile, dhts *tables) {
     while (bytesProcessed < segmentLength) {
         if (tables->tablesLeftToMake == 0) {
             printf("ERROR: TOO MANY TABLES");
-            destroyDhts(tables);
             return 1;
         }
         // Get index to place table in tables->tables
@@ -238,13 +635,11 @@ int buildDhts(FILE *jpegFile, dhts *tables) {
             tables->tables[index] != NULL) {
             printf("ERROR: Invalid Huffman Table id values: %d %d\n",
                     tableId, discreteOrAlternating);
-            destroyDhts(tables);
             return 1;
         }
         
         dhtTrie *tempNode = createDhtTrie(jpegFile, &bytesProcessed);
         if(!tempNode) {
-            destroyDhts(tables);
             return 1;
          } else {
              tables->tables[index] = tempNode;
@@ -298,3 +693,58 @@ dhtTrie* traverseTrie(dhtTrie* t, char bit) {
     }
     return bit == 0 ? t->zero : t->one;
 }
+
+/**
+ * Fills entry with the symbols that bits (DHT_LOOKUP_BITS of them) start
+ * with when decoded with the table rooted at root (see dhtLookupEntry)
+ */
+static void fillDhtLookupEntry(dhtTrie *root, unsigned char isAc,
+                               unsigned int bits, dhtLookupEntry *entry) {
+    unsigned char position = 0;  // bits of bits decoded so far
+    entry->count = 0;
+    while (entry->count < DHT_LOOKUP_SYMBOLS) {
+        dhtTrie *node = root;
+        unsigned char codeEnd = position;
+        while (node != NULL && node->isEmpty && codeEnd < DHT_LOOKUP_BITS) {
+            unsigned char bit = bits >> (DHT_LOOKUP_BITS - 1 - codeEnd) & 1;
+            node = traverseTrie(node, bit);
+            codeEnd++;
+        }
+        if (node == NULL || node->isEmpty) {
+            return;  // code longer than what is left of bits or not valid
+        }
+        unsigned char valueBits = isAc ? GET_FIRST_4_BITS(node->value) :
+                                  node->value;
+        entry->values[entry->count] = node->value;
+        entry->codeEnds[entry->count] = codeEnd;
+        entry->ends[entry->count] = codeEnd + valueBits;
+        entry->count++;
+        position = codeEnd + valueBits;
+        if (!isAc || node->value == EOB || position >= DHT_LOOKUP_BITS) {
+            return;
+        }
+    }
+}
+
+const dhtLookupEntry* getDhtLookup(dhtTrie *t, unsigned char isAc) {
+    dhtLookupEntry *lookup = __atomic_load_n(&t->lookups[isAc],
+                                             __ATOMIC_ACQUIRE);
+    if (lookup != NULL) {
+        return lookup;
+    }
+    lookup = malloc(sizeof(dhtLookupEntry) << DHT_LOOKUP_BITS);
+    if (lookup == NULL) {
+        return NULL;
+    }
+    for (unsigned int bits = 0; bits < 1U << DHT_LOOKUP_BITS; bits++) {
+        fillDhtLookupEntry(t, isAc, bits, &lookup[bits]);
+    }
+    // Tables can be shared, so another thread may have built them first
+    dhtLookupEntry *expected = NULL;
+    if (!__atomic_compare_exchange_n(&t->lookups[isAc], &expected, lookup, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(lookup);
+        return expected;
+    }
+    return lookup;
+}
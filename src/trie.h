@@ -28,6 +28,35 @@ unsigned char getValue(dhtTrie*);
  */
 dhtTrie* traverseTrie(dhtTrie*, char);
 
+#define DHT_LOOKUP_BITS 9     // bits of scan data probed per lookup
+#define DHT_LOOKUP_SYMBOLS 3  // most symbols decoded by a single probe
+
+/**
+ * What the DHT_LOOKUP_BITS bits of scan data used as its index decode to:
+ * the first count symbols found in them, each followed by its value bits.
+ * A symbol is included when its code fits in those bits, even if its value
+ * bits go past them, in which case it is the last one. count is 0 if the
+ * first code is longer than DHT_LOOKUP_BITS or not valid.
+ *
+ * AC entries stop after an EOB, and DC entries hold at most one symbol,
+ * as the coeficients that follow them are coded with another table.
+ */
+typedef struct dhtLookupEntry {
+    unsigned char count;
+    unsigned char values[DHT_LOOKUP_SYMBOLS];    // decoded symbols
+    unsigned char codeEnds[DHT_LOOKUP_SYMBOLS];  // bits up to end of code
+    unsigned char ends[DHT_LOOKUP_SYMBOLS];      // bits up to end of values
+} dhtLookupEntry;
+
+/**
+ * Returns the 1 << DHT_LOOKUP_BITS entries for decoding with the table rooted
+ * at t as an AC table if isAc and as a DC table otherwise, building them on
+ * first use, or NULL on failiure. They live as long as t does
+ */
+const dhtLookupEntry* getDhtLookup(dhtTrie *t, unsigned char isAc);
+
+#define DHT_COUNTS_LENGTH 16  // bytes giving number of codes of each length
+#define DHT_CACHE_SIZE 64  // max number of distinct tables kept process-wide
 #define MAX_NUMBER_OF_TABLES 8  // max number of Huffman tables in a JPG
 #define MAX_NUMBER_OF_TABLES_ALLOWED 6  // We support only YCrCb
                                         // and 2 tables per color channel
@@ -53,6 +82,10 @@ int buildDhts(FILE*, dhts*);
  */
 void destroyDhts(dhts*);
 
+/**
+ * Frees a table, unless it is shared through the process-wide table cache,
+ * in which case it stays alive for later images.
+ */
 void destroyDhtTrie(dhtTrie *t);
 
 #endif
\ No newline at end of file
@@ -5,6 +5,17 @@ IMG_COPIES = 'imgCoppies'
 ORIG_IMGS_DIR = 'imgs'
 ORIG_MSSG_SOURCE = 'mssg.txt'
 EXTRACTED_MSSG_FILE = 'extracted_messages.txt'
+PAYLOAD_FILE = IMG_COPIES + '/payload.bin'
+REASSEMBLED_FILE = IMG_COPIES + '/reassembled.bin'
+CRAFTED_MSSG_FILE = IMG_COPIES + '/crafted.txt'
+COPIED_MSSG_FILE = IMG_COPIES + '/extracted.txt'
+FLIPPED_MSSG_FILE = IMG_COPIES + '/flipped.txt'
+UPDATED_MSSG_FILE = IMG_COPIES + '/updated.txt'
+
+# Framed header claiming a payload of 2^64 - 1 bytes (see src/payload.h),
+# with no 0 byte so -w hides all of it
+CORRUPT_LENGTH_HEADER = (b'\x89CSG' + b'\x01\x02' + b'\x01\x01' +
+                         b'\x01\x01' + b'\xFF' * 8 + b'ABCD' + b'A' * 64)
 
 class TestCsteg(unittest.TestCase):
     def assertMessageMatch(self):
@@ -15,12 +26,46 @@ class TestCsteg(unittest.TestCase):
         
         return self.assertEqual(original_message, extracted_message)
 
-    def test_writing_and_reading(self):
+    def assertFileMatch(self, path, content):
+        with open(path, 'rb') as f:
+            return self.assertEqual(f.read(), content)
+
+    def resetCopies(self):
         if os.path.isdir(IMG_COPIES):
-            result = os.system('sudo rm -r ' + IMG_COPIES)
+            result = os.system('rm -r ' + IMG_COPIES)
             self.assertEqual(result, 0)
         os.mkdir(IMG_COPIES)
 
+    def copyBaselineImages(self):
+        """Copies the baseline images into imgCoppies, returning their paths"""
+        self.resetCopies()
+        imgs = sorted(img for img in os.listdir(ORIG_IMGS_DIR)
+                      if img.startswith('baseline'))
+        for img in imgs:
+            result = os.system('cp {}/{} {}/'.format(ORIG_IMGS_DIR, img,
+                                                     IMG_COPIES))
+            self.assertEqual(result, 0)
+        return [IMG_COPIES + '/' + img for img in imgs]
+
+    def splitPayload(self, imgs, length):
+        """Hides length random bytes over imgs, returning them"""
+        payload = os.urandom(length)
+        with open(PAYLOAD_FILE, 'wb') as f:
+            f.write(payload)
+        result = os.system('csteg.bin -W {} {}'.format(PAYLOAD_FILE,
+                                                       ' '.join(imgs)))
+        self.assertEqual(result, 0)
+        return payload
+
+    def capacity(self, img, options=''):
+        """Returns the capacity -c prints for img, in bytes"""
+        output = os.popen('csteg.bin {} -c {}'.format(options, img)).read()
+        return int(output.split('MAX MESSAGE SIZE OF {}: '.format(img))[1]
+                   .split(' bytes')[0])
+
+    def test_writing_and_reading(self):
+        self.resetCopies()
+
         imgs = os.listdir(ORIG_IMGS_DIR)
         for i in range(len(imgs)):
             with self.subTest(i=i):
@@ -39,6 +84,382 @@ class TestCsteg(unittest.TestCase):
                 # Make sure original and read messages match
                 self.assertMessageMatch()
 
+    def test_splitting_and_reassembling(self):
+        imgs = self.copyBaselineImages()
+        # Long enough to need a part in every image
+        payload = self.splitPayload(imgs, 2000)
+
+        # Parts may be given in any order
+        result = os.system('csteg.bin -R {} {}'.format(REASSEMBLED_FILE,
+            ' '.join(reversed(imgs))))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(REASSEMBLED_FILE, payload)
+
+    def test_reassembling_missing_part(self):
+        imgs = self.copyBaselineImages()
+        self.splitPayload(imgs, 2000)
+
+        result = os.system('csteg.bin -R {} {}'.format(REASSEMBLED_FILE,
+            ' '.join(imgs[:1] + imgs[2:])))
+        self.assertEqual(result, 0)
+        self.assertFalse(os.path.exists(REASSEMBLED_FILE))
+
+    def test_reassembling_duplicated_part(self):
+        imgs = self.copyBaselineImages()
+        self.splitPayload(imgs, 2000)
+
+        result = os.system('csteg.bin -R {} {}'.format(REASSEMBLED_FILE,
+            ' '.join(imgs[:1] + imgs)))
+        self.assertEqual(result, 0)
+        self.assertFalse(os.path.exists(REASSEMBLED_FILE))
+
+    def test_reading_corrupt_length(self):
+        img = self.copyBaselineImages()[0]
+        with open(CRAFTED_MSSG_FILE, 'wb') as f:
+            f.write(CORRUPT_LENGTH_HEADER)
+        result = os.system('csteg.bin -w {} {}'.format(img, CRAFTED_MSSG_FILE))
+        self.assertEqual(result, 0)
+
+        # The header must be rejected before its length is allocated
+        for command in ['-r {} {}', '--offset=0 --length=16 -r {} {}',
+                        '-R {1} {0}']:
+            with self.subTest(command=command):
+                result = os.system('csteg.bin ' + command.format(img,
+                    COPIED_MSSG_FILE))
+                self.assertEqual(result, 0)
+                self.assertFalse(os.path.exists(COPIED_MSSG_FILE))
+
+    def test_checksum_catches_flipped_bit(self):
+        img = self.copyBaselineImages()[0]
+        other = IMG_COPIES + '/flipped.jpg'
+        result = os.system('cp {} {}'.format(img, other))
+        self.assertEqual(result, 0)
+        # Same message but for the lowest bit of one byte near its end
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            message = f.read()
+        flipped = message[:-10] + bytes([message[-10] ^ 1]) + message[-9:]
+        with open(FLIPPED_MSSG_FILE, 'wb') as f:
+            f.write(flipped)
+        result = os.system('csteg.bin --crc -w {} {}'.format(img,
+            ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin --crc -w {} {}'.format(other,
+            FLIPPED_MSSG_FILE))
+        self.assertEqual(result, 0)
+
+        # The scans differ in the checksum near their start and in the byte
+        # holding the flipped bit, so taking only the last one from the
+        # other image flips a single payload bit under the same checksum
+        with open(img, 'rb') as f:
+            hidden = f.read()
+        with open(other, 'rb') as f:
+            damaged = f.read()
+        self.assertEqual(len(hidden), len(damaged))
+        diffs = [i for i in range(len(hidden)) if hidden[i] != damaged[i]]
+        self.assertLess(diffs[0], diffs[-1])
+        last = diffs[-1]
+        with open(img, 'wb') as f:
+            f.write(hidden[:last] + damaged[last:last + 1] + hidden[last + 1:])
+
+        result = os.system('csteg.bin -r {} {}'.format(img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFalse(os.path.exists(COPIED_MSSG_FILE))
+
+        # Ranges short of the whole payload are not checked, and show the flip
+        result = os.system('csteg.bin --offset=0 --length={} -r {} {}'.format(
+            len(message) - 1, img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, flipped[:-1])
+
+    def test_updating(self):
+        img = self.copyBaselineImages()[0]
+        result = os.system('csteg.bin -w {} {}'.format(img, ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+
+        # The new message replaces the old one, however much shorter
+        updated = b'An updated message, shorter than the first one.'
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(updated)
+        result = os.system('csteg.bin -u {} {}'.format(img, UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin -r {} {}'.format(img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, updated)
+
+        # A message too long to fit leaves the image as it was
+        with open(img, 'rb') as f:
+            before = f.read()
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(b'x' * len(before))
+        result = os.system('csteg.bin -u {} {}'.format(img, UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(img, before)
+
+    def test_progressive(self):
+        # Progressive (SOF2) image with restart markers in every scan, and
+        # EOB runs and ZRLs in its AC scans
+        self.resetCopies()
+        img = IMG_COPIES + '/progressive_rst.jpg'
+        result = os.system('cp {}/progressive_rst.jpg {}'.format(
+            ORIG_IMGS_DIR, img))
+        self.assertEqual(result, 0)
+
+        # -c must count exactly the slots -w hides in
+        capacity = self.capacity(img)
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            text = f.read()
+        message = (text * (capacity // len(text) + 1))[:capacity]
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(message)
+        result = os.system('csteg.bin -w {} {}'.format(img, UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin -r {} {}'.format(img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, message)
+
+        # The image is hidden in as it is, not converted to baseline
+        with open(img, 'rb') as f:
+            self.assertIn(b'\xff\xc2', f.read())
+
+    def test_cache(self):
+        img = self.copyBaselineImages()[0]
+        capacity = self.capacity(img)
+        self.assertEqual(self.capacity(img, '--cache'), capacity)
+        self.assertTrue(os.path.exists(img + '.cstegidx'))
+
+        # Hides and reads take the positions of the cached entry
+        result = os.system('csteg.bin --cache -w {} {}'.format(img,
+            ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin --cache -r {}'.format(img))
+        self.assertEqual(result, 0)
+        self.assertMessageMatch()
+        self.assertEqual(self.capacity(img, '--cache'), capacity)
+
+    def test_cache_of_changed_image(self):
+        img = self.copyBaselineImages()[2]
+        with open(img, 'rb') as f:
+            original = f.read()
+        result = os.system('csteg.bin --cache -c {}'.format(img))
+        self.assertEqual(result, 0)
+
+        # Change the image where the entry cannot see it: this hide adds and
+        # removes as many stuff-bytes, so the length and scan offset stay
+        # the same, but the slots between them move
+        with open(CRAFTED_MSSG_FILE, 'wb') as f:
+            f.write(b'~' * 80)
+        result = os.system('csteg.bin -w {} {}'.format(img, CRAFTED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        with open(img, 'rb') as f:
+            changed = f.read()
+        self.assertEqual(len(changed), len(original))
+        self.assertNotEqual(changed, original)
+
+        # Its content hash no longer matches the entry, which must not be used
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            updated = f.read() * 2
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(updated)
+        result = os.system('csteg.bin --cache -w {} {}'.format(img,
+            UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin -r {} {}'.format(img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, updated)
+        os.remove(COPIED_MSSG_FILE)
+        result = os.system('csteg.bin --cache -r {} {}'.format(img,
+            COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, updated)
+
+    def test_channels(self):
+        img = self.copyBaselineImages()[0]
+        # Luminance blocks add to the capacity of the chroma ones
+        capacity = self.capacity(img)
+        self.assertGreater(self.capacity(img, '--channels=y,cb,cr'), capacity)
+        self.assertLess(self.capacity(img, '--channels=cb'), capacity)
+
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            message = f.read() * 5
+        self.assertGreater(len(message), capacity)
+        self.assertLess(len(message), self.capacity(img, '--channels=y,cb'))
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(message)
+        result = os.system('csteg.bin --channels=y,cb -w {} {}'.format(img,
+            UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin --channels=y,cb -r {} {}'.format(img,
+            COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, message)
+
+        # Other channels hold other bits
+        os.remove(COPIED_MSSG_FILE)
+        result = os.system('csteg.bin -r {} {}'.format(img, COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        with open(COPIED_MSSG_FILE, 'rb') as f:
+            self.assertNotEqual(f.read(), message)
+
+    def test_cache_of_channels(self):
+        img = self.copyBaselineImages()[0]
+        cacheDir = IMG_COPIES + '/cache'
+        os.mkdir(cacheDir)
+        capacities = {}
+        for channels in ['cb,cr', 'y,cb,cr']:
+            capacities[channels] = self.capacity(img,
+                '--channels=' + channels)
+
+        # Each set of channels gets an entry of its own in a directory, and
+        # a sidecar entry of other channels is never used
+        for cache in ['--cache', '--cache=' + cacheDir]:
+            for repeat in range(2):
+                for channels in capacities:
+                    with self.subTest(cache=cache, channels=channels):
+                        self.assertEqual(self.capacity(img,
+                            '{} --channels={}'.format(cache, channels)),
+                            capacities[channels])
+        self.assertEqual(len(os.listdir(cacheDir)), len(capacities))
+
+    def test_adding_restart_markers(self):
+        img = self.copyBaselineImages()[0]
+        capacity = self.capacity(img)
+        with open(img, 'rb') as f:
+            self.assertNotIn(b'\xff\xdd', f.read())
+        result = os.system('csteg.bin -t {}'.format(img))
+        self.assertEqual(result, 0)
+
+        # The scan is the same once decoded, so are its slots
+        with open(img, 'rb') as f:
+            self.assertIn(b'\xff\xdd', f.read())
+        self.assertEqual(self.capacity(img), capacity)
+        result = os.system('csteg.bin -w {} {}'.format(img, ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin -r {}'.format(img))
+        self.assertEqual(result, 0)
+        self.assertMessageMatch()
+
+    def test_adding_restart_markers_to_progressive(self):
+        self.resetCopies()
+        img = IMG_COPIES + '/progressive_rst.jpg'
+        result = os.system('cp {}/progressive_rst.jpg {}'.format(
+            ORIG_IMGS_DIR, img))
+        self.assertEqual(result, 0)
+        with open(img, 'rb') as f:
+            before = f.read()
+        result = os.system('csteg.bin -t {}'.format(img))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(img, before)
+
+    def test_streaming(self):
+        # Scans longer than the 1 MiB window, which slides as they decode
+        self.resetCopies()
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            text = f.read()
+        for name in ['stream_420_rst.jpg', 'stream_444.jpg']:
+            img = IMG_COPIES + '/' + name
+            result = os.system('cp {}/{} {}'.format(ORIG_IMGS_DIR, name, img))
+            self.assertEqual(result, 0)
+            capacity = self.capacity(img)
+            self.assertEqual(self.capacity(img, '--stream'), capacity)
+
+            # Messages fill the image, leaving framed ones room for their
+            # header and checkpoints, so bits are hidden and checked on both
+            # sides of a slide
+            for options, length in [('', capacity),
+                                    ('--verify', capacity),
+                                    ('--framed --crc', capacity - 500)]:
+                with self.subTest(img=name, options=options):
+                    result = os.system('cp {}/{} {}'.format(ORIG_IMGS_DIR,
+                                                            name, img))
+                    self.assertEqual(result, 0)
+                    message = (text * (length // len(text) + 1))[:length]
+                    with open(UPDATED_MSSG_FILE, 'wb') as f:
+                        f.write(message)
+                    result = os.system('csteg.bin --stream {} -w {} {}'.format(
+                        options, img, UPDATED_MSSG_FILE))
+                    self.assertEqual(result, 0)
+                    for read in ['--stream', '']:
+                        if os.path.exists(COPIED_MSSG_FILE):
+                            os.remove(COPIED_MSSG_FILE)
+                        result = os.system('csteg.bin {} -r {} {}'.format(
+                            read, img, COPIED_MSSG_FILE))
+                        self.assertEqual(result, 0)
+                        self.assertFileMatch(COPIED_MSSG_FILE, message)
+
+            # Scattered payloads take the slots of both sides of a slide too
+            result = os.system('cp {}/{} {}'.format(ORIG_IMGS_DIR, name, img))
+            self.assertEqual(result, 0)
+            with open(img, 'rb') as f:
+                before = f.read()
+            result = os.system('csteg.bin --stream --key=secret -w {} {}'.format(
+                img, ORIG_MSSG_SOURCE))
+            self.assertEqual(result, 0)
+            with open(img, 'rb') as f:
+                self.assertNotEqual(f.read(), before)
+            for read in ['--stream', '']:
+                if os.path.exists(COPIED_MSSG_FILE):
+                    os.remove(COPIED_MSSG_FILE)
+                result = os.system('csteg.bin {} --key=secret -r {} {}'.format(
+                    read, img, COPIED_MSSG_FILE))
+                self.assertEqual(result, 0)
+                self.assertFileMatch(COPIED_MSSG_FILE, text)
+
+    def test_key(self):
+        img = self.copyBaselineImages()[0]
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            message = f.read()
+        result = os.system('csteg.bin --key=secret -w {} {}'.format(img,
+            ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+        result = os.system('csteg.bin --key=secret -r {} {}'.format(img,
+            COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, message)
+
+        # Another key, or none, reads other slots
+        for key in ['--key=other', '']:
+            with self.subTest(key=key):
+                os.remove(COPIED_MSSG_FILE)
+                result = os.system('csteg.bin {} -r {} {}'.format(key, img,
+                    COPIED_MSSG_FILE))
+                self.assertEqual(result, 0)
+                if os.path.exists(COPIED_MSSG_FILE):
+                    with open(COPIED_MSSG_FILE, 'rb') as f:
+                        self.assertNotEqual(f.read(), message)
+
+        # The new message replaces the old one, however much shorter
+        updated = b'An updated message, shorter than the first one.'
+        with open(UPDATED_MSSG_FILE, 'wb') as f:
+            f.write(updated)
+        result = os.system('csteg.bin --key=secret -u {} {}'.format(img,
+            UPDATED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        os.remove(COPIED_MSSG_FILE)
+        result = os.system('csteg.bin --key=secret -r {} {}'.format(img,
+            COPIED_MSSG_FILE))
+        self.assertEqual(result, 0)
+        self.assertFileMatch(COPIED_MSSG_FILE, updated)
+
+    def test_key_with_range(self):
+        img = self.copyBaselineImages()[0]
+        with open(ORIG_MSSG_SOURCE, 'rb') as f:
+            message = f.read()
+        result = os.system('csteg.bin --key=secret --framed --crc -w {} {}'
+            .format(img, ORIG_MSSG_SOURCE))
+        self.assertEqual(result, 0)
+
+        # Ranges are cut from the whole payload, which is checked
+        for offset, length in [(0, len(message)), (100, 250),
+                               (len(message) - 7, 7)]:
+            with self.subTest(offset=offset, length=length):
+                if os.path.exists(COPIED_MSSG_FILE):
+                    os.remove(COPIED_MSSG_FILE)
+                result = os.system('csteg.bin --key=secret --offset={} '
+                    '--length={} -r {} {}'.format(offset, length, img,
+                    COPIED_MSSG_FILE))
+                self.assertEqual(result, 0)
+                self.assertFileMatch(COPIED_MSSG_FILE,
+                    message[offset:offset + length])
+
 if __name__ == '__main__':
     unittest.main()
-